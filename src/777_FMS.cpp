@@ -6,18 +6,39 @@
 enum FMS_constants
 {
 	N_MAX_DATABUS_QUEUE_PROC = 1024,
+	DATABUS_TIME_BUDGET_US = 500,
+	DATABUS_METRICS_LOG_INTERVAL_SEC = 60,
 	N_CUSTOM_STR_DR_LENGTH = 2048,
-	NAV_REF_ICAO_BUF_LENGTH = 5
+	NAV_REF_ICAO_BUF_LENGTH = 5,
+	RTE_IN_BUF_LENGTH = 512,
+	FPL_NAME_BUF_LENGTH = 64
+};
+
+const char* FMC_SHM_NAME = "/Strato_777_FMC";
+const char* DATABUS_REC_FILE_NAME = "Strato_777_databus.rec";
+
+// Exported for home cockpit CDU drivers. See shm_layout.h
+std::vector<std::string> shm_datarefs = {
+	"Strato/777/FMC/line_1_big",
+	"Strato/777/FMC/line_2_big",
+	"Strato/777/FMC/line_3_big",
+	"Strato/777/FMC/line_4_big",
+	"Strato/777/FMC/line_5_big",
+	"Strato/777/FMC/line_6_big",
+	"Strato/777/FMC/line_7_big",
+	"Strato/777/FMC/FMC_R/scratchpad_msg"
 };
 
 #ifndef XPLM400
 	#error This is made to be compiled against the XPLM400 SDK
 #endif
 
-std::vector<int> int_dr_values = { 0, 0 };
+std::vector<int> int_dr_values = { 0, 0, 0, 0, 0, REF_NAV_DATA, 0, 0, 0, 0 };
 std::vector<double> double_dr_values = { 0, 0, 0, 0 };
 char nav_ref_in_icao[NAV_REF_ICAO_BUF_LENGTH];
 char nav_ref_out_icao[NAV_REF_ICAO_BUF_LENGTH];
+char rte_in[RTE_IN_BUF_LENGTH];
+char fpl_name[FPL_NAME_BUF_LENGTH];
 char fmc_line_1_big[24];
 char fmc_line_2_big[24];
 char fmc_line_3_big[24];
@@ -29,7 +50,15 @@ char scratchpad_msg[24];
 
 std::vector<DRUtil::dref_i> int_datarefs = {
 	{{"Strato/777/UI/messages/creating_databases", false, nullptr}, &int_dr_values[0]},
-	{{"Strato/777/FMC/FMC_R/clear_msg", true, nullptr}, &int_dr_values[1]}
+	{{"Strato/777/FMC/FMC_R/clear_msg", true, nullptr}, &int_dr_values[1]},
+	{{"Strato/777/databus/record", true, nullptr}, &int_dr_values[2]}, // Set to 1 to record data bus traffic
+	{{"Strato/777/navdata/reload", true, nullptr}, &int_dr_values[3]}, // Set to 1 to reload nav data without restarting the sim
+	{{"Strato/777/FMC/FMC_R/fpl_io", false, nullptr}, &int_dr_values[4]}, // 1 while a .fms file is read or written, 0 when done, -1 on failure
+	{{"Strato/777/FMC/FMC_R/page", true, nullptr}, &int_dr_values[5]}, // One of fmc_pages
+	{{"Strato/777/FMC/FMC_R/exec", true, nullptr}, &int_dr_values[6]},
+	{{"Strato/777/FMC/FMC_R/erase", true, nullptr}, &int_dr_values[7]},
+	{{"Strato/777/FMC/FMC_R/fpl_load", true, nullptr}, &int_dr_values[8]},
+	{{"Strato/777/FMC/FMC_R/fpl_save", true, nullptr}, &int_dr_values[9]}
 };
 
 std::vector<DRUtil::dref_d> double_datarefs = {
@@ -42,6 +71,8 @@ std::vector<DRUtil::dref_d> double_datarefs = {
 std::vector<DRUtil::dref_s> str_datarefs = {
 	{{"Strato/777/FMC/FMC_R/REF_NAV/input_icao", true, nullptr}, nav_ref_in_icao, NAV_REF_ICAO_BUF_LENGTH},
 	{{"Strato/777/FMC/FMC_R/REF_NAV/out_icao", false, nullptr}, nav_ref_out_icao, NAV_REF_ICAO_BUF_LENGTH},
+	{{"Strato/777/FMC/FMC_R/RTE/input_route", true, nullptr}, rte_in, RTE_IN_BUF_LENGTH},
+	{{"Strato/777/FMC/FMC_R/fpl_name", true, nullptr}, fpl_name, FPL_NAME_BUF_LENGTH},
 	{{"Strato/777/FMC/line_1_big", false, nullptr}, fmc_line_1_big, 24},
 	{{"Strato/777/FMC/line_2_big", false, nullptr}, fmc_line_2_big, 24},
 	{{"Strato/777/FMC/line_3_big", false, nullptr}, fmc_line_3_big, 24},
@@ -63,7 +94,14 @@ std::shared_ptr<std::thread> fmc_thread;
 
 StratosphereAvionics::fmc_in_drs fmc_in = { 
 											"Strato/777/FMC/FMC_R/REF_NAV/input_icao",
-											"Strato/777/FMC/FMC_R/clear_msg"
+											"Strato/777/FMC/FMC_R/clear_msg",
+											"Strato/777/FMC/FMC_R/page",
+											"Strato/777/FMC/FMC_R/RTE/input_route",
+											"Strato/777/FMC/FMC_R/exec",
+											"Strato/777/FMC/FMC_R/erase",
+											"Strato/777/FMC/FMC_R/fpl_name",
+											"Strato/777/FMC/FMC_R/fpl_load",
+											"Strato/777/FMC/FMC_R/fpl_save"
 										  };
 StratosphereAvionics::fmc_out_drs fmc_out = { 
 											  "Strato/777/FMC/FMC_R/REF_NAV/out_icao",
@@ -71,7 +109,16 @@ StratosphereAvionics::fmc_out_drs fmc_out = {
 											  "Strato/777/FMC/FMC_R/REF_NAV/poi_lon", 
 											  "Strato/777/FMC/FMC_R/REF_NAV/poi_elev",
 											  "Strato/777/FMC/FMC_R/REF_NAV/poi_freq",
-											  "Strato/777/FMC/FMC_R/scratchpad_msg"
+											  "Strato/777/FMC/FMC_R/scratchpad_msg",
+											  {
+												"Strato/777/FMC/line_1_big",
+												"Strato/777/FMC/line_2_big",
+												"Strato/777/FMC/line_3_big",
+												"Strato/777/FMC/line_4_big",
+												"Strato/777/FMC/line_5_big",
+												"Strato/777/FMC/line_6_big",
+												"Strato/777/FMC/line_7_big"
+											  }
 											};
 
 int data_refs_created = 0;
@@ -125,6 +172,45 @@ void unregister_data_refs()
 float FMS_init_FLCB(float elapsedMe, float elapsedSim, int counter, void* refcon)
 {
 	sim_databus = std::make_shared<XPDataBus::DataBus>(&data_refs, N_MAX_DATABUS_QUEUE_PROC);
+	sim_databus->set_coalescing(true);
+	sim_databus->set_time_budget(DATABUS_TIME_BUDGET_US);
+	sim_databus->enable_metrics("Strato/777/databus/", DATABUS_METRICS_LOG_INTERVAL_SEC);
+	if (!sim_databus->export_data_refs(FMC_SHM_NAME, &shm_datarefs))
+	{
+		XPLMDebugString("777_FMS: Failed to export CDU datarefs to shared memory\n");
+	}
+	for (size_t i = 0; i < int_datarefs.size(); i++)
+	{
+		if (int_datarefs.at(i).dr.is_writable)
+		{
+			int_datarefs.at(i).on_write = XPDataBus::DataBus::on_custom_data_ref_write;
+			int_datarefs.at(i).on_write_ref = sim_databus.get();
+		}
+	}
+	for (size_t i = 0; i < str_datarefs.size(); i++)
+	{
+		if (str_datarefs.at(i).dr.is_writable)
+		{
+			str_datarefs.at(i).on_write = XPDataBus::DataBus::on_custom_data_ref_write;
+			str_datarefs.at(i).on_write_ref = sim_databus.get();
+		}
+	}
+	sim_databus->watch_data_ref("Strato/777/databus/record", [](XPDataBus::generic_val* val)
+		{
+			// Watches are called from the flight loop, so it's safe to start recording here.
+			if (val->int_val)
+			{
+				std::string path = sim_databus->prefs_path + DATABUS_REC_FILE_NAME;
+				if (!sim_databus->start_recording(path))
+				{
+					XPLMDebugString("777_FMS: Failed to start recording data bus traffic\n");
+				}
+			}
+			else
+			{
+				sim_databus->stop_recording();
+			}
+		});
 	avionics = std::make_shared<StratosphereAvionics::AvionicsSys>(sim_databus);
 	fmc_l = std::make_shared<StratosphereAvionics::FMC>(avionics, &fmc_in, &fmc_out);
 	avionics_thread = std::make_shared<std::thread>([]()
@@ -161,16 +247,26 @@ PLUGIN_API void	XPluginStop(void)
 	if (data_refs_created)
 	{
 		XPLMDebugString("777_FMS: Disabling\n");
+		std::chrono::steady_clock::time_point stop_start = std::chrono::steady_clock::now();
 		avionics->sim_shutdown.store(true, std::memory_order_seq_cst);
 		fmc_l->sim_shutdown.store(true, std::memory_order_seq_cst);
 		sim_databus->cleanup();
 		fmc_thread->join();
 		avionics_thread->join();
+		XPLMDebugString(avionics->sched.get_summary().c_str());
+		XPLMDebugString(fmc_l->sched.get_summary().c_str());
 		unregister_data_refs();
 		fmc_thread.reset();
+		avionics_thread.reset();
+		// The FMC holds a reference to the avionics, so it goes first. ~AvionicsSys cancels
+		// the loaders and joins the task pool, so nothing is left running after this.
+		fmc_l.reset();
 		avionics.reset();
 		sim_databus.reset();
-		XPLMDebugString("777_FMS: Successfully disabled.\n");
+		std::chrono::steady_clock::duration stop_time = std::chrono::steady_clock::now() - stop_start;
+		std::string msg = "777_FMS: Successfully disabled in " +
+			std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(stop_time).count()) + " ms.\n";
+		XPLMDebugString(msg.c_str());
 	}
 }
 
@@ -0,0 +1,76 @@
+/*
+	This source file contains definitions of member functions of CDUScreen.
+*/
+
+#include "cdu_screen.h"
+
+
+namespace StratosphereAvionics
+{
+	CDUScreen::CDUScreen(std::shared_ptr<XPDataBus::DataBus> databus, std::vector<std::string>* line_drs)
+	{
+		xp_databus = databus;
+		for (size_t i = 0; i < line_drs->size() && i < CDU_N_LINES; i++)
+		{
+			line_handles.push_back(xp_databus->register_data_ref(line_drs->at(i), DB_PRIORITY_USER));
+		}
+		clear();
+		memset(front_buf, ' ', sizeof(front_buf));
+	}
+
+	void CDUScreen::clear()
+	{
+		memset(back_buf, ' ', sizeof(back_buf));
+	}
+
+	void CDUScreen::write(size_t line, size_t col, std::string text)
+	{
+		if (line >= CDU_N_LINES)
+		{
+			return;
+		}
+		for (size_t i = 0; i < text.size() && col + i < CDU_N_COLUMNS; i++)
+		{
+			back_buf[line][col + i] = text[i];
+		}
+	}
+
+	void CDUScreen::write_right(size_t line, std::string text)
+	{
+		if (text.size() > CDU_N_COLUMNS)
+		{
+			text.erase(CDU_N_COLUMNS);
+		}
+		write(line, CDU_N_COLUMNS - text.size(), text);
+	}
+
+	void CDUScreen::write_centered(size_t line, std::string text)
+	{
+		if (text.size() > CDU_N_COLUMNS)
+		{
+			text.erase(CDU_N_COLUMNS);
+		}
+		write(line, (CDU_N_COLUMNS - text.size()) / 2, text);
+	}
+
+	size_t CDUScreen::publish()
+	{
+		/*
+		* Changed lines are sent whole. With coalescing, the data bus only keeps the
+		* latest set for every offset, so a partial line could drop an earlier one.
+		*/
+		size_t n_sent = 0;
+		for (size_t i = 0; i < line_handles.size(); i++)
+		{
+			if (is_front_valid && !memcmp(back_buf[i], front_buf[i], CDU_N_COLUMNS))
+			{
+				continue;
+			}
+			xp_databus->set_data_s(line_handles[i], std::string(back_buf[i], CDU_N_COLUMNS));
+			memcpy(front_buf[i], back_buf[i], CDU_N_COLUMNS);
+			n_sent++;
+		}
+		is_front_valid = true;
+		return n_sent;
+	}
+}
@@ -0,0 +1,54 @@
+/*
+	This header file contains the declaration of CDUScreen. Pages are drawn into
+	an off-screen buffer every CDU tick. Only the lines that differ from the
+	last published frame are sent to the data bus, so a static page doesn't
+	cost anything.
+*/
+
+#pragma once
+
+#include "databus.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+enum cdu_screen_constants
+{
+	CDU_N_COLUMNS = 24,
+	CDU_N_LINES = 8 // 7 big lines and the scratchpad
+};
+
+
+namespace StratosphereAvionics
+{
+	class CDUScreen
+	{
+	public:
+		// line_drs holds the string dataref of every line of the screen, top to bottom.
+		CDUScreen(std::shared_ptr<XPDataBus::DataBus> databus, std::vector<std::string>* line_drs);
+
+		// Fills the off-screen buffer with spaces.
+		void clear();
+
+		// Writes text to line, starting at column col. Anything past the edge is cut off.
+		void write(size_t line, size_t col, std::string text);
+
+		// Writes text so that it ends at the right edge of the screen.
+		void write_right(size_t line, std::string text);
+
+		void write_centered(size_t line, std::string text);
+
+		// Sends the lines that changed since the last call.
+		// Returns number of lines sent.
+		size_t publish();
+
+	private:
+		std::shared_ptr<XPDataBus::DataBus> xp_databus;
+		std::vector<XPDataBus::dr_handle> line_handles;
+
+		char back_buf[CDU_N_LINES][CDU_N_COLUMNS];
+		char front_buf[CDU_N_LINES][CDU_N_COLUMNS]; // What the datarefs hold
+		bool is_front_valid = false; // The first frame is sent whole
+	};
+}
@@ -0,0 +1,294 @@
+/*
+	This source file contains definitions of member functions of FlightPlan.
+*/
+
+#include "flight_plan.h"
+
+
+namespace StratosphereAvionics
+{
+	size_t FlightPlan::get_n_legs() const
+	{
+		return chunk_starts.back();
+	}
+
+	int FlightPlan::insert_leg(size_t idx, fpl_fix* fix)
+	{
+		if (idx > get_n_legs())
+		{
+			return 0;
+		}
+		if (!chunks.size())
+		{
+			chunks.push_back(std::make_shared<fpl_chunk>());
+			chunks[0]->dist_nm = 0;
+			update_chunk_index();
+		}
+		size_t offset;
+		size_t chunk_idx = find_chunk(idx, &offset);
+		fpl_chunk* chunk = get_writable_chunk(chunk_idx);
+		fpl_leg leg = { *fix, 0, 0, 0 };
+		chunk->legs.insert(chunk->legs.begin() + offset, leg);
+		// The new leg and the one after it are the only ones that change shape
+		update_around(chunk_idx, idx);
+		return 1;
+	}
+
+	int FlightPlan::delete_leg(size_t idx)
+	{
+		if (idx >= get_n_legs())
+		{
+			return 0;
+		}
+		size_t offset;
+		size_t chunk_idx = find_chunk(idx, &offset);
+		fpl_chunk* chunk = get_writable_chunk(chunk_idx);
+		chunk->legs.erase(chunk->legs.begin() + offset);
+		// The next leg now starts at the fix before the deleted one
+		update_around(chunk_idx, idx);
+		return 1;
+	}
+
+	int FlightPlan::modify_leg(size_t idx, fpl_fix* fix)
+	{
+		if (idx >= get_n_legs())
+		{
+			return 0;
+		}
+		size_t offset;
+		size_t chunk_idx = find_chunk(idx, &offset);
+		fpl_chunk* chunk = get_writable_chunk(chunk_idx);
+		chunk->legs[offset].fix = *fix;
+		update_around(chunk_idx, idx);
+		return 1;
+	}
+
+	int FlightPlan::get_leg(size_t idx, fpl_leg* out) const
+	{
+		if (idx >= get_n_legs())
+		{
+			return 0;
+		}
+		size_t offset;
+		size_t chunk_idx = find_chunk(idx, &offset);
+		*out = chunks[chunk_idx]->legs[offset];
+		out->cum_dist_nm += chunk_dists[chunk_idx];
+		return 1;
+	}
+
+	double FlightPlan::get_dist_to_go_nm(size_t idx) const
+	{
+		fpl_leg leg;
+		if (!get_leg(idx, &leg))
+		{
+			return 0;
+		}
+		return get_total_dist_nm() - leg.cum_dist_nm;
+	}
+
+	double FlightPlan::get_total_dist_nm() const
+	{
+		return chunk_dists.back();
+	}
+
+	void FlightPlan::clear()
+	{
+		chunks.clear();
+		update_chunk_index();
+	}
+
+	size_t FlightPlan::resolve(navdb::NavDB* nav_db)
+	{
+		size_t n_not_found = 0;
+		for (size_t i = 0; i < chunks.size(); i++)
+		{
+			fpl_chunk* chunk = get_writable_chunk(i);
+			for (size_t j = 0; j < chunk->legs.size(); j++)
+			{
+				fpl_fix* fix = &chunk->legs[j].fix;
+				// A waypoint mustn't turn into a navaid or an airport with the same id
+				navdb::POI poi;
+				if (!nav_db->get_poi_info(fix->id, fix->type, &poi))
+				{
+					n_not_found++;
+					continue;
+				}
+
+				std::vector<geo::point> candidates;
+				if (poi.type == POI_AIRPORT)
+				{
+					candidates.push_back(poi.arpt.data.pos);
+				}
+				for (size_t k = 0; k < poi.navaid.size(); k++)
+				{
+					candidates.push_back(poi.navaid[k].wpt);
+				}
+				for (size_t k = 0; k < poi.wpt.size(); k++)
+				{
+					candidates.push_back(poi.wpt[k]);
+				}
+
+				// Idents aren't unique, so pick the one that's closest to where the fix was.
+				// If even that one is far away, the fix was removed from the navdata.
+				size_t best = 0;
+				double best_dist = fix->pos.getGreatCircleDistanceNM(candidates[0]);
+				for (size_t k = 1; k < candidates.size(); k++)
+				{
+					double dist = fix->pos.getGreatCircleDistanceNM(candidates[k]);
+					if (dist < best_dist)
+					{
+						best = k;
+						best_dist = dist;
+					}
+				}
+				if (best_dist > FPL_MAX_RESOLVE_DIST_NM)
+				{
+					n_not_found++;
+					continue;
+				}
+				fix->pos = candidates[best];
+			}
+		}
+
+		for (size_t i = 0; i < get_n_legs(); i++)
+		{
+			update_leg_geometry(i);
+		}
+		for (size_t i = 0; i < chunks.size(); i++)
+		{
+			update_chunk_sums(i);
+		}
+		update_chunk_index();
+		return n_not_found;
+	}
+
+	//Private member functions:
+
+	size_t FlightPlan::find_chunk(size_t idx, size_t* offset) const
+	{
+		// The chunk is the last one that starts at or before idx
+		auto it = std::upper_bound(chunk_starts.begin(), chunk_starts.end() - 1, idx);
+		size_t chunk_idx = size_t(it - chunk_starts.begin()) - 1;
+		*offset = idx - chunk_starts[chunk_idx];
+		return chunk_idx;
+	}
+
+	fpl_chunk* FlightPlan::get_writable_chunk(size_t chunk_idx)
+	{
+		if (chunks[chunk_idx].use_count() > 1)
+		{
+			chunks[chunk_idx] = std::make_shared<fpl_chunk>(*chunks[chunk_idx]);
+		}
+		else
+		{
+			// Another plan may have just released the chunk on a different thread.
+			// Make sure its reads are done before the chunk is written to.
+			std::atomic_thread_fence(std::memory_order_acquire);
+		}
+		return chunks[chunk_idx].get();
+	}
+
+	void FlightPlan::update_around(size_t chunk_idx, size_t idx)
+	{
+		update_chunk_index();
+		update_leg_geometry(idx);
+		update_leg_geometry(idx + 1);
+
+		// The legs after idx + 1 keep their sums, since those start at their own chunk.
+		update_chunk_sums(chunk_idx);
+		for (size_t i = idx; i < idx + 2 && i < get_n_legs(); i++)
+		{
+			size_t offset;
+			size_t leg_chunk = find_chunk(i, &offset);
+			if (leg_chunk != chunk_idx)
+			{
+				update_chunk_sums(leg_chunk);
+			}
+		}
+		balance_chunk(chunk_idx);
+		update_chunk_index();
+	}
+
+	void FlightPlan::update_leg_geometry(size_t idx)
+	{
+		if (idx >= get_n_legs())
+		{
+			return;
+		}
+		size_t offset;
+		size_t chunk_idx = find_chunk(idx, &offset);
+		fpl_leg* leg = &get_writable_chunk(chunk_idx)->legs[offset];
+		if (idx == 0)
+		{
+			leg->course_deg = 0;
+			leg->dist_nm = 0;
+			return;
+		}
+		size_t prev_offset;
+		size_t prev_chunk = find_chunk(idx - 1, &prev_offset);
+		geo::point start = chunks[prev_chunk]->legs[prev_offset].fix.pos;
+		leg->dist_nm = start.getGreatCircleDistanceNM(leg->fix.pos);
+		leg->course_deg = start.getGreatCircleBearingDeg(leg->fix.pos);
+		if (leg->course_deg < 0) // Leg goes due north or due south
+		{
+			leg->course_deg = leg->fix.pos.lat_deg >= start.lat_deg ? 0 : 180;
+		}
+	}
+
+	void FlightPlan::update_chunk_sums(size_t chunk_idx)
+	{
+		fpl_chunk* chunk = get_writable_chunk(chunk_idx);
+		double sum = 0;
+		for (size_t i = 0; i < chunk->legs.size(); i++)
+		{
+			sum += chunk->legs[i].dist_nm;
+			chunk->legs[i].cum_dist_nm = sum;
+		}
+		chunk->dist_nm = sum;
+	}
+
+	void FlightPlan::balance_chunk(size_t chunk_idx)
+	{
+		size_t size = chunks[chunk_idx]->legs.size();
+		if (!size)
+		{
+			chunks.erase(chunks.begin() + chunk_idx);
+		}
+		else if (size > FPL_CHUNK_SIZE)
+		{
+			fpl_chunk* chunk = get_writable_chunk(chunk_idx);
+			std::shared_ptr<fpl_chunk> second = std::make_shared<fpl_chunk>();
+			second->legs.assign(chunk->legs.begin() + size / 2, chunk->legs.end());
+			chunk->legs.erase(chunk->legs.begin() + size / 2, chunk->legs.end());
+			chunks.insert(chunks.begin() + chunk_idx + 1, second);
+			update_chunk_sums(chunk_idx);
+			update_chunk_sums(chunk_idx + 1);
+		}
+		else if (size < FPL_MIN_CHUNK_SIZE && chunks.size() > 1)
+		{
+			// Merge with the next chunk or with the previous one if this is the last chunk
+			size_t first = chunk_idx + 1 < chunks.size() ? chunk_idx : chunk_idx - 1;
+			if (chunks[first]->legs.size() + chunks[first + 1]->legs.size() <= FPL_CHUNK_SIZE)
+			{
+				fpl_chunk* chunk = get_writable_chunk(first);
+				const std::vector<fpl_leg>* next = &chunks[first + 1]->legs;
+				chunk->legs.insert(chunk->legs.end(), next->begin(), next->end());
+				chunks.erase(chunks.begin() + first + 1);
+				update_chunk_sums(first);
+			}
+		}
+	}
+
+	void FlightPlan::update_chunk_index()
+	{
+		chunk_starts.resize(chunks.size() + 1);
+		chunk_dists.resize(chunks.size() + 1);
+		chunk_starts[0] = 0;
+		chunk_dists[0] = 0;
+		for (size_t i = 0; i < chunks.size(); i++)
+		{
+			chunk_starts[i + 1] = chunk_starts[i] + chunks[i]->legs.size();
+			chunk_dists[i + 1] = chunk_dists[i] + chunks[i]->dist_nm;
+		}
+	}
+}
@@ -0,0 +1,112 @@
+/*
+	This header file contains the declaration of FlightPlan. It's a list of legs
+	that end at fixes from libnav. Course and distance of every leg are cached,
+	so that an edit only recomputes the legs next to it.
+
+	Legs are kept in chunks that are shared between copies of a plan. Copying a
+	plan only copies the chunk pointers and an edit clones the chunks it touches,
+	so a MOD plan shares everything it didn't change with the active one.
+*/
+
+#pragma once
+
+#include "nav_database.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+
+enum fpl_constants
+{
+	FPL_CHUNK_SIZE = 32, // Chunks that grow past this are split in half
+	FPL_MIN_CHUNK_SIZE = 8, // Chunks that shrink below this are merged with a neighbour
+	FPL_MAX_RESOLVE_DIST_NM = 50 // A fix that moved further than this is a different fix with the same id
+};
+
+
+namespace StratosphereAvionics
+{
+	struct fpl_fix
+	{
+		std::string id;
+		uint8_t type; // One of POI_types
+		geo::point pos;
+	};
+
+	struct fpl_leg
+	{
+		fpl_fix fix;
+		// Leg from the previous fix to this one. Both are 0 for the first leg.
+		double course_deg;
+		double dist_nm;
+		double cum_dist_nm; // Distance from the first fix to the end of this leg
+	};
+
+	struct fpl_chunk
+	{
+		// cum_dist_nm of these legs starts from the beginning of the chunk.
+		std::vector<fpl_leg> legs;
+		double dist_nm;
+	};
+
+	class FlightPlan
+	{
+	public:
+		size_t get_n_legs() const;
+
+		// Inserts a leg to fix before leg idx. idx equal to get_n_legs() appends.
+		// Returns 0 if idx is out of range.
+		int insert_leg(size_t idx, fpl_fix* fix);
+
+		// Returns 0 if idx is out of range.
+		int delete_leg(size_t idx);
+
+		// Replaces the fix at the end of leg idx.
+		// Returns 0 if idx is out of range.
+		int modify_leg(size_t idx, fpl_fix* fix);
+
+		// Returns 0 if idx is out of range.
+		int get_leg(size_t idx, fpl_leg* out) const;
+
+		// Returns distance from the end of leg idx to the last fix.
+		double get_dist_to_go_nm(size_t idx) const;
+
+		double get_total_dist_nm() const;
+
+		void clear();
+
+		// Looks up every fix in nav_db again and moves it to the closest candidate
+		// with the same id and type. Used after the navdata has been reloaded.
+		// Returns number of fixes that weren't found within FPL_MAX_RESOLVE_DIST_NM.
+		// They keep their old position.
+		size_t resolve(navdb::NavDB* nav_db);
+
+	private:
+		// Chunks may be shared with other plans. They are only modified through
+		// get_writable_chunk, which clones a shared chunk first.
+		std::vector<std::shared_ptr<fpl_chunk>> chunks;
+		// Index of the first leg and distance before the first leg of every chunk.
+		// Both have an extra entry at the end with the totals.
+		std::vector<size_t> chunk_starts = { 0 };
+		std::vector<double> chunk_dists = { 0 };
+
+		// Returns index of the chunk that contains leg idx and writes the index
+		// of the leg inside of that chunk to offset.
+		size_t find_chunk(size_t idx, size_t* offset) const;
+
+		fpl_chunk* get_writable_chunk(size_t chunk_idx);
+
+		// Brings everything up to date after leg idx of chunk chunk_idx has been
+		// inserted, deleted or modified.
+		void update_around(size_t chunk_idx, size_t idx);
+
+		void update_leg_geometry(size_t idx);
+
+		void update_chunk_sums(size_t chunk_idx);
+
+		// Splits and merges chunk chunk_idx if its size is out of bounds.
+		void balance_chunk(size_t chunk_idx);
+
+		void update_chunk_index();
+	};
+}
@@ -24,12 +24,64 @@ namespace StratosphereAvionics
 
 		std::string fix_path = xp_databus->default_data_path + "earth_fix.dat";
 		std::string navaid_path = xp_databus->default_data_path + "earth_nav.dat";
+		std::string awy_path = xp_databus->default_data_path + "earth_awy.dat";
+		fms_plans_path = xplane_path + "Output" + path_sep + "FMS plans" + path_sep;
 
-		airports = {};
-		runways = {};
+		apt_db = new navdb::ArptDB(sim_apt_path, tgt_apt_path, tgt_rnw_path, 0, 0, &task_pool, &sim_shutdown);
+		navaid_db = new navdb::NavaidDB(fix_path, navaid_path, &task_pool, &sim_shutdown);
+		nav_db = new navdb::NavDB(navaid_db, apt_db);
+		awy_db = new navdb::AwyDB(awy_path, navaid_db, &task_pool, &sim_shutdown);
+		rte_resolver = new navdb::RouteResolver(apt_db, navaid_db, awy_db);
 
-		apt_db = new navdb::ArptDB(&airports, &runways, sim_apt_path, tgt_apt_path, tgt_rnw_path, 0, 0);
-		navaid_db = new navdb::NavaidDB(fix_path, navaid_path, &waypoints, &navaids);
+		// 1 starts a reload. Set to 0 once the new data is in use or to -1 if it was rejected.
+		xp_databus->watch_data_ref("Strato/777/navdata/reload", [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					reload_navdata();
+				}
+			});
+	}
+
+	bool AvionicsSys::reload_navdata()
+	{
+		bool expected = false;
+		if (!is_reloading.compare_exchange_strong(expected, true, std::memory_order_seq_cst))
+		{
+			return false;
+		}
+		task_pool.submit([this]()
+			{
+				// Everything is built and validated before anything is published, so that
+				// the new data is used either completely or not at all.
+				// Airways go last, since their fixes are looked up in the new navaids.
+				std::shared_ptr<navdb::arpt_snapshot> arpt_snap;
+				std::shared_ptr<navdb::navaid_snapshot> nav_snap;
+				std::shared_ptr<navdb::awy_snapshot> awy_snap;
+				bool is_built = apt_db->build_reload(&arpt_snap) && navaid_db->build_reload(&nav_snap) &&
+					awy_db->build_reload(nav_snap.get(), &awy_snap) && !sim_shutdown.load(std::memory_order_seq_cst);
+				if (is_built)
+				{
+					// Readers that need several databases retry until the generations match.
+					uint64_t generation = navdata_generation.load(std::memory_order_seq_cst) + 1;
+					arpt_snap->generation = generation;
+					nav_snap->generation = generation;
+					awy_snap->generation = generation;
+					apt_db->publish(arpt_snap);
+					navaid_db->publish(nav_snap);
+					awy_db->publish(awy_snap);
+					navdata_generation.store(generation, std::memory_order_seq_cst);
+					// Rewrite the caches, so that the next start doesn't go back to the old data.
+					apt_db->write_to_arpt_db(arpt_snap.get());
+					apt_db->write_to_rnw_db(arpt_snap.get());
+				}
+				if (!sim_shutdown.load(std::memory_order_seq_cst))
+				{
+					xp_databus->set_datai("Strato/777/navdata/reload", is_built ? 0 : -1);
+				}
+				is_reloading.store(false, std::memory_order_seq_cst);
+			}, common::TASK_LOW);
+		return true;
 	}
 
 	void AvionicsSys::update_load_status()
@@ -37,8 +89,9 @@ namespace StratosphereAvionics
 		xp_databus->set_datai("Strato/777/UI/messages/creating_databases", 1);
 		if (!sim_shutdown.load(std::memory_order_seq_cst))
 		{
-			int sts = apt_db->get_load_status() * navaid_db->get_load_status();
-			if (!sts)
+			int sts = apt_db->get_load_status() * navaid_db->get_load_status() * awy_db->get_load_status();
+			// Loaders that were cancelled by shutdown aren't errors
+			if (!sts && !sim_shutdown.load(std::memory_order_seq_cst))
 			{
 				xp_databus->set_datai("Strato/777/UI/messages/creating_databases", -1);
 				return;
@@ -55,66 +108,477 @@ namespace StratosphereAvionics
 	void AvionicsSys::main_loop()
 	{
 		update_load_status();
-		while (!sim_shutdown.load(std::memory_order_seq_cst))
-		{
-			update_sys();
-		}
+		sched.add_task("avionics", AVIONICS_UPDATE_HZ, [this]() { update_sys(); });
+		sched.run();
 	}
 
 	AvionicsSys::~AvionicsSys()
 	{
-		delete[] apt_db;
-		delete[] navaid_db;
+		// Cancel whatever is still loading. Tasks in the pool may use the databases
+		// until they notice it, so wait for them before freeing anything.
+		sim_shutdown.store(true, std::memory_order_seq_cst);
+		task_pool.wait_idle();
+		delete rte_resolver;
+		delete awy_db;
+		delete nav_db;
+		delete apt_db;
+		delete navaid_db;
 	}
 
 	//FMC definitions:
 
+	// Formats pos the way the CDU shows it, e.g. N4726.9 W12218.5
+	static std::string format_lat_lon(geo::point pos)
+	{
+		char buf[CDU_N_COLUMNS + 1];
+		// Rounded to tenths of a minute first, so that 59.96' becomes the next degree.
+		// Every field is clamped and printed as an 8 bit value, so the compiler can
+		// tell that the result fits at any optimisation level.
+		long lat = std::min(std::max(lround(fabs(pos.lat_deg) * 600), 0L), 90L * 600);
+		long lon = std::min(std::max(lround(fabs(pos.lon_deg) * 600), 0L), 180L * 600);
+		snprintf(buf, sizeof(buf), "%c%02hhu%02hhu.%hhu %c%03hhu%02hhu.%hhu", pos.lat_deg >= 0 ? 'N' : 'S',
+			uint8_t(lat / 600), uint8_t(lat % 600 / 10), uint8_t(lat % 10), pos.lon_deg >= 0 ? 'E' : 'W',
+			uint8_t(lon / 600), uint8_t(lon % 600 / 10), uint8_t(lon % 10));
+		return buf;
+	}
+
 	FMC::FMC(std::shared_ptr<AvionicsSys> av, fmc_in_drs* in, fmc_out_drs* out)
 	{
 		avionics = av;
 		apt_db = avionics->apt_db;
-		memcpy(&in_drs, in, sizeof(fmc_in_drs));
-		memcpy(&out_drs, out, sizeof(fmc_out_drs));
+		in_drs = *in;
+		out_drs = *out;
 
 		xp_databus = avionics->xp_databus;
 
-		dr_cache = new XPDataBus::DataRefCache();
+		ref_nav_out_id = xp_databus->register_data_ref(out_drs.ref_nav_out_id, DB_PRIORITY_USER);
+		apt_lat = xp_databus->register_data_ref(out_drs.apt_lat, DB_PRIORITY_USER);
+		apt_lon = xp_databus->register_data_ref(out_drs.apt_lon, DB_PRIORITY_USER);
+		apt_elevation = xp_databus->register_data_ref(out_drs.apt_elevation, DB_PRIORITY_USER);
+		poi_freq = xp_databus->register_data_ref(out_drs.poi_freq, DB_PRIORITY_USER);
+
+		std::vector<std::string> line_drs = out_drs.screen_lines;
+		line_drs.resize(CDU_N_LINES - 1);
+		line_drs.push_back(out_drs.scratch_pad_msg);
+		screen = new CDUScreen(xp_databus, &line_drs);
+
+		ref_nav_task = sched.add_task("ref_nav", FMC_CDU_UPDATE_HZ, [this]() { update_ref_nav(); });
+		sched.add_task("fpl", FMC_CDU_UPDATE_HZ, [this]() { update_fpl(); });
+		sched.add_task("screen", FMC_CDU_UPDATE_HZ, [this]() { update_screen(); });
+
+		xp_databus->watch_data_ref(in_drs.ref_nav_in_id, [this](XPDataBus::generic_val* val)
+			{
+				{
+					std::lock_guard<std::mutex> lock(ref_nav_mutex);
+					ref_nav_icao = std::string(val->str.c_str()); // Cut off the padding
+					ref_nav_changed = true;
+				}
+				sched.trigger(ref_nav_task);
+			});
+		xp_databus->watch_data_ref(in_drs.clear_msg, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					is_clear_msg_pressed.store(true, std::memory_order_seq_cst);
+				}
+			});
+		xp_databus->watch_data_ref(in_drs.page, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == RTE || val->int_val == REF_NAV_DATA)
+				{
+					set_page(val->int_val);
+				}
+			});
+		xp_databus->watch_data_ref(in_drs.rte_in, [this](XPDataBus::generic_val* val)
+			{
+				std::lock_guard<std::mutex> lock(fpl_in_mutex);
+				rte_in = std::string(val->str.c_str()); // Cut off the padding
+				is_rte_in_changed = true;
+			});
+		xp_databus->watch_data_ref(in_drs.fpl_name, [this](XPDataBus::generic_val* val)
+			{
+				std::lock_guard<std::mutex> lock(fpl_in_mutex);
+				fpl_name = std::string(val->str.c_str());
+			});
+		xp_databus->watch_data_ref(in_drs.exec, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					is_exec_pressed.store(true, std::memory_order_seq_cst);
+				}
+			});
+		xp_databus->watch_data_ref(in_drs.erase, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					is_erase_pressed.store(true, std::memory_order_seq_cst);
+				}
+			});
+		xp_databus->watch_data_ref(in_drs.fpl_load, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					is_fpl_load_pressed.store(true, std::memory_order_seq_cst);
+				}
+			});
+		xp_databus->watch_data_ref(in_drs.fpl_save, [this](XPDataBus::generic_val* val)
+			{
+				if (val->int_val == 1)
+				{
+					is_fpl_save_pressed.store(true, std::memory_order_seq_cst);
+				}
+			});
 	}
 
 	void FMC::update_ref_nav() // Updates ref nav data page
 	{
-		std::string icao = avionics->xp_databus->get_data_s(in_drs.ref_nav_in_id);
-		std::string icao_entry_last = dr_cache->get_val_s(in_drs.ref_nav_in_id);
-		if (icao != icao_entry_last)
+		/*
+		* Does nothing unless the input icao has been changed by the user
+		* or the navdata has been reloaded.
+		*/
+		std::string icao;
+		uint64_t generation = avionics->navdata_generation.load(std::memory_order_seq_cst);
 		{
-			dr_cache->set_val_s(in_drs.ref_nav_in_id, icao);
-			navdb::airport_data tmp = {};
-			size_t n_arpts_found = apt_db->get_airport_data(icao, &tmp);
-			if (n_arpts_found)
+			std::lock_guard<std::mutex> lock(ref_nav_mutex);
+			bool is_reloaded = generation != ref_nav_generation && ref_nav_icao != "";
+			ref_nav_generation = generation;
+			if (!ref_nav_changed && !is_reloaded)
 			{
-				xp_databus->set_datad(out_drs.apt_lat, tmp.pos.lat_deg);
-				xp_databus->set_datad(out_drs.apt_lon, tmp.pos.lon_deg);
-				xp_databus->set_datad(out_drs.apt_elevation, double(tmp.elevation_ft));
+				return;
 			}
-			else
+			ref_nav_changed = false;
+			icao = ref_nav_icao;
+		}
+
+		navdb::airport_data tmp = {};
+		size_t n_arpts_found = apt_db->get_airport_data(icao, &tmp);
+		if (n_arpts_found)
+		{
+			xp_databus->set_datad(apt_lat, tmp.pos.lat_deg);
+			xp_databus->set_datad(apt_lon, tmp.pos.lon_deg);
+			xp_databus->set_datad(apt_elevation, double(tmp.elevation_ft));
+			xp_databus->set_data_s(ref_nav_out_id, std::string(icao.c_str(), icao.size() + 1)); // Keep the terminator
+			ref_nav_shown = icao;
+			ref_nav_data = tmp;
+		}
+		else
+		{
+			xp_databus->set_datad(apt_lat, -1);
+			xp_databus->set_datad(apt_lon, -1);
+			xp_databus->set_datad(apt_elevation, -1);
+			xp_databus->set_data_s(ref_nav_out_id, std::string(1, '\0'), -1); // Fills the whole string
+			ref_nav_shown = "";
+			if (icao != "")
 			{
-				xp_databus->set_datad(out_drs.apt_lat, -1);
-				xp_databus->set_datad(out_drs.apt_lon, -1);
-				xp_databus->set_datad(out_drs.apt_elevation, -1);
+				scratchpad = "NOT IN DATA BASE";
 			}
 		}
+		xp_databus->set_datad(poi_freq, -1);
+	}
+
+	void FMC::update_fpl()
+	{
+		uint64_t generation = avionics->navdata_generation.load(std::memory_order_seq_cst);
+		{
+			std::lock_guard<std::mutex> lock(fpl_io_mutex);
+			if (fpl_io_task.valid() && fpl_io_task.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			{
+				int ret = fpl_io_task.get();
+				if (ret && is_fpl_loading)
+				{
+					// Appending only updates the geometry of the new leg, so this is cheap
+					// enough for the FMC thread even for long plans.
+					mod_fpl.clear();
+					for (size_t i = 0; i < loaded_fixes.size(); i++)
+					{
+						mod_fpl.insert_leg(i, &loaded_fixes[i]);
+					}
+					is_mod_active = true;
+					if (loaded_generation != generation)
+					{
+						mod_fpl.resolve(avionics->nav_db);
+					}
+				}
+				loaded_fixes.clear();
+				xp_databus->set_datai("Strato/777/FMC/FMC_R/fpl_io", ret ? FPL_IO_DONE : FPL_IO_FAILED);
+				is_fpl_io_busy.store(false, std::memory_order_seq_cst);
+			}
+		}
+
+		if (generation != fpl_generation)
+		{
+			fpl_generation = generation;
+			std::shared_ptr<FlightPlan> act = std::make_shared<FlightPlan>(*get_act_fpl());
+			act->resolve(avionics->nav_db);
+			std::atomic_store(&act_fpl, std::shared_ptr<const FlightPlan>(act));
+			if (is_mod_active)
+			{
+				mod_fpl.resolve(avionics->nav_db);
+			}
+		}
+
+		update_fpl_inputs();
+	}
+
+	void FMC::update_screen()
+	{
+		if (is_clear_msg_pressed.exchange(false, std::memory_order_seq_cst))
+		{
+			scratchpad = "";
+			xp_databus->set_datai(in_drs.clear_msg, 0, 0, DB_PRIORITY_USER);
+		}
+
+		// The whole page is drawn every tick. CDUScreen only sends what changed.
+		screen->clear();
+		if (curr_page.load(std::memory_order_seq_cst) == RTE)
+		{
+			draw_rte();
+		}
+		else
+		{
+			draw_ref_nav();
+		}
+		screen->write(CDU_N_LINES - 1, 0, scratchpad);
+		screen->publish();
+	}
+
+	void FMC::set_page(int page)
+	{
+		curr_page.store(page, std::memory_order_seq_cst);
+	}
+
+	std::shared_ptr<const FlightPlan> FMC::get_act_fpl()
+	{
+		return std::atomic_load(&act_fpl);
+	}
+
+	FlightPlan* FMC::get_mod_fpl()
+	{
+		if (!is_mod_active)
+		{
+			// Only copies the chunk pointers
+			mod_fpl = *get_act_fpl();
+			is_mod_active = true;
+		}
+		return &mod_fpl;
+	}
+
+	bool FMC::has_mod_fpl()
+	{
+		return is_mod_active;
+	}
+
+	bool FMC::execute_mod()
+	{
+		if (!is_mod_active)
+		{
+			return false;
+		}
+		// Readers either see the old plan or the new one, never a mix of both.
+		std::atomic_store(&act_fpl, std::shared_ptr<const FlightPlan>(std::make_shared<FlightPlan>(mod_fpl)));
+		erase_mod();
+		return true;
+	}
+
+	void FMC::erase_mod()
+	{
+		mod_fpl.clear();
+		is_mod_active = false;
+	}
+
+	bool FMC::load_fpl(std::string name)
+	{
+		if (!is_fpl_name_valid(name))
+		{
+			return false;
+		}
+		bool expected = false;
+		if (!is_fpl_io_busy.compare_exchange_strong(expected, true, std::memory_order_seq_cst))
+		{
+			return false;
+		}
+		xp_databus->set_datai("Strato/777/FMC/FMC_R/fpl_io", FPL_IO_BUSY);
+
+		std::lock_guard<std::mutex> lock(fpl_io_mutex);
+		std::string path = avionics->fms_plans_path + name + ".fms";
+		is_fpl_loading = true;
+		// Fixes are resolved against the data of this generation. A reload that
+		// finishes before the plan is installed makes update_fpl resolve them again.
+		loaded_generation = avionics->navdata_generation.load(std::memory_order_seq_cst);
+		fpl_io_task = avionics->task_pool.submit([this, path]() -> int
+			{
+				return load_fms_file(path, avionics->apt_db, avionics->navaid_db, &loaded_fixes);
+			});
+		return true;
+	}
+
+	bool FMC::save_fpl(std::string name)
+	{
+		if (!is_fpl_name_valid(name))
+		{
+			return false;
+		}
+		bool expected = false;
+		if (!is_fpl_io_busy.compare_exchange_strong(expected, true, std::memory_order_seq_cst))
+		{
+			return false;
+		}
+		xp_databus->set_datai("Strato/777/FMC/FMC_R/fpl_io", FPL_IO_BUSY);
+
+		std::shared_ptr<const FlightPlan> act = get_act_fpl();
+		std::shared_ptr<std::vector<fpl_fix>> fixes = std::make_shared<std::vector<fpl_fix>>();
+		for (size_t i = 0; i < act->get_n_legs(); i++)
+		{
+			fpl_leg leg;
+			act->get_leg(i, &leg);
+			fixes->push_back(leg.fix);
+		}
+
+		std::lock_guard<std::mutex> lock(fpl_io_mutex);
+		std::string path = avionics->fms_plans_path + name + ".fms";
+		is_fpl_loading = false;
+		fpl_io_task = avionics->task_pool.submit([this, path, fixes]() -> int
+			{
+				std::shared_ptr<const navdb::navaid_snapshot> nav_snap = avionics->navaid_db->get_snapshot();
+				navdb::navaid_snapshot empty;
+				return write_fms_file(path, nav_snap != nullptr ? nav_snap.get() : &empty, fixes.get());
+			}, common::TASK_LOW);
+		return true;
 	}
 
 	void FMC::main_loop()
 	{
-		while (!sim_shutdown.load(std::memory_order_seq_cst))
+		sched.run();
+	}
+
+	void FMC::update_fpl_inputs()
+	{
+		std::string route;
+		std::string name;
+		bool is_route_entered = false;
 		{
-			update_ref_nav();
+			std::lock_guard<std::mutex> lock(fpl_in_mutex);
+			is_route_entered = is_rte_in_changed && rte_in != "";
+			is_rte_in_changed = false;
+			route = rte_in;
+			name = fpl_name;
 		}
+
+		if (is_route_entered)
+		{
+			std::vector<navdb::route_elem> elems;
+			std::vector<navdb::route_error> errors;
+			avionics->rte_resolver->resolve(route, &elems, &errors);
+			if (elems.size())
+			{
+				FlightPlan* mod = get_mod_fpl();
+				for (size_t i = 0; i < elems.size(); i++)
+				{
+					fpl_fix fix = { elems[i].id, elems[i].type, elems[i].pos };
+					mod->insert_leg(mod->get_n_legs(), &fix);
+				}
+			}
+			for (size_t i = 0; i < errors.size(); i++)
+			{
+				if (errors[i].type == RTE_NOT_FOUND)
+				{
+					scratchpad = "NOT IN DATA BASE";
+				}
+			}
+			// Clearing the entry lets the same route be entered again
+			xp_databus->set_data_s(in_drs.rte_in, std::string(1, '\0'), -1, DB_PRIORITY_USER);
+		}
+		if (is_erase_pressed.exchange(false, std::memory_order_seq_cst))
+		{
+			erase_mod();
+			xp_databus->set_datai(in_drs.erase, 0, 0, DB_PRIORITY_USER);
+		}
+		if (is_exec_pressed.exchange(false, std::memory_order_seq_cst))
+		{
+			execute_mod();
+			xp_databus->set_datai(in_drs.exec, 0, 0, DB_PRIORITY_USER);
+		}
+		// Progress of both is reported through fpl_io
+		if (is_fpl_load_pressed.exchange(false, std::memory_order_seq_cst))
+		{
+			if (name == "" || !load_fpl(name))
+			{
+				scratchpad = "INVALID ENTRY";
+			}
+			xp_databus->set_datai(in_drs.fpl_load, 0, 0, DB_PRIORITY_USER);
+		}
+		if (is_fpl_save_pressed.exchange(false, std::memory_order_seq_cst))
+		{
+			if (name == "" || !save_fpl(name))
+			{
+				scratchpad = "INVALID ENTRY";
+			}
+			xp_databus->set_datai(in_drs.fpl_save, 0, 0, DB_PRIORITY_USER);
+		}
+	}
+
+	void FMC::draw_ref_nav()
+	{
+		screen->write_centered(0, "REF NAVIGATION DATA");
+		if (ref_nav_shown == "")
+		{
+			screen->write(1, 0, "----");
+			return;
+		}
+		screen->write(1, 0, ref_nav_shown);
+		screen->write_right(1, "ELEV " + std::to_string(ref_nav_data.elevation_ft) + "FT");
+		screen->write(2, 0, format_lat_lon(ref_nav_data.pos));
+	}
+
+	void FMC::draw_rte()
+	{
+		std::shared_ptr<const FlightPlan> act = get_act_fpl();
+		const FlightPlan* fpl = is_mod_active ? &mod_fpl : act.get();
+		screen->write_centered(0, is_mod_active ? "MOD RTE 1 LEGS" : "ACT RTE 1 LEGS");
+		if (!fpl->get_n_legs())
+		{
+			screen->write_centered(1, "NO ROUTE");
+			return;
+		}
+
+		// Title, total distance and scratchpad leave the lines in between for legs
+		size_t n_shown = CDU_N_LINES - 3;
+		for (size_t i = 0; i < n_shown && i < fpl->get_n_legs(); i++)
+		{
+			fpl_leg leg;
+			fpl->get_leg(i, &leg);
+			screen->write(i + 1, 0, leg.fix.id);
+			if (i > 0)
+			{
+				int course = int(lround(leg.course_deg));
+				char buf[CDU_N_COLUMNS + 1];
+				snprintf(buf, sizeof(buf), "%03d", course == 0 ? 360 : course);
+				screen->write(i + 1, 10, buf);
+				snprintf(buf, sizeof(buf), "%ldNM", lround(leg.dist_nm));
+				screen->write_right(i + 1, buf);
+			}
+		}
+		char buf[CDU_N_COLUMNS + 1];
+		snprintf(buf, sizeof(buf), "%ldNM", lround(fpl->get_total_dist_nm()));
+		screen->write(CDU_N_LINES - 2, 0, "TOTAL");
+		screen->write_right(CDU_N_LINES - 2, buf);
+	}
+
+	bool FMC::is_fpl_name_valid(std::string name)
+	{
+		// The name comes from a writable dataref, so it's only allowed to name a file in the folder.
+		// ':' would select a drive on Windows.
+		return name != "" && name.find_first_of("/\\:") == std::string::npos && name.find("..") == std::string::npos;
 	}
 
 	FMC::~FMC()
 	{
-		delete[] dr_cache;
+		// The task may still be writing to loaded_fixes
+		std::lock_guard<std::mutex> lock(fpl_io_mutex);
+		if (fpl_io_task.valid())
+		{
+			fpl_io_task.wait();
+		}
+		delete screen;
 	}
 }
@@ -5,9 +5,14 @@
 
 #pragma once
 
-#include "dr_cache.h"
 #include "databus.h"
 #include "nav_database.h"
+#include "airway_database.h"
+#include "route_resolver.h"
+#include "flight_plan.h"
+#include "fms_file.h"
+#include "cdu_screen.h"
+#include "scheduler.h"
 #include <cstring>
 
 
@@ -17,21 +22,44 @@ enum fmc_pages
 	REF_NAV_DATA = 2
 };
 
+enum fmc_update_rates
+{
+	AVIONICS_UPDATE_HZ = 50,
+	FMC_CDU_UPDATE_HZ = 10
+};
+
+// Values of Strato/777/FMC/FMC_R/fpl_io
+enum fpl_io_status
+{
+	FPL_IO_FAILED = -1,
+	FPL_IO_DONE = 0,
+	FPL_IO_BUSY = 1
+};
+
 
 namespace StratosphereAvionics
 {
 
 	struct fmc_in_drs
 	{
-		//std::string curr_page;
 		std::string ref_nav_in_id;
+		std::string clear_msg; // Set to 1 to clear the scratchpad
+		std::string page; // Set to one of fmc_pages to select the page shown
+		std::string rte_in; // Route string. Its fixes are appended to the MOD flight plan.
+		std::string exec; // Set to 1 to execute the MOD flight plan
+		std::string erase; // Set to 1 to erase the MOD flight plan
+		std::string fpl_name; // Name of the .fms file without the extension
+		std::string fpl_load; // Set to 1 to load fpl_name into the MOD flight plan
+		std::string fpl_save; // Set to 1 to save the active flight plan to fpl_name
 	};
 
 	struct fmc_out_drs
 	{
-		//std::string scratch_pad_msg;
-		//std::vector<std::string> screen_lines;
+		std::string ref_nav_out_id;
 		std::string apt_lat, apt_lon, apt_elevation;
+		std::string poi_freq; // Airports don't have one, so it's always -1 for now
+		std::string scratch_pad_msg;
+		std::vector<std::string> screen_lines; // Big lines of the screen, top to bottom
 	};
 
 	class AvionicsSys 
@@ -42,22 +70,33 @@ namespace StratosphereAvionics
 		std::string prefs_path;
 		std::string sim_apt_path;
 		std::string default_data_path;
+		std::string fms_plans_path; // Output/FMS plans, where the sim keeps .fms files
 		int xplane_version;
 		std::atomic<bool> sim_shutdown{false};
+		Scheduler sched{&sim_shutdown};
+		// Shared by all background work of the avionics: navdata loading,
+		// cache writing, route computation, etc.
+		common::ThreadPool task_pool;
 
 		std::shared_ptr<XPDataBus::DataBus> xp_databus;
 
-		std::unordered_map<std::string, std::vector<navdb::navaid_entry>> navaids;
-		std::unordered_map<std::string, std::vector<geo::point>> waypoints;
-
-		std::unordered_map<std::string, navdb::airport_data> airports;
-		std::unordered_map<std::string, std::unordered_map<std::string, navdb::runway_entry>> runways;
-
 		navdb::ArptDB* apt_db;
 		navdb::NavaidDB* navaid_db;
+		navdb::NavDB* nav_db;
+		navdb::AwyDB* awy_db;
+		navdb::RouteResolver* rte_resolver;
+		// Incremented every time the reloaded databases are swapped in. It's also
+		// the generation of the snapshots that were published by that reload.
+		// Anything that was resolved against the old data should be resolved again.
+		std::atomic<uint64_t> navdata_generation{0};
 
 		AvionicsSys(std::shared_ptr<XPDataBus::DataBus> databus);
 
+		// Starts rebuilding the navigation databases on the low priority lane of
+		// the task pool. The FMC keeps using the old data until the new one is validated.
+		// Returns false if a reload is already running. Ran from any thread.
+		bool reload_navdata();
+
 		void update_sys();
 
 		void main_loop();
@@ -66,6 +105,7 @@ namespace StratosphereAvionics
 
 	private:
 		std::string icao_entry_last;
+		std::atomic<bool> is_reloading{false};
 
 		void update_load_status();
 	};
@@ -74,11 +114,47 @@ namespace StratosphereAvionics
 	{
 	public:
 		std::atomic<bool> sim_shutdown{ false };
+		Scheduler sched{&sim_shutdown};
 
 		FMC(std::shared_ptr<AvionicsSys> av, fmc_in_drs* in, fmc_out_drs* out);
 
 		void update_ref_nav(); // Updates ref nav data page
 
+		void update_fpl(); // Keeps the active flight plan in sync with the navdata
+
+		void update_screen(); // Draws the current page and publishes the lines that changed
+
+		// Selects the page drawn by update_screen. page is one of fmc_pages. Ran from any thread.
+		void set_page(int page);
+
+		// Returns the active flight plan. It stays valid and unchanged for as long
+		// as the pointer is held. Ran from any thread.
+		std::shared_ptr<const FlightPlan> get_act_fpl();
+
+		// Returns the MOD flight plan. If there is none, a new one is started from the
+		// active plan. It shares all legs that haven't been edited with the active plan.
+		// Ran from the FMC thread.
+		FlightPlan* get_mod_fpl();
+
+		bool has_mod_fpl();
+
+		// Makes the MOD flight plan active. Returns false if there is no MOD.
+		// Ran from the FMC thread.
+		bool execute_mod();
+
+		// Drops the MOD flight plan. Ran from the FMC thread.
+		void erase_mod();
+
+		// Starts loading name.fms from the FMS plans folder on the task pool. It becomes
+		// the MOD flight plan on the next update_fpl. Progress is reported through
+		// Strato/777/FMC/FMC_R/fpl_io. Returns false if name isn't a valid file name or
+		// a file is already being read or written.
+		bool load_fpl(std::string name);
+
+		// Writes the active flight plan to name.fms on the task pool. Returns false if name
+		// isn't a valid file name or a file is already being read or written. Ran from any thread.
+		bool save_fpl(std::string name);
+
 		void main_loop();
 
 		~FMC();
@@ -90,6 +166,61 @@ namespace StratosphereAvionics
 
 		std::shared_ptr<XPDataBus::DataBus> xp_databus;
 
-		XPDataBus::DataRefCache* dr_cache;
+		XPDataBus::dr_handle ref_nav_out_id;
+		XPDataBus::dr_handle apt_lat, apt_lon, apt_elevation, poi_freq;
+
+		int ref_nav_task;
+
+		// Set by the dataref watch on the main thread.
+		std::mutex ref_nav_mutex;
+		std::string ref_nav_icao;
+		bool ref_nav_changed = false;
+		uint64_t ref_nav_generation = 0; // Navdata generation ref nav data was looked up in
+
+		// Only used by the FMC thread
+		CDUScreen* screen;
+		std::string scratchpad;
+		std::string ref_nav_shown; // Icao shown on the ref nav data page. Empty if nothing was found.
+		navdb::airport_data ref_nav_data = {};
+
+		std::atomic<int> curr_page{REF_NAV_DATA};
+		std::atomic<bool> is_clear_msg_pressed{false};
+
+		// Flight plan inputs. Set by the dataref watches on the main thread.
+		std::mutex fpl_in_mutex;
+		std::string rte_in;
+		bool is_rte_in_changed = false;
+		std::string fpl_name;
+		std::atomic<bool> is_exec_pressed{false};
+		std::atomic<bool> is_erase_pressed{false};
+		std::atomic<bool> is_fpl_load_pressed{false};
+		std::atomic<bool> is_fpl_save_pressed{false};
+
+		// Applies the flight plan inputs. Ran from the FMC thread.
+		void update_fpl_inputs();
+
+		void draw_ref_nav();
+
+		void draw_rte();
+
+		// Replaced as a whole and never modified, so guidance can read it without locks.
+		// Only accessed through std::atomic_load/std::atomic_store.
+		std::shared_ptr<const FlightPlan> act_fpl = std::make_shared<const FlightPlan>();
+
+		// Only used by the FMC thread
+		FlightPlan mod_fpl;
+		bool is_mod_active = false;
+		uint64_t fpl_generation = 0;
+
+		// Only one .fms file is read or written at a time.
+		std::atomic<bool> is_fpl_io_busy{false};
+		std::mutex fpl_io_mutex;
+		std::future<int> fpl_io_task;
+		bool is_fpl_loading = false;
+		uint64_t loaded_generation = 0;
+		std::vector<fpl_fix> loaded_fixes; // Written by the load task until fpl_io_task is ready
+
+		// Returns false if name is empty or could point outside of the FMS plans folder.
+		static bool is_fpl_name_valid(std::string name);
 	};
 }
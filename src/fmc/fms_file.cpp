@@ -0,0 +1,274 @@
+/*
+	This source file contains definitions of functions declared in fms_file.h
+*/
+
+#include "fms_file.h"
+
+
+namespace StratosphereAvionics
+{
+	// Returns the start of the next token in [p, end) and writes its end to tok_end.
+	// Returns end if there are no tokens left.
+	static const char* next_token(const char* p, const char* end, const char** tok_end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t'))
+		{
+			p++;
+		}
+		const char* q = p;
+		while (q < end && *q != ' ' && *q != '\t')
+		{
+			q++;
+		}
+		*tok_end = q;
+		return p;
+	}
+
+	static void resolve_entry(int type, std::string* id, const navdb::arpt_snapshot* arpt_snap,
+		const navdb::navaid_snapshot* nav_snap, fpl_fix* out)
+	{
+		// Anything further than this from the position in the file is a different fix with the same id
+		double min_dist = FPL_MAX_RESOLVE_DIST_NM;
+		if (type == FMS_AIRPORT)
+		{
+			out->type = POI_AIRPORT;
+			auto it = arpt_snap->airports.find(*id);
+			if (it != arpt_snap->airports.end())
+			{
+				out->pos = it->second.pos;
+			}
+		}
+		else if (type == FMS_NDB || type == FMS_VOR)
+		{
+			out->type = POI_NAVAID;
+			auto it = nav_snap->navaids.find(*id);
+			if (it != nav_snap->navaids.end())
+			{
+				geo::point file_pos = out->pos;
+				for (size_t i = 0; i < it->second.size(); i++)
+				{
+					const navdb::navaid_entry* navaid = &it->second[i];
+					// NDBs and VHF navaids can share an ident
+					if ((navaid->type == NAV_NDB) != (type == FMS_NDB))
+					{
+						continue;
+					}
+					double dist = file_pos.getGreatCircleDistanceNM(navaid->wpt);
+					if (dist < min_dist)
+					{
+						min_dist = dist;
+						out->pos = navaid->wpt;
+					}
+				}
+			}
+		}
+		else
+		{
+			out->type = POI_WAYPOINT;
+			auto it = nav_snap->waypoints.find(*id);
+			if (type == FMS_FIX && it != nav_snap->waypoints.end())
+			{
+				geo::point file_pos = out->pos;
+				for (size_t i = 0; i < it->second.size(); i++)
+				{
+					double dist = file_pos.getGreatCircleDistanceNM(it->second[i]);
+					if (dist < min_dist)
+					{
+						min_dist = dist;
+						out->pos = it->second[i];
+					}
+				}
+			}
+		}
+	}
+
+	int load_fms_file(std::string path, navdb::ArptDB* arpt_db, navdb::NavaidDB* navaid_db, std::vector<fpl_fix>* out)
+	{
+		std::ifstream file(path, std::ifstream::in | std::ifstream::binary);
+		if (!file.is_open())
+		{
+			return 0;
+		}
+		// The whole file is read at once and parsed in place.
+		file.seekg(0, std::ifstream::end);
+		std::streamoff size = file.tellg();
+		file.seekg(0, std::ifstream::beg);
+		if (size <= 0)
+		{
+			return 0;
+		}
+		std::string buf(size_t(size), '\0');
+		file.read(&buf[0], size);
+		file.close();
+
+		std::shared_ptr<const navdb::arpt_snapshot> arpt_snap;
+		std::shared_ptr<const navdb::navaid_snapshot> nav_snap;
+		navdb::get_snapshots(arpt_db, navaid_db, &arpt_snap, &nav_snap);
+		navdb::arpt_snapshot empty_arpt;
+		navdb::navaid_snapshot empty_nav;
+		return parse_fms(buf.c_str(), buf.size(), arpt_snap != nullptr ? arpt_snap.get() : &empty_arpt,
+			nav_snap != nullptr ? nav_snap.get() : &empty_nav, out);
+	}
+
+	int parse_fms(const char* data, size_t size, const navdb::arpt_snapshot* arpt_snap,
+		const navdb::navaid_snapshot* nav_snap, std::vector<fpl_fix>* out)
+	{
+		const char* p = data;
+		const char* end = data + size;
+		int line_idx = 0;
+		int version = 0;
+		while (p < end)
+		{
+			const char* line_end = (const char*)memchr(p, '\n', size_t(end - p));
+			if (line_end == nullptr)
+			{
+				line_end = end;
+			}
+			const char* next_line = line_end < end ? line_end + 1 : end;
+			if (line_end > p && line_end[-1] == '\r')
+			{
+				line_end--;
+			}
+
+			const char* tokens[6];
+			const char* token_ends[6];
+			size_t n_tokens = 0;
+			const char* tok_end = p;
+			while (n_tokens < 6)
+			{
+				const char* tok = next_token(tok_end, line_end, &tok_end);
+				if (tok == line_end)
+				{
+					break;
+				}
+				tokens[n_tokens] = tok;
+				token_ends[n_tokens] = tok_end;
+				n_tokens++;
+			}
+
+			if (line_idx == 0 && (n_tokens != 1 || (*tokens[0] != 'I' && *tokens[0] != 'A')))
+			{
+				return 0;
+			}
+			else if (line_idx == 1)
+			{
+				version = n_tokens ? atoi(tokens[0]) : 0;
+				if (version != FMS_VERSION_XP10 && version != FMS_VERSION_XP11)
+				{
+					return 0;
+				}
+			}
+			else if (line_idx > 1 && n_tokens >= 5)
+			{
+				/*
+				* Entries are "type id alt lat lon" in version 3 and
+				* "type id via alt lat lon" in version 1100. Anything else,
+				* like ADEP or NUMENR, doesn't start with a number.
+				*/
+				char* num_end;
+				int type = int(strtol(tokens[0], &num_end, 10));
+				bool is_entry = num_end == token_ends[0] && (type == FMS_AIRPORT || type == FMS_NDB ||
+					type == FMS_VOR || type == FMS_FIX || type == FMS_LAT_LON);
+				size_t lat_idx = version == FMS_VERSION_XP11 ? 4 : 3;
+				if (is_entry && n_tokens > lat_idx + 1)
+				{
+					fpl_fix fix;
+					fix.id.assign(tokens[1], size_t(token_ends[1] - tokens[1]));
+					fix.pos.lat_deg = strtod(tokens[lat_idx], nullptr);
+					fix.pos.lon_deg = strtod(tokens[lat_idx + 1], nullptr);
+					resolve_entry(type, &fix.id, arpt_snap, nav_snap, &fix);
+					out->push_back(fix);
+				}
+			}
+			line_idx++;
+			p = next_line;
+		}
+		return version != 0;
+	}
+
+	int write_fms_file(std::string path, const navdb::navaid_snapshot* nav_snap, std::vector<fpl_fix>* fixes)
+	{
+		std::string buf;
+		buf.reserve((fixes->size() + 6) * 64);
+		char line[FMS_LINE_BUF_SIZE];
+
+		buf.append("I\n1100 Version\n");
+		if (fixes->size())
+		{
+			fpl_fix* first = &fixes->front();
+			fpl_fix* last = &fixes->back();
+			snprintf(line, FMS_LINE_BUF_SIZE, "%s %s\n", first->type == POI_AIRPORT ? "ADEP" : "DEP", first->id.c_str());
+			buf.append(line);
+			snprintf(line, FMS_LINE_BUF_SIZE, "%s %s\n", last->type == POI_AIRPORT ? "ADES" : "DES", last->id.c_str());
+			buf.append(line);
+		}
+		snprintf(line, FMS_LINE_BUF_SIZE, "NUMENR %d\n", int(fixes->size()));
+		buf.append(line);
+
+		for (size_t i = 0; i < fixes->size(); i++)
+		{
+			fpl_fix* fix = &fixes->at(i);
+			int type = FMS_FIX;
+			if (fix->type == POI_AIRPORT)
+			{
+				type = FMS_AIRPORT;
+			}
+			else if (fix->type == POI_NAVAID)
+			{
+				// The plan doesn't keep the navaid type, so it's looked up by position
+				type = FMS_VOR;
+				auto it = nav_snap->navaids.find(fix->id);
+				if (it != nav_snap->navaids.end())
+				{
+					for (size_t j = 0; j < it->second.size(); j++)
+					{
+						const navdb::navaid_entry* navaid = &it->second[j];
+						if (navaid->wpt.lat_deg == fix->pos.lat_deg && navaid->wpt.lon_deg == fix->pos.lon_deg)
+						{
+							type = navaid->type == NAV_NDB ? FMS_NDB : FMS_VOR;
+							break;
+						}
+					}
+				}
+			}
+			else if (nav_snap->waypoints.find(fix->id) == nav_snap->waypoints.end())
+			{
+				type = FMS_LAT_LON;
+			}
+
+			const char* via = "DRCT";
+			if (type == FMS_AIRPORT && i == 0)
+			{
+				via = "ADEP";
+			}
+			else if (type == FMS_AIRPORT && i == fixes->size() - 1)
+			{
+				via = "ADES";
+			}
+			snprintf(line, FMS_LINE_BUF_SIZE, "%d %s %s 0.000000 %.9f %.9f\n", type, fix->id.c_str(), via,
+				fix->pos.lat_deg, fix->pos.lon_deg);
+			buf.append(line);
+		}
+
+		std::string tmp_path = path + DB_TMP_SUFFIX;
+		FILE* file = fopen(tmp_path.c_str(), "wb");
+		if (file == nullptr)
+		{
+			return 0;
+		}
+		bool is_written = fwrite(buf.c_str(), 1, buf.size(), file) == buf.size();
+		is_written = fclose(file) == 0 && is_written;
+		if (!is_written)
+		{
+			std::remove(tmp_path.c_str());
+			return 0;
+		}
+		// The old plan is only replaced once the new one is complete
+		if (!common::replace_file(tmp_path, path))
+		{
+			std::remove(tmp_path.c_str());
+			return 0;
+		}
+		return 1;
+	}
+}
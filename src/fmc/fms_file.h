@@ -0,0 +1,50 @@
+/*
+	This header file contains declarations of functions that read and write
+	X-Plane .fms flight plan files. Both the version 3 (X-Plane 10) and the
+	version 1100 (X-Plane 11/12) formats are read. Files are written in 1100 format.
+*/
+
+#pragma once
+
+#include "flight_plan.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+#define FMS_LINE_BUF_SIZE 256 // Size of the buffer a single entry is formatted into
+
+enum fms_entry_types
+{
+	FMS_AIRPORT = 1,
+	FMS_NDB = 2,
+	FMS_VOR = 3,
+	FMS_FIX = 11,
+	FMS_LAT_LON = 28
+};
+
+enum fms_versions
+{
+	FMS_VERSION_XP10 = 3,
+	FMS_VERSION_XP11 = 1100
+};
+
+
+namespace StratosphereAvionics
+{
+	// Reads the entries of the .fms file at path into out. Every entry is moved to the
+	// closest fix with the same id and type in the current navdata. Entries that
+	// aren't in the navdata keep the position from the file.
+	// Returns 0 if the file couldn't be read or isn't a flight plan.
+	int load_fms_file(std::string path, navdb::ArptDB* arpt_db, navdb::NavaidDB* navaid_db, std::vector<fpl_fix>* out);
+
+	// Parses a whole .fms file held in memory. data has to be null terminated.
+	// Idents are the only thing copied out of data.
+	int parse_fms(const char* data, size_t size, const navdb::arpt_snapshot* arpt_snap,
+		const navdb::navaid_snapshot* nav_snap, std::vector<fpl_fix>* out);
+
+	// Writes fixes to path in 1100 format. The file is formatted in memory, written
+	// under a temporary name and renamed, so a failed write leaves the old file intact.
+	// Returns 0 if the file couldn't be written.
+	int write_fms_file(std::string path, const navdb::navaid_snapshot* nav_snap, std::vector<fpl_fix>* fixes);
+}
@@ -0,0 +1,138 @@
+/*
+	This source file contains definitions of member functions of Scheduler.
+*/
+
+#include "scheduler.h"
+#include <thread>
+
+
+namespace StratosphereAvionics
+{
+	Scheduler::Scheduler(std::atomic<bool>* shutdown)
+	{
+		sim_shutdown = shutdown;
+	}
+
+	int Scheduler::add_task(std::string name, double rate_hz, std::function<void()> callback)
+	{
+		std::unique_ptr<task_entry> task = std::make_unique<task_entry>();
+		task->name = name;
+		task->period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1 / rate_hz));
+		task->callback = callback;
+		task->next_due = std::chrono::steady_clock::now();
+		tasks.push_back(std::move(task));
+		return int(tasks.size()) - 1;
+	}
+
+	void Scheduler::trigger(int task_id)
+	{
+		if (task_id < 0 || task_id >= int(tasks.size()))
+		{
+			return;
+		}
+		tasks[task_id]->is_triggered.store(true, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex);
+			is_woken.store(true, std::memory_order_release);
+		}
+		wake_cv.notify_one();
+	}
+
+	void Scheduler::run()
+	{
+		while (!sim_shutdown->load(std::memory_order_seq_cst))
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point wake_time = now + std::chrono::milliseconds(SCHED_MAX_SLEEP_MS);
+			for (size_t i = 0; i < tasks.size(); i++)
+			{
+				task_entry* task = tasks[i].get();
+				bool is_triggered = task->is_triggered.exchange(false, std::memory_order_acq_rel);
+				if (is_triggered || now >= task->next_due)
+				{
+					run_task(task, now);
+					now = std::chrono::steady_clock::now();
+				}
+				if (task->next_due < wake_time)
+				{
+					wake_time = task->next_due;
+				}
+			}
+			sleep_until(wake_time);
+		}
+	}
+
+	sched_task_stats Scheduler::get_stats(int task_id)
+	{
+		sched_task_stats out = {};
+		if (task_id >= 0 && task_id < int(tasks.size()))
+		{
+			task_entry* task = tasks[task_id].get();
+			out.n_runs = task->n_runs.load(std::memory_order_relaxed);
+			out.n_overruns = task->n_overruns.load(std::memory_order_relaxed);
+			out.n_skipped = task->n_skipped.load(std::memory_order_relaxed);
+			out.last_time_us = task->last_time_us.load(std::memory_order_relaxed);
+			out.max_time_us = task->max_time_us.load(std::memory_order_relaxed);
+		}
+		return out;
+	}
+
+	std::string Scheduler::get_summary()
+	{
+		std::string out;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			sched_task_stats stats = get_stats(int(i));
+			out += "Scheduler: " + tasks[i]->name + " runs=" + std::to_string(stats.n_runs) +
+				" overruns=" + std::to_string(stats.n_overruns) + " skipped=" + std::to_string(stats.n_skipped) +
+				" max_us=" + std::to_string(stats.max_time_us) + "\n";
+		}
+		return out;
+	}
+
+	void Scheduler::run_task(task_entry* task, std::chrono::steady_clock::time_point now)
+	{
+		/*
+		* Ticks stay on a fixed grid, so the rate doesn't drift.
+		* If a run ends after the next tick, the ticks that were
+		* missed are dropped rather than run back to back.
+		*/
+		task->callback();
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		uint64_t time_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(end - now).count());
+		task->n_runs.fetch_add(1, std::memory_order_relaxed);
+		task->last_time_us.store(time_us, std::memory_order_relaxed);
+		if (time_us > task->max_time_us.load(std::memory_order_relaxed))
+		{
+			task->max_time_us.store(time_us, std::memory_order_relaxed);
+		}
+
+		if (now < task->next_due)
+		{
+			return; // Triggered run. The next tick stays where it was.
+		}
+		task->next_due += task->period;
+		if (end > task->next_due)
+		{
+			uint64_t n_missed = uint64_t((end - task->next_due) / task->period) + 1;
+			task->n_overruns.fetch_add(1, std::memory_order_relaxed);
+			task->n_skipped.fetch_add(n_missed, std::memory_order_relaxed);
+			task->next_due += task->period * n_missed;
+		}
+	}
+
+	void Scheduler::sleep_until(std::chrono::steady_clock::time_point t)
+	{
+		std::chrono::steady_clock::time_point spin_start = t - std::chrono::microseconds(SCHED_SPIN_US);
+		{
+			std::unique_lock<std::mutex> lock(wake_mutex);
+			wake_cv.wait_until(lock, spin_start, [this]() { return is_woken.load(std::memory_order_acquire); });
+		}
+		while (!is_woken.load(std::memory_order_acquire) && std::chrono::steady_clock::now() < t)
+		{
+			std::this_thread::yield();
+		}
+		is_woken.store(false, std::memory_order_release);
+	}
+}
@@ -0,0 +1,82 @@
+/*
+	This header file contains the declaration of Scheduler. It runs the tasks
+	of a subsystem at fixed rates on the calling thread and sleeps in between,
+	so that avionics threads don't take CPU time away from the sim.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace StratosphereAvionics
+{
+	enum scheduler_constants
+	{
+		SCHED_SPIN_US = 200, // The last part of every sleep is spent yielding for better precision
+		SCHED_MAX_SLEEP_MS = 50 // Upper bound of the time it takes to notice shutdown
+	};
+
+	struct sched_task_stats
+	{
+		uint64_t n_runs;
+		uint64_t n_overruns; // Runs that ended after the next tick of the task
+		uint64_t n_skipped; // Ticks dropped because of overruns
+		uint64_t last_time_us;
+		uint64_t max_time_us;
+	};
+
+	class Scheduler
+	{
+	public:
+		Scheduler(std::atomic<bool>* shutdown);
+
+		// Not thread safe: add all tasks before calling run.
+		// Returns id of the task.
+		int add_task(std::string name, double rate_hz, std::function<void()> callback);
+
+		// Makes the task due immediately. Ran from any thread.
+		void trigger(int task_id);
+
+		// Runs the tasks until *shutdown is set.
+		void run();
+
+		sched_task_stats get_stats(int task_id);
+
+		std::string get_summary();
+
+	private:
+		struct task_entry
+		{
+			std::string name;
+			std::chrono::steady_clock::duration period;
+			std::function<void()> callback;
+			std::chrono::steady_clock::time_point next_due;
+			std::atomic<bool> is_triggered{false};
+
+			std::atomic<uint64_t> n_runs{0};
+			std::atomic<uint64_t> n_overruns{0};
+			std::atomic<uint64_t> n_skipped{0};
+			std::atomic<uint64_t> last_time_us{0};
+			std::atomic<uint64_t> max_time_us{0};
+		};
+
+		std::atomic<bool>* sim_shutdown;
+		std::vector<std::unique_ptr<task_entry>> tasks;
+
+		std::mutex wake_mutex;
+		std::condition_variable wake_cv;
+		std::atomic<bool> is_woken{false};
+
+		void run_task(task_entry* task, std::chrono::steady_clock::time_point now);
+
+		void sleep_until(std::chrono::steady_clock::time_point t);
+	};
+}
@@ -0,0 +1,602 @@
+#include "airway_database.h"
+
+
+namespace navdb
+{
+	uint32_t get_closest_node(const awy_snapshot* snap, std::string id, geo::point pos)
+	{
+		auto it = snap->node_ids.find(id);
+		if (it == snap->node_ids.end())
+		{
+			return UINT32_MAX;
+		}
+		uint32_t out = UINT32_MAX;
+		double min_dist = INFINITY;
+		for (size_t i = 0; i < it->second.size(); i++)
+		{
+			double dist = pos.getGreatCircleDistanceNM(snap->node_pos[it->second[i]]);
+			if (out == UINT32_MAX || dist < min_dist)
+			{
+				min_dist = dist;
+				out = it->second[i];
+			}
+		}
+		return out;
+	}
+
+	//RouteFinder definitions:
+
+	size_t RouteFinder::find(const awy_snapshot* snap, std::string from, std::string to, awy_search_params* params,
+		std::vector<awy_leg>* out)
+	{
+		auto from_it = snap->node_ids.find(from);
+		auto to_it = snap->node_ids.find(to);
+		if (from_it == snap->node_ids.end() || to_it == snap->node_ids.end())
+		{
+			return 0;
+		}
+		return search(snap, from_it->second.data(), from_it->second.size(), to_it->second.data(),
+			to_it->second.size(), params, out);
+	}
+
+	size_t RouteFinder::find(const awy_snapshot* snap, std::string from, geo::point from_pos, std::string to,
+		geo::point to_pos, awy_search_params* params, std::vector<awy_leg>* out)
+	{
+		uint32_t from_node = get_closest_node(snap, from, from_pos);
+		uint32_t to_node = get_closest_node(snap, to, to_pos);
+		if (from_node == UINT32_MAX || to_node == UINT32_MAX)
+		{
+			return 0;
+		}
+		return search(snap, &from_node, 1, &to_node, 1, params, out);
+	}
+
+	size_t RouteFinder::find(const awy_snapshot* snap, uint32_t from_node, uint32_t to_node, awy_search_params* params,
+		std::vector<awy_leg>* out)
+	{
+		if (from_node >= snap->node_pos.size() || to_node >= snap->node_pos.size())
+		{
+			return 0;
+		}
+		return search(snap, &from_node, 1, &to_node, 1, params, out);
+	}
+
+	bool RouteFinder::is_further(open_entry a, open_entry b)
+	{
+		return a.f > b.f;
+	}
+
+	double RouteFinder::get_heuristic(geo::point pos)
+	{
+		/*
+		* Great circle distance to the closest target. Airway segments
+		* can't be shorter than that, so the first target to be popped
+		* ends the shortest route.
+		*/
+		double out = INFINITY;
+		for (size_t i = 0; i < targets.size(); i++)
+		{
+			double dist = pos.getGreatCircleDistanceNM(targets[i]);
+			if (dist < out)
+			{
+				out = dist;
+			}
+		}
+		return out;
+	}
+
+	size_t RouteFinder::search(const awy_snapshot* snap, const uint32_t* from_nodes, size_t n_from,
+		const uint32_t* to_nodes, size_t n_to, awy_search_params* params, std::vector<awy_leg>* out)
+	{
+		size_t n_nodes = snap->node_pos.size();
+		if (stamp.size() != n_nodes)
+		{
+			best_g.assign(n_nodes, 0);
+			stamp.assign(n_nodes, 0);
+			hop_row.assign(n_nodes, 0);
+			is_target.assign(n_nodes, 0);
+			search_id = 0;
+		}
+		search_id++;
+		if (search_id == 0) // Wrapped around
+		{
+			stamp.assign(n_nodes, 0);
+			search_id = 1;
+		}
+		labels.clear();
+		open.clear();
+		targets.clear();
+		hop_best_g.clear();
+		max_hops = params->max_hops;
+
+		for (size_t i = 0; i < n_to; i++)
+		{
+			is_target[to_nodes[i]] = 1;
+			targets.push_back(snap->node_pos[to_nodes[i]]);
+		}
+		for (size_t i = 0; i < n_from; i++)
+		{
+			push(from_nodes[i], UINT32_MAX, UINT32_MAX, 0, 0, snap->node_pos[from_nodes[i]]);
+		}
+
+		uint32_t found = UINT32_MAX;
+		while (open.size())
+		{
+			std::pop_heap(open.begin(), open.end(), is_further);
+			uint32_t label_idx = open.back().label;
+			open.pop_back();
+			label curr = labels[label_idx];
+
+			// A better label for this node has been pushed after this one
+			if (max_hops)
+			{
+				if (hop_best_g[size_t(hop_row[curr.node]) * (max_hops + 1) + curr.n_hops] < curr.g)
+				{
+					continue;
+				}
+			}
+			else if (curr.g > best_g[curr.node])
+			{
+				continue;
+			}
+			if (is_target[curr.node])
+			{
+				found = label_idx;
+				break;
+			}
+			if (max_hops && curr.n_hops >= max_hops)
+			{
+				continue;
+			}
+
+			for (uint32_t i = snap->edge_start[curr.node]; i < snap->edge_start[curr.node + 1]; i++)
+			{
+				const awy_edge* edge = &snap->edges[i];
+				if (params->fl && (params->fl < edge->base_fl || params->fl > edge->top_fl))
+				{
+					continue;
+				}
+				push(edge->to, label_idx, i, curr.n_hops + 1, curr.g + edge->dist_nm, snap->node_pos[edge->to]);
+			}
+		}
+
+		for (size_t i = 0; i < n_to; i++)
+		{
+			is_target[to_nodes[i]] = 0;
+		}
+		if (found == UINT32_MAX)
+		{
+			return 0;
+		}
+
+		std::vector<uint32_t> path;
+		for (uint32_t i = found; i != UINT32_MAX; i = labels[i].parent)
+		{
+			path.push_back(i);
+		}
+		for (size_t i = path.size(); i > 0; i--)
+		{
+			label* curr = &labels[path[i - 1]];
+			awy_leg leg;
+			if (curr->edge != UINT32_MAX)
+			{
+				leg.awy = snap->awy_names[snap->edges[curr->edge].awy];
+			}
+			leg.id = snap->node_names[curr->node];
+			leg.pos = snap->node_pos[curr->node];
+			out->push_back(leg);
+		}
+		return path.size();
+	}
+
+	bool RouteFinder::is_dominated(uint32_t node, uint32_t n_hops, double g)
+	{
+		if (!max_hops)
+		{
+			return g >= best_g[node];
+		}
+		// Entries are kept as minimums over all hop counts up to their own,
+		// so a single lookup covers every label with less hops.
+		double* row = &hop_best_g[size_t(hop_row[node]) * (max_hops + 1)];
+		if (g >= row[n_hops])
+		{
+			return true;
+		}
+		for (size_t i = n_hops; i <= max_hops && row[i] > g; i++)
+		{
+			row[i] = g;
+		}
+		return false;
+	}
+
+	void RouteFinder::push(uint32_t node, uint32_t parent, uint32_t edge, uint32_t n_hops, double g, geo::point pos)
+	{
+		if (stamp[node] != search_id)
+		{
+			stamp[node] = search_id;
+			best_g[node] = INFINITY;
+			if (max_hops)
+			{
+				hop_row[node] = uint32_t(hop_best_g.size() / (max_hops + 1));
+				hop_best_g.resize(hop_best_g.size() + max_hops + 1, INFINITY);
+			}
+		}
+		if (is_dominated(node, n_hops, g))
+		{
+			return;
+		}
+		best_g[node] = g;
+		labels.push_back({ node, parent, edge, n_hops, g });
+		open.push_back({ g + get_heuristic(pos), uint32_t(labels.size() - 1) });
+		std::push_heap(open.begin(), open.end(), is_further);
+	}
+
+	//AwyDB definitions:
+
+	AwyDB::AwyDB(std::string awy_path, NavaidDB* navaid_ptr, common::ThreadPool* pool, std::atomic<bool>* stop)
+	{
+		sim_awy_db_path = awy_path;
+		navaid_db = navaid_ptr;
+		task_pool = pool;
+		stop_flag = stop;
+
+		awy_loaded = task_pool->submit([this]() -> int
+			{
+				navaid_db->get_load_status();
+				std::shared_ptr<const navaid_snapshot> nav = navaid_db->get_snapshot();
+				std::shared_ptr<awy_snapshot> snap = std::make_shared<awy_snapshot>();
+				int ret = load_airways(snap.get(), nav.get());
+				if (ret && !is_cancelled())
+				{
+					publish(snap);
+				}
+				return ret;
+			}).share();
+	}
+
+	int AwyDB::get_load_status()
+	{
+		task_pool->wait(awy_loaded);
+		return awy_loaded.get();
+	}
+
+	int AwyDB::build_reload(const navaid_snapshot* nav, std::shared_ptr<awy_snapshot>* out)
+	{
+		task_pool->wait(awy_loaded);
+
+		std::shared_ptr<awy_snapshot> snap = std::make_shared<awy_snapshot>();
+		if (!load_airways(snap.get(), nav) || is_cancelled() || !is_valid(snap.get()))
+		{
+			return 0;
+		}
+		*out = snap;
+		return 1;
+	}
+
+	bool AwyDB::is_valid(const awy_snapshot* snap)
+	{
+		if (snap->edges.size() == 0)
+		{
+			return false;
+		}
+		std::shared_ptr<const awy_snapshot> curr = get_snapshot();
+		double min_ratio = MIN_RELOAD_SIZE_RATIO;
+		return curr == nullptr || double(snap->edges.size()) >= double(curr->edges.size()) * min_ratio;
+	}
+
+	std::shared_ptr<const awy_snapshot> AwyDB::get_snapshot()
+	{
+		return std::atomic_load(&snapshot);
+	}
+
+	void AwyDB::publish(std::shared_ptr<const awy_snapshot> snap)
+	{
+		std::atomic_store(&snapshot, snap);
+	}
+
+	size_t AwyDB::find_route(std::string from, std::string to, awy_search_params params, std::vector<awy_leg>* out)
+	{
+		std::shared_ptr<const awy_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
+		{
+			return 0;
+		}
+
+		RouteFinder* finder = take_finder();
+		size_t n_legs = finder->find(snap.get(), from, to, &params, out);
+		release_finder(finder);
+		return n_legs;
+	}
+
+	size_t AwyDB::find_route(std::string from, geo::point from_pos, std::string to, geo::point to_pos,
+		awy_search_params params, std::vector<awy_leg>* out)
+	{
+		std::shared_ptr<const awy_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
+		{
+			return 0;
+		}
+
+		RouteFinder* finder = take_finder();
+		size_t n_legs = finder->find(snap.get(), from, from_pos, to, to_pos, &params, out);
+		release_finder(finder);
+		return n_legs;
+	}
+
+	std::future<size_t> AwyDB::find_route_async(std::string from, std::string to, awy_search_params params,
+		std::vector<awy_leg>* out)
+	{
+		return task_pool->submit([this, from, to, params, out]() -> size_t
+			{
+				return find_route(from, to, params, out);
+			});
+	}
+
+	AwyDB::~AwyDB()
+	{
+		for (size_t i = 0; i < free_finders.size(); i++)
+		{
+			delete free_finders[i];
+		}
+	}
+
+	RouteFinder* AwyDB::take_finder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(finder_mutex);
+			if (free_finders.size())
+			{
+				RouteFinder* finder = free_finders.back();
+				free_finders.pop_back();
+				return finder;
+			}
+		}
+		return new RouteFinder();
+	}
+
+	void AwyDB::release_finder(RouteFinder* finder)
+	{
+		std::lock_guard<std::mutex> lock(finder_mutex);
+		free_finders.push_back(finder);
+	}
+
+	bool AwyDB::is_cancelled()
+	{
+		return stop_flag->load(std::memory_order_relaxed);
+	}
+
+	int AwyDB::load_airways(awy_snapshot* snap, const navaid_snapshot* nav)
+	{
+		std::ifstream file(sim_awy_db_path);
+		if (nav == nullptr || !file.is_open())
+		{
+			return 0;
+		}
+
+		struct tmp_node
+		{
+			std::string id;
+			uint8_t type; // One of POI_types
+			std::vector<geo::point> candidates;
+			int64_t pos_idx; // Index into candidates once resolved
+			std::vector<uint32_t> adjacent;
+		};
+
+		struct tmp_segment
+		{
+			uint32_t from, to;
+			char dir;
+			uint16_t base_fl, top_fl;
+			std::string names;
+		};
+
+		// Fixes are identified by ident, region and type in earth_awy.dat
+		std::unordered_map<std::string, uint32_t> node_keys;
+		std::vector<tmp_node> nodes;
+		std::vector<tmp_segment> segments;
+
+		auto get_node = [&](std::string id, std::string region, int type) -> uint32_t
+		{
+			std::string key = id + " " + region + " " + std::to_string(type);
+			auto it = node_keys.find(key);
+			if (it != node_keys.end())
+			{
+				return it->second;
+			}
+			tmp_node node = { id, uint8_t(type == AWY_FIX ? POI_WAYPOINT : POI_NAVAID), {}, -1, {} };
+			if (type == AWY_FIX)
+			{
+				auto wpt = nav->waypoints.find(id);
+				if (wpt != nav->waypoints.end())
+				{
+					node.candidates = wpt->second;
+				}
+			}
+			else
+			{
+				auto navaid = nav->navaids.find(id);
+				if (navaid != nav->navaids.end())
+				{
+					for (size_t i = 0; i < navaid->second.size(); i++)
+					{
+						node.candidates.push_back(navaid->second[i].wpt);
+					}
+				}
+			}
+			nodes.push_back(node);
+			uint32_t idx = uint32_t(nodes.size() - 1);
+			node_keys[key] = idx;
+			return idx;
+		};
+
+		std::string line;
+		int i = 0;
+		int limit = N_AWY_LINES_IGNORE;
+		while (getline(file, line) && line != "99")
+		{
+			if (is_cancelled())
+			{
+				file.close();
+				return 0;
+			}
+			if (i >= limit && line != "")
+			{
+				std::stringstream s(line);
+				std::string id_1, region_1, id_2, region_2, dir, names;
+				int type_1, type_2, level;
+				tmp_segment seg;
+				s >> id_1 >> region_1 >> type_1 >> id_2 >> region_2 >> type_2 >> dir >> level >> seg.base_fl >> seg.top_fl >> seg.names;
+				if (!s.fail())
+				{
+					seg.from = get_node(id_1, region_1, type_1);
+					seg.to = get_node(id_2, region_2, type_2);
+					seg.dir = dir[0];
+					segments.push_back(seg);
+					nodes[seg.from].adjacent.push_back(seg.to);
+					nodes[seg.to].adjacent.push_back(seg.from);
+				}
+			}
+			i++;
+		}
+		file.close();
+
+		/*
+		* earth_awy.dat has no coordinates and the fix database has no regions,
+		* so idents with several candidates are resolved to the candidate that's
+		* closest to a neighbour on the airway. Fixes with a single candidate are
+		* resolved first and the rest is resolved outwards from them.
+		*/
+		std::vector<uint32_t> queue;
+		for (size_t j = 0; j < nodes.size(); j++)
+		{
+			if (nodes[j].candidates.size() == 1)
+			{
+				nodes[j].pos_idx = 0;
+				queue.push_back(uint32_t(j));
+			}
+		}
+		size_t next_unresolved = 0;
+		size_t q_pos = 0;
+		while (true)
+		{
+			if (q_pos == queue.size())
+			{
+				// Seed the next group of fixes that have no unique ident
+				while (next_unresolved < nodes.size() && (nodes[next_unresolved].pos_idx >= 0 ||
+					!nodes[next_unresolved].candidates.size()))
+				{
+					next_unresolved++;
+				}
+				if (next_unresolved == nodes.size())
+				{
+					break;
+				}
+				nodes[next_unresolved].pos_idx = 0;
+				queue.push_back(uint32_t(next_unresolved));
+			}
+			tmp_node* curr = &nodes[queue[q_pos]];
+			q_pos++;
+			geo::point curr_pos = curr->candidates[curr->pos_idx];
+			for (size_t j = 0; j < curr->adjacent.size(); j++)
+			{
+				tmp_node* adj = &nodes[curr->adjacent[j]];
+				if (adj->pos_idx >= 0 || !adj->candidates.size())
+				{
+					continue;
+				}
+				double min_dist = INFINITY;
+				for (size_t k = 0; k < adj->candidates.size(); k++)
+				{
+					double dist = curr_pos.getGreatCircleDistanceNM(adj->candidates[k]);
+					if (dist < min_dist)
+					{
+						min_dist = dist;
+						adj->pos_idx = int64_t(k);
+					}
+				}
+				queue.push_back(curr->adjacent[j]);
+			}
+		}
+
+		// Only the resolved fixes get node ids
+		std::vector<uint32_t> node_ids(nodes.size(), UINT32_MAX);
+		for (size_t j = 0; j < nodes.size(); j++)
+		{
+			if (nodes[j].pos_idx >= 0)
+			{
+				node_ids[j] = uint32_t(snap->node_names.size());
+				snap->node_names.push_back(nodes[j].id);
+				snap->node_pos.push_back(nodes[j].candidates[nodes[j].pos_idx]);
+				snap->node_types.push_back(nodes[j].type);
+				snap->node_ids[nodes[j].id].push_back(node_ids[j]);
+			}
+		}
+
+		std::vector<std::pair<uint32_t, awy_edge>> tmp_edges;
+		for (size_t j = 0; j < segments.size(); j++)
+		{
+			tmp_segment* seg = &segments[j];
+			uint32_t from = node_ids[seg->from];
+			uint32_t to = node_ids[seg->to];
+			if (from == UINT32_MAX || to == UINT32_MAX)
+			{
+				continue;
+			}
+			double dist_nm = snap->node_pos[from].getGreatCircleDistanceNM(snap->node_pos[to]);
+			// A segment can be a part of several airways, e.g. "J1-J2"
+			std::stringstream names(seg->names);
+			std::string name;
+			while (getline(names, name, '-'))
+			{
+				if (snap->awy_ids.find(name) == snap->awy_ids.end())
+				{
+					snap->awy_ids[name] = uint32_t(snap->awy_names.size());
+					snap->awy_names.push_back(name);
+				}
+				uint32_t awy = snap->awy_ids[name];
+				if (seg->dir != AWY_BACKWARD)
+				{
+					tmp_edges.push_back(std::make_pair(from, awy_edge{ to, awy, seg->base_fl, seg->top_fl, dist_nm }));
+				}
+				if (seg->dir != AWY_FORWARD)
+				{
+					tmp_edges.push_back(std::make_pair(to, awy_edge{ from, awy, seg->base_fl, seg->top_fl, dist_nm }));
+				}
+			}
+		}
+
+		// Group the edges by the node they leave from
+		size_t n_nodes = snap->node_names.size();
+		snap->edge_start.assign(n_nodes + 1, 0);
+		for (size_t j = 0; j < tmp_edges.size(); j++)
+		{
+			snap->edge_start[tmp_edges[j].first + 1]++;
+		}
+		for (size_t j = 0; j < n_nodes; j++)
+		{
+			snap->edge_start[j + 1] += snap->edge_start[j];
+		}
+		std::vector<uint32_t> fill(snap->edge_start.begin(), snap->edge_start.end() - 1);
+		snap->edges.resize(tmp_edges.size());
+		for (size_t j = 0; j < tmp_edges.size(); j++)
+		{
+			snap->edges[fill[tmp_edges[j].first]++] = tmp_edges[j].second;
+		}
+		return 1;
+	}
+
+	void get_snapshots(ArptDB* arpt_db, NavaidDB* navaid_db, AwyDB* awy_db, std::shared_ptr<const arpt_snapshot>* arpt_out,
+		std::shared_ptr<const navaid_snapshot>* nav_out, std::shared_ptr<const awy_snapshot>* awy_out)
+	{
+		while (true)
+		{
+			get_snapshots(arpt_db, navaid_db, arpt_out, nav_out);
+			*awy_out = awy_db->get_snapshot();
+			if (*nav_out == nullptr || *awy_out == nullptr || (*nav_out)->generation == (*awy_out)->generation)
+			{
+				return;
+			}
+			std::this_thread::yield();
+		}
+	}
+}
@@ -0,0 +1,200 @@
+/*
+	This header file contains the declarations of AwyDB and RouteFinder.
+	AwyDB loads the airway network from earth_awy.dat into a graph with
+	integer node ids. RouteFinder searches it with A*.
+*/
+
+#pragma once
+
+#include "nav_database.h"
+
+
+#define N_AWY_LINES_IGNORE 3; // Number of lines at the beginning of earth_awy.dat to ignore
+
+enum awy_fix_types
+{
+	AWY_NDB = 2,
+	AWY_VHF = 3,
+	AWY_FIX = 11
+};
+
+enum awy_directions
+{
+	AWY_BOTH_WAYS = 'N',
+	AWY_FORWARD = 'F', // Only from the first fix to the second one
+	AWY_BACKWARD = 'B'
+};
+
+namespace navdb
+{
+	struct awy_edge
+	{
+		uint32_t to;
+		uint32_t awy; // Index into awy_snapshot::awy_names
+		uint16_t base_fl, top_fl;
+		double dist_nm;
+	};
+
+	struct awy_snapshot
+	{
+		uint64_t generation = 0; // Same as the navaid snapshot that it was built from when reloaded
+		// Node data, indexed by node id
+		std::vector<std::string> node_names;
+		std::vector<geo::point> node_pos;
+		std::vector<uint8_t> node_types; // One of POI_types
+		// Edges that leave node i are edges[edge_start[i]] to edges[edge_start[i + 1] - 1]
+		std::vector<uint32_t> edge_start;
+		std::vector<awy_edge> edges;
+		std::vector<std::string> awy_names;
+		std::unordered_map<std::string, uint32_t> awy_ids; // Index into awy_names
+		// Idents aren't unique, so every ident maps to all of its nodes
+		std::unordered_map<std::string, std::vector<uint32_t>> node_ids;
+	};
+
+	// Returns the node called id that is closest to pos or UINT32_MAX if there is none.
+	uint32_t get_closest_node(const awy_snapshot* snap, std::string id, geo::point pos);
+
+	struct awy_search_params
+	{
+		int fl; // Segments whose altitude band doesn't contain fl are skipped. 0 to use all of them.
+		size_t max_hops; // Maximum number of segments in the route. 0 means no limit.
+	};
+
+	struct awy_leg
+	{
+		std::string awy; // Airway that leads to the fix. Empty for the first fix.
+		std::string id;
+		geo::point pos;
+	};
+
+	class RouteFinder
+	{
+	public:
+		// Finds the shortest route over airways between any of the fixes called from
+		// and any of the fixes called to. Both idents are looked up all over the world,
+		// so use the overloads below if the positions of the fixes are known.
+		// If params->max_hops is set, the route is the shortest one with at most that many segments.
+		// The first leg of the route is the origin fix.
+		// Returns number of legs written to out or 0 if there is no route.
+		size_t find(const awy_snapshot* snap, std::string from, std::string to, awy_search_params* params,
+			std::vector<awy_leg>* out);
+
+		// Same as above, between the nodes called from and to that are closest to from_pos and to_pos.
+		size_t find(const awy_snapshot* snap, std::string from, geo::point from_pos, std::string to,
+			geo::point to_pos, awy_search_params* params, std::vector<awy_leg>* out);
+
+		// Same as above, between two node ids.
+		size_t find(const awy_snapshot* snap, uint32_t from_node, uint32_t to_node, awy_search_params* params,
+			std::vector<awy_leg>* out);
+
+	private:
+		struct label
+		{
+			uint32_t node;
+			uint32_t parent; // Index of the previous label. UINT32_MAX for the origin.
+			uint32_t edge;
+			uint32_t n_hops;
+			double g;
+		};
+
+		struct open_entry
+		{
+			double f;
+			uint32_t label;
+		};
+
+		// Scratch data reused by every search. Per node entries are only
+		// valid if stamp matches the current search.
+		std::vector<label> labels;
+		std::vector<open_entry> open;
+		std::vector<double> best_g;
+		std::vector<uint32_t> stamp;
+		uint32_t search_id = 0;
+
+		// With a hop limit, a route that is longer but has less hops can still be
+		// the only one that reaches the target. Every node reached by the search gets
+		// a row of max_hops + 1 entries in hop_best_g. Entry h is the shortest distance
+		// to the node with at most h hops.
+		size_t max_hops = 0;
+		std::vector<uint32_t> hop_row;
+		std::vector<double> hop_best_g;
+
+		std::vector<geo::point> targets;
+		std::vector<uint8_t> is_target;
+
+		// Orders the open list as a min-heap on f.
+		static bool is_further(open_entry a, open_entry b);
+
+		double get_heuristic(geo::point pos);
+
+		size_t search(const awy_snapshot* snap, const uint32_t* from_nodes, size_t n_from, const uint32_t* to_nodes,
+			size_t n_to, awy_search_params* params, std::vector<awy_leg>* out);
+
+		// Returns true if a label with at most n_hops hops has reached node with a distance of g or less.
+		bool is_dominated(uint32_t node, uint32_t n_hops, double g);
+
+		void push(uint32_t node, uint32_t parent, uint32_t edge, uint32_t n_hops, double g, geo::point pos);
+	};
+
+	class AwyDB
+	{
+	public:
+		// Node positions come from navaid_ptr, so loading waits for it.
+		// The snapshot is published once loading is complete.
+		AwyDB(std::string awy_path, NavaidDB* navaid_ptr, common::ThreadPool* pool, std::atomic<bool>* stop);
+
+		int get_load_status();
+
+		// Builds a new graph on the calling thread, with node positions from nav.
+		// Returns 1 and writes it to out if it passes validation. Not thread safe.
+		int build_reload(const navaid_snapshot* nav, std::shared_ptr<awy_snapshot>* out);
+
+		// Returns the current snapshot or nullptr if nothing has been loaded yet.
+		std::shared_ptr<const awy_snapshot> get_snapshot();
+
+		void publish(std::shared_ptr<const awy_snapshot> snap);
+
+		// Runs RouteFinder::find on the calling thread.
+		size_t find_route(std::string from, std::string to, awy_search_params params, std::vector<awy_leg>* out);
+
+		// Same as above, between the fixes closest to from_pos and to_pos.
+		size_t find_route(std::string from, geo::point from_pos, std::string to, geo::point to_pos,
+			awy_search_params params, std::vector<awy_leg>* out);
+
+		// Runs find_route on the task pool. out is written before the future becomes ready.
+		std::future<size_t> find_route_async(std::string from, std::string to, awy_search_params params,
+			std::vector<awy_leg>* out);
+
+		~AwyDB();
+
+	private:
+		std::string sim_awy_db_path;
+		NavaidDB* navaid_db;
+		common::ThreadPool* task_pool;
+		std::atomic<bool>* stop_flag;
+		std::shared_future<int> awy_loaded;
+
+		// Only accessed through std::atomic_load/std::atomic_store.
+		std::shared_ptr<const awy_snapshot> snapshot;
+
+		// Finders that aren't used by a search. Each one keeps its scratch memory.
+		std::mutex finder_mutex;
+		std::vector<RouteFinder*> free_finders;
+
+		// Returns a free finder or a new one if all of them are in use.
+		RouteFinder* take_finder();
+
+		void release_finder(RouteFinder* finder);
+
+		bool is_cancelled();
+
+		bool is_valid(const awy_snapshot* snap);
+
+		// Returns 0 if the file couldn't be read or nav is nullptr.
+		int load_airways(awy_snapshot* snap, const navaid_snapshot* nav);
+	};
+
+	// Same as the overload in nav_database.h, but also takes the airway snapshot.
+	void get_snapshots(ArptDB* arpt_db, NavaidDB* navaid_db, AwyDB* awy_db, std::shared_ptr<const arpt_snapshot>* arpt_out,
+		std::shared_ptr<const navaid_snapshot>* nav_out, std::shared_ptr<const awy_snapshot>* awy_out);
+}
@@ -0,0 +1,34 @@
+/*
+	This source file contains definitions of the helpers declared in common.h.
+*/
+
+#include "common.h"
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+namespace common
+{
+	bool replace_file(std::string src, std::string dst)
+	{
+#ifdef _WIN32
+		// rename doesn't replace existing files on windows. Paths are UTF-8.
+		int src_len = MultiByteToWideChar(CP_UTF8, 0, src.c_str(), -1, nullptr, 0);
+		int dst_len = MultiByteToWideChar(CP_UTF8, 0, dst.c_str(), -1, nullptr, 0);
+		if (src_len <= 0 || dst_len <= 0)
+		{
+			return false;
+		}
+		std::wstring src_w(size_t(src_len), L'\0');
+		std::wstring dst_w(size_t(dst_len), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, src.c_str(), -1, &src_w[0], src_len);
+		MultiByteToWideChar(CP_UTF8, 0, dst.c_str(), -1, &dst_w[0], dst_len);
+		return MoveFileExW(src_w.c_str(), dst_w.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		// rename replaces dst atomically on POSIX.
+		return std::rename(src.c_str(), dst.c_str()) == 0;
+#endif
+	}
+}
@@ -13,4 +13,9 @@ namespace common
 		s << std::fixed << std::setprecision(precision) << num;
 		return s.str();
 	}
+
+	// Moves the file at src to dst. If dst exists, it's replaced in one step, so
+	// readers see either the old or the new file. If the move fails, dst is left
+	// as it was. Returns true on success.
+	bool replace_file(std::string src, std::string dst);
 }
@@ -6,11 +6,12 @@ namespace navdb
 
 	//ArptDB definitions:
 
-	ArptDB::ArptDB(std::unordered_map<std::string, airport_data>* a_db, std::unordered_map<std::string, std::unordered_map<std::string, runway_entry>>* r_db,
-				   std::string sim_arpt_path, std::string custom_arpt_path, std::string custom_rnw_path, double lat, double lon)
+	ArptDB::ArptDB(std::string sim_arpt_path, std::string custom_arpt_path, std::string custom_rnw_path, double lat, double lon,
+				   common::ThreadPool* pool, std::atomic<bool>* stop)
 	{
-		arpt_db = a_db;
-		rnw_db = r_db;
+		task_pool = pool;
+		stop_flag = stop;
+		build_snap = std::make_shared<arpt_snapshot>();
 		sim_arpt_db_path = sim_arpt_path;
 		custom_arpt_db_path = custom_arpt_path;
 		custom_rnw_db_path = custom_rnw_path;
@@ -18,38 +19,69 @@ namespace navdb
 		ac_lon = lon;
 		if (!does_db_exist(custom_arpt_db_path, custom_arpt_db_sign) || !does_db_exist(custom_rnw_db_path, custom_rnw_db_sign))
 		{
-			write_arpt_db.store(true, std::memory_order_seq_cst);
-			sim_db_loaded = std::async(std::launch::async, [](ArptDB* ptr) -> int { return ptr->load_from_sim_db(); }, this);
+			n_build_tasks.store(1, std::memory_order_seq_cst);
+			sim_db_loaded = task_pool->submit([this]() -> int
+				{
+					int ret = load_from_sim_db(build_snap.get());
+					finish_build(ret);
+					return ret;
+				}).share();
+			// Nothing waits for the caches, so they are written from the low priority lane.
 			if (!does_db_exist(custom_arpt_db_path, custom_arpt_db_sign))
 			{
 				apt_db_created = true;
-				arpt_db_task = std::async(std::launch::async, [](ArptDB* ptr) {ptr->write_to_arpt_db(); }, this);
+				arpt_db_task = task_pool->submit([this]()
+					{
+						std::shared_ptr<const arpt_snapshot> snap = wait_for_sim_db();
+						if (snap != nullptr)
+						{
+							write_to_arpt_db(snap.get());
+						}
+					}, common::TASK_LOW).share();
 			}
 			if (!does_db_exist(custom_rnw_db_path, custom_rnw_db_sign))
 			{
 				rnw_db_created = true;
-				rnw_db_task = std::async(std::launch::async, [](ArptDB* ptr) {ptr->write_to_rnw_db(); }, this);
+				rnw_db_task = task_pool->submit([this]()
+					{
+						std::shared_ptr<const arpt_snapshot> snap = wait_for_sim_db();
+						if (snap != nullptr)
+						{
+							write_to_rnw_db(snap.get());
+						}
+					}, common::TASK_LOW).share();
 			}
 		}
 		else
 		{
-			arpt_db_task = std::async(std::launch::async, [](ArptDB* ptr) {ptr->load_from_custom_arpt(); }, this);
-			rnw_db_task = std::async(std::launch::async, [](ArptDB* ptr) {ptr->load_from_custom_rnw(); }, this);
+			n_build_tasks.store(2, std::memory_order_seq_cst);
+			arpt_db_task = task_pool->submit([this]() { finish_build(load_from_custom_arpt(build_snap.get())); }).share();
+			rnw_db_task = task_pool->submit([this]() { finish_build(load_from_custom_rnw(build_snap.get())); }).share();
 		}
 	}
 
-	int ArptDB::get_load_status()
+	int ArptDB::build_reload(std::shared_ptr<arpt_snapshot>* out)
 	{
-		//Wait until all of the threads finish
-		arpt_db_task.get();
-		rnw_db_task.get();
-		if (apt_db_created || rnw_db_created)
+		// The initial load may still be writing the same cache files
+		wait_for_tasks();
+
+		std::shared_ptr<arpt_snapshot> snap = std::make_shared<arpt_snapshot>();
+		if (!load_from_sim_db(snap.get()) || is_cancelled() || !is_valid(snap.get()))
 		{
-			return sim_db_loaded.get();
+			return 0;
 		}
+		*out = snap;
 		return 1;
 	}
 
+	int ArptDB::get_load_status()
+	{
+		//Wait until all of the tasks finish. Waiting through the pool makes this
+		//safe to call from a pool task.
+		wait_for_tasks();
+		return build_status.load(std::memory_order_seq_cst);
+	}
+
 	bool ArptDB::does_db_exist(std::string path, std::string sign)
 	{
 		std::ifstream file(path, std::ifstream::in);
@@ -67,6 +99,28 @@ namespace navdb
 		return false;
 	}
 
+	bool ArptDB::commit_db_file(std::string tmp_path, std::string path, bool is_complete)
+	{
+		if (!is_complete)
+		{
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+		// The old file may be a valid cache, e.g. when the navdata is reloaded.
+		// It stays in place until the new one replaces it.
+		if (!common::replace_file(tmp_path, path))
+		{
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool ArptDB::is_cancelled()
+	{
+		return stop_flag->load(std::memory_order_relaxed);
+	}
+
 	double ArptDB::parse_runway(std::string line, std::vector<runway>* rnw)
 	{
 		std::stringstream s(line);
@@ -96,19 +150,7 @@ namespace navdb
 		return rnw_1.data.get_implied_length_meters();
 	}
 
-	void ArptDB::add_to_arpt_queue(arpt_data arpt)
-	{
-		std::lock_guard<std::mutex> lock(arpt_queue_mutex);
-		arpt_queue.push_back(arpt);
-	}
-
-	void ArptDB::add_to_rnw_queue(rnw_data rnw)
-	{
-		std::lock_guard<std::mutex> lock(rnw_queue_mutex);
-		rnw_queue.push_back(rnw);
-	}
-
-	int ArptDB::load_from_sim_db()
+	int ArptDB::load_from_sim_db(arpt_snapshot* snap)
 	{
 		std::ifstream file(sim_arpt_db_path, std::ifstream::in);
 		if (file.is_open())
@@ -122,6 +164,11 @@ namespace navdb
 
 			while (getline(file, line))
 			{
+				if (is_cancelled())
+				{
+					file.close();
+					return 0;
+				}
 				if (i >= limit && line != "")
 				{
 					int row_code;
@@ -151,15 +198,11 @@ namespace navdb
 							tmp_arpt.data.pos.lat_deg /= n_runways;
 							tmp_arpt.data.pos.lon_deg /= n_runways;
 
-							// Update queues
-							add_to_arpt_queue(tmp_arpt);
-							add_to_rnw_queue(tmp_rnw);
-
 							// Update internal data 
 							std::pair<std::string, airport_data> apt = std::make_pair(tmp_arpt.icao, tmp_arpt.data);
 							std::pair<std::string, std::unordered_map<std::string, runway_entry>> rnw_pair = std::make_pair(tmp_arpt.icao, apt_runways);
-							arpt_db->insert(apt);
-							rnw_db->insert(rnw_pair);
+							snap->airports.insert(apt);
+							snap->runways.insert(rnw_pair);
 						}
 
 						tmp_arpt.icao = "";
@@ -213,74 +256,75 @@ namespace navdb
 				i++;
 			}
 			file.close();
-			write_arpt_db.store(false, std::memory_order_seq_cst);
 			return 1;
 		}
 		file.close();
 		return 0;
 	}
 
-	void ArptDB::write_to_arpt_db()
+	void ArptDB::write_to_arpt_db(const arpt_snapshot* snap)
 	{
-		std::ofstream out(custom_arpt_db_path, std::ofstream::out);
+		std::string tmp_path = custom_arpt_db_path + DB_TMP_SUFFIX;
+		std::ofstream out(tmp_path, std::ofstream::out);
 		out << "ARPTDB\n";
-		while (arpt_queue.size() || write_arpt_db.load(std::memory_order_seq_cst))
+		uint8_t precision = N_DOUBLE_OUT_PRECISION;
+		for (auto it = snap->airports.begin(); it != snap->airports.end(); it++)
 		{
-			if (arpt_queue.size())
+			if (is_cancelled())
 			{
-				std::lock_guard<std::mutex> lock(arpt_queue_mutex);
-				uint8_t precision = N_DOUBLE_OUT_PRECISION;
-				arpt_data data = arpt_queue[0];
-				arpt_queue.erase(arpt_queue.begin());
+				break;
+			}
+			const airport_data* data = &it->second;
 
-				std::string arpt_lat = common::double_to_str(data.data.pos.lat_deg, precision);
-				std::string arpt_lon = common::double_to_str(data.data.pos.lon_deg, precision);
-				std::string arpt_icao_pos = data.icao + " " + arpt_lat + " " + arpt_lon;
+			std::string arpt_lat = common::double_to_str(data->pos.lat_deg, precision);
+			std::string arpt_lon = common::double_to_str(data->pos.lon_deg, precision);
+			std::string arpt_icao_pos = it->first + " " + arpt_lat + " " + arpt_lon;
 
-				out << arpt_icao_pos << " " << data.data.elevation_ft << " " << data.data.transition_alt_ft << " " << data.data.transition_level << "\n";
-			}
+			out << arpt_icao_pos << " " << data->elevation_ft << " " << data->transition_alt_ft << " " << data->transition_level << "\n";
 		}
 		out.close();
+		commit_db_file(tmp_path, custom_arpt_db_path, !out.fail() && !is_cancelled());
 	}
 
-	void ArptDB::write_to_rnw_db()
+	void ArptDB::write_to_rnw_db(const arpt_snapshot* snap)
 	{
-		std::ofstream out(custom_rnw_db_path, std::ofstream::out);
+		std::string tmp_path = custom_rnw_db_path + DB_TMP_SUFFIX;
+		std::ofstream out(tmp_path, std::ofstream::out);
 		out << "RNWDB\n";
-		while (rnw_queue.size() || write_arpt_db.load(std::memory_order_seq_cst))
+		uint8_t precision = N_DOUBLE_OUT_PRECISION;
+		for (auto it = snap->runways.begin(); it != snap->runways.end(); it++)
 		{
-			if (rnw_queue.size())
+			if (is_cancelled())
 			{
-				std::lock_guard<std::mutex> lock(rnw_queue_mutex);
-				uint8_t precision = N_DOUBLE_OUT_PRECISION;
-				rnw_data data = rnw_queue[0];
-				rnw_queue.erase(rnw_queue.begin());
-				for (int i = 0; i < data.runways.size(); i++)
-				{
-					std::string rnw_start_lat = common::double_to_str(data.runways[i].data.start.lat_deg, precision);
-					std::string rnw_start_lon = common::double_to_str(data.runways[i].data.start.lon_deg, precision);
-					std::string rnw_end_lat = common::double_to_str(data.runways[i].data.end.lat_deg, precision);
-					std::string rnw_end_lon = common::double_to_str(data.runways[i].data.end.lon_deg, precision);
+				break;
+			}
+			// Runways of an airport have to be on consecutive lines
+			for (auto rnw = it->second.begin(); rnw != it->second.end(); rnw++)
+			{
+				std::string rnw_start_lat = common::double_to_str(rnw->second.start.lat_deg, precision);
+				std::string rnw_start_lon = common::double_to_str(rnw->second.start.lon_deg, precision);
+				std::string rnw_end_lat = common::double_to_str(rnw->second.end.lat_deg, precision);
+				std::string rnw_end_lon = common::double_to_str(rnw->second.end.lon_deg, precision);
 
-					std::string rnw_start = rnw_start_lat + " " + rnw_start_lon;
-					std::string rnw_end = rnw_end_lat + " " + rnw_end_lon;
+				std::string rnw_start = rnw_start_lat + " " + rnw_start_lon;
+				std::string rnw_end = rnw_end_lat + " " + rnw_end_lon;
 
-					std::string rnw_icao_pos = data.icao + " " + data.runways[i].id + " " + rnw_start + " " + rnw_end;
+				std::string rnw_icao_pos = it->first + " " + rnw->first + " " + rnw_start + " " + rnw_end;
 
-					out << rnw_icao_pos << " " << data.runways[i].data.displ_threshold_m << "\n";
-				}
+				out << rnw_icao_pos << " " << rnw->second.displ_threshold_m << "\n";
 			}
 		}
 		out.close();
+		commit_db_file(tmp_path, custom_rnw_db_path, !out.fail() && !is_cancelled());
 	}
 
-	void ArptDB::load_from_custom_arpt()
+	int ArptDB::load_from_custom_arpt(arpt_snapshot* snap)
 	{
 		std::ifstream file(custom_arpt_db_path, std::ifstream::in);
 		if (file.is_open())
 		{
 			std::string line;
-			while (getline(file, line))
+			while (getline(file, line) && !is_cancelled())
 			{
 				if (line != custom_arpt_db_sign)
 				{
@@ -289,15 +333,17 @@ namespace navdb
 					std::stringstream s(line);
 					s >> icao >> tmp.pos.lat_deg >> tmp.pos.lon_deg >> tmp.elevation_ft >> tmp.transition_alt_ft >> tmp.transition_level;
 					std::pair<std::string, airport_data> tmp_pair = std::make_pair(icao, tmp);
-					arpt_db->insert(tmp_pair);
+					snap->airports.insert(tmp_pair);
 				}
 			}
 			file.close();
+			return !is_cancelled();
 		}
 		file.close();
+		return 0;
 	}
 
-	void ArptDB::load_from_custom_rnw()
+	int ArptDB::load_from_custom_rnw(arpt_snapshot* snap)
 	{
 		std::ifstream file(custom_rnw_db_path, std::ifstream::in);
 		if (file.is_open())
@@ -305,7 +351,7 @@ namespace navdb
 			std::string line;
 			std::string curr_icao = "";
 			std::unordered_map<std::string, runway_entry> runways = {};
-			while (getline(file, line))
+			while (getline(file, line) && !is_cancelled())
 			{
 				if (line != custom_rnw_db_sign)
 				{
@@ -318,7 +364,7 @@ namespace navdb
 						if (curr_icao != "")
 						{
 							std::pair<std::string, std::unordered_map<std::string, runway_entry>> icao_runways = std::make_pair(curr_icao, runways);
-							rnw_db->insert(icao_runways);
+							snap->runways.insert(icao_runways);
 						}
 						curr_icao = icao;
 						runways.clear();
@@ -328,17 +374,29 @@ namespace navdb
 					runways.insert(str_rnw_entry);
 				}
 			}
+			if (curr_icao != "" && !is_cancelled())
+			{
+				std::pair<std::string, std::unordered_map<std::string, runway_entry>> icao_runways = std::make_pair(curr_icao, runways);
+				snap->runways.insert(icao_runways);
+			}
 			file.close();
+			return !is_cancelled();
 		}
 		file.close();
+		return 0;
 	}
 
 	size_t ArptDB::get_airport_data(std::string icao_code, airport_data* out)
 	{
-		std::lock_guard<std::mutex> lock(arpt_db_mutex);
-		if (arpt_db->find(icao_code) != arpt_db->end())
+		std::shared_ptr<const arpt_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
 		{
-			airport_data* tmp = &arpt_db->at(icao_code);
+			return 0;
+		}
+		auto it = snap->airports.find(icao_code);
+		if (it != snap->airports.end())
+		{
+			const airport_data* tmp = &it->second;
 			out->pos.lat_deg = tmp->pos.lat_deg;
 			out->pos.lon_deg = tmp->pos.lon_deg;
 			out->elevation_ft = tmp->elevation_ft;
@@ -349,11 +407,80 @@ namespace navdb
 		return 0;
 	}
 
+	std::shared_ptr<const arpt_snapshot> ArptDB::get_snapshot()
+	{
+		return std::atomic_load(&snapshot);
+	}
+
+	void ArptDB::publish(std::shared_ptr<const arpt_snapshot> snap)
+	{
+		std::atomic_store(&snapshot, snap);
+	}
+
+	std::shared_ptr<const arpt_snapshot> ArptDB::wait_for_sim_db()
+	{
+		// Waiting through the pool keeps the worker busy with other tasks,
+		// so the loader can't be starved by the writers.
+		task_pool->wait(sim_db_loaded);
+		if (!sim_db_loaded.get())
+		{
+			// Don't cache a database that wasn't loaded completely
+			return nullptr;
+		}
+		return get_snapshot();
+	}
+
+	void ArptDB::wait_for_tasks()
+	{
+		if (sim_db_loaded.valid())
+		{
+			task_pool->wait(sim_db_loaded);
+		}
+		if (arpt_db_task.valid())
+		{
+			task_pool->wait(arpt_db_task);
+		}
+		if (rnw_db_task.valid())
+		{
+			task_pool->wait(rnw_db_task);
+		}
+	}
+
+	bool ArptDB::is_valid(const arpt_snapshot* snap)
+	{
+		if (snap->airports.size() == 0 || snap->airports.size() != snap->runways.size())
+		{
+			return false;
+		}
+		// A much smaller database than the current one is most likely a truncated file
+		std::shared_ptr<const arpt_snapshot> curr = get_snapshot();
+		double min_ratio = MIN_RELOAD_SIZE_RATIO;
+		return curr == nullptr || double(snap->airports.size()) >= double(curr->airports.size()) * min_ratio;
+	}
+
+	void ArptDB::finish_build(int loader_ret)
+	{
+		if (!loader_ret)
+		{
+			is_build_failed.store(true, std::memory_order_relaxed);
+		}
+		// The last loader to finish publishes the snapshot.
+		// acq_rel makes the other loaders' inserts visible here.
+		if (n_build_tasks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			// A partial database would also become the baseline for the reload size check
+			if (!is_cancelled() && !is_build_failed.load(std::memory_order_relaxed) && is_valid(build_snap.get()))
+			{
+				publish(build_snap);
+				build_status.store(1, std::memory_order_seq_cst);
+			}
+			build_snap = nullptr;
+		}
+	}
+
 	//NavDB definitions:
 
-	NavaidDB::NavaidDB(std::string wpt_path, std::string navaid_path,
-				 std::unordered_map<std::string, std::vector<geo::point>>* wpt_db,
-				 std::unordered_map<std::string, std::vector<navaid_entry>>* navaid_db)
+	NavaidDB::NavaidDB(std::string wpt_path, std::string navaid_path, common::ThreadPool* pool, std::atomic<bool>* stop)
 	{
 		//Pre-defined stuff
 
@@ -366,16 +493,45 @@ namespace navdb
 		sim_wpt_db_path = wpt_path;
 		sim_navaid_db_path = navaid_path;
 
-		wpt_cache = wpt_db;
-		navaid_cache = navaid_db;
+		task_pool = pool;
+		stop_flag = stop;
+		build_snap = std::make_shared<navaid_snapshot>();
+		n_build_tasks.store(2, std::memory_order_seq_cst);
 
-		wpt_loaded = std::async(std::launch::async, [](NavaidDB* db) -> int {return db->load_waypoints();}, this);
-		navaid_loaded = std::async(std::launch::async, [](NavaidDB* db) -> int {return db->load_navaids();}, this);
+		wpt_loaded = task_pool->submit([this]() -> int
+			{
+				int ret = load_waypoints(build_snap.get());
+				finish_build(ret);
+				return ret;
+			}).share();
+		navaid_loaded = task_pool->submit([this]() -> int
+			{
+				int ret = load_navaids(build_snap.get());
+				finish_build(ret);
+				return ret;
+			}).share();
 	}
 
 	int NavaidDB::get_load_status()
 	{
-		return wpt_loaded.get() * navaid_loaded.get();
+		task_pool->wait(wpt_loaded);
+		task_pool->wait(navaid_loaded);
+		return build_status.load(std::memory_order_seq_cst);
+	}
+
+	int NavaidDB::build_reload(std::shared_ptr<navaid_snapshot>* out)
+	{
+		// Only one build at a time, so that the initial load can't overwrite the new data
+		task_pool->wait(wpt_loaded);
+		task_pool->wait(navaid_loaded);
+
+		std::shared_ptr<navaid_snapshot> snap = std::make_shared<navaid_snapshot>();
+		if (!load_waypoints(snap.get()) || !load_navaids(snap.get()) || is_cancelled() || !is_valid(snap.get()))
+		{
+			return 0;
+		}
+		*out = snap;
+		return 1;
 	}
 
 	NavaidDB::~NavaidDB()
@@ -384,7 +540,7 @@ namespace navdb
 
 	}
 
-	int NavaidDB::load_waypoints()
+	int NavaidDB::load_waypoints(navaid_snapshot* snap)
 	{
 		std::ifstream file(sim_wpt_db_path);
 		if (file.is_open())
@@ -394,6 +550,11 @@ namespace navdb
 			int limit = N_NAVAID_LINES_IGNORE;
 			while (getline(file, line) && line != "99")
 			{
+				if (is_cancelled())
+				{
+					file.close();
+					return 0;
+				}
 				if (i >= limit)
 				{
 					//Construct a navaid entry.
@@ -406,11 +567,11 @@ namespace navdb
 					tmp.lat_deg = lat;
 					tmp.lon_deg = lon;
 					//Find the navaid in the database by name.
-					if (wpt_cache->find(name) != wpt_cache->end())
+					if (snap->waypoints.find(name) != snap->waypoints.end())
 					{
 						//If there is a navaid with the same name in the database,
 						//add new entry to the vector.
-						wpt_cache->at(name).push_back(tmp);
+						snap->waypoints.at(name).push_back(tmp);
 					}
 					else
 					{
@@ -418,7 +579,7 @@ namespace navdb
 						//add a vector with tmp
 						std::pair<std::string, std::vector<geo::point>> p;
 						p = std::make_pair(name, std::vector<geo::point>{tmp});
-						wpt_cache->insert(p);
+						snap->waypoints.insert(p);
 					}
 				}
 				i++;
@@ -429,7 +590,7 @@ namespace navdb
 		return 0;
 	}
 
-	int NavaidDB::load_navaids()
+	int NavaidDB::load_navaids(navaid_snapshot* snap)
 	{
 		std::ifstream file(sim_navaid_db_path);
 		if (file.is_open())
@@ -439,6 +600,11 @@ namespace navdb
 			int limit = N_NAVAID_LINES_IGNORE;
 			while (getline(file, line))
 			{
+				if (is_cancelled())
+				{
+					file.close();
+					return 0;
+				}
 				std::string check_val;
 				std::stringstream s(line);
 				s >> check_val;
@@ -461,12 +627,12 @@ namespace navdb
 					tmp.mag_var = mag_var;
 					tmp.freq = freq;
 					//Find the navaid in the database by name.
-					if (navaid_cache->find(name) != navaid_cache->end())
+					if (snap->navaids.find(name) != snap->navaids.end())
 					{
 						//If there is a navaid with the same name in the database,
 						//add new entry to the vector.
 						bool is_colocated = false;
-						std::vector<navaid_entry>* entries = &navaid_cache->at(name);
+						std::vector<navaid_entry>* entries = &snap->navaids.at(name);
 						for (int i = 0; i < entries->size(); i++)
 						{
 							navaid_entry* navaid = &entries->at(i);
@@ -495,7 +661,7 @@ namespace navdb
 						//add a vector with tmp
 						std::pair<std::string, std::vector<navaid_entry>> p;
 						p = std::make_pair(name, std::vector<navaid_entry>{tmp});
-						navaid_cache->insert(p);
+						snap->navaids.insert(p);
 					}
 				}
 				else if (check_val == "99")
@@ -505,6 +671,7 @@ namespace navdb
 				i++;
 			}
 			file.close();
+			build_recv_index(snap);
 			return 1;
 		}
 		return 0;
@@ -512,9 +679,15 @@ namespace navdb
 
 	size_t NavaidDB::get_wpt_info(std::string id, std::vector<geo::point>* out)
 	{
-		if (wpt_cache->find(id) != wpt_cache->end())
+		std::shared_ptr<const navaid_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
+		{
+			return 0;
+		}
+		auto it = snap->waypoints.find(id);
+		if (it != snap->waypoints.end())
 		{
-			std::vector<geo::point>* waypoints = &wpt_cache->at(id);
+			const std::vector<geo::point>* waypoints = &it->second;
 			size_t n_waypoints = waypoints->size();
 			for (int i = 0; i < n_waypoints; i++)
 			{
@@ -527,9 +700,15 @@ namespace navdb
 
 	size_t NavaidDB::get_navaid_info(std::string id, std::vector<navaid_entry>* out)
 	{
-		if (navaid_cache->find(id) != navaid_cache->end())
+		std::shared_ptr<const navaid_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
+		{
+			return 0;
+		}
+		auto it = snap->navaids.find(id);
+		if (it != snap->navaids.end())
 		{
-			std::vector<navaid_entry>* navaids = &navaid_cache->at(id);
+			const std::vector<navaid_entry>* navaids = &it->second;
 			size_t n_navaids = navaids->size();
 			for (size_t i = 0; i < n_navaids; i++)
 			{
@@ -540,6 +719,320 @@ namespace navdb
 		return 0;
 	}
 
+	size_t NavaidDB::update_in_range(geo::point ac_pos)
+	{
+		std::shared_ptr<const navaid_snapshot> snap = get_snapshot();
+		if (snap == nullptr)
+		{
+			return 0;
+		}
+
+		std::lock_guard<std::mutex> lock(in_range_mutex);
+		size_t n_changed = 0;
+		if (snap != in_range_snap)
+		{
+			// A new database was published. Start over with its index.
+			n_changed = in_range.size();
+			in_range_snap = snap;
+			ac_tile = INT64_MAX;
+			tile_candidates = nullptr;
+			is_in_range.assign(snap->recv_navaids.size(), 0);
+			in_range_slot.assign(snap->recv_navaids.size(), 0);
+			in_range.clear();
+			in_range_idx.clear();
+		}
+		const std::unordered_map<int64_t, std::vector<uint32_t>>& recv_tiles = snap->recv_tiles;
+		int64_t new_tile = get_tile_key(ac_pos);
+		if (new_tile != ac_tile)
+		{
+			// Only the navaids that are in the tile we're leaving but not in the
+			// new one exit the set here. The rest is handled by the range check below.
+			const std::vector<uint32_t>* new_candidates = nullptr;
+			auto it = recv_tiles.find(new_tile);
+			if (it != recv_tiles.end())
+			{
+				new_candidates = &it->second;
+				for (size_t i = 0; i < new_candidates->size(); i++)
+				{
+					is_in_range[new_candidates->at(i)] |= RECV_IN_TILE;
+				}
+			}
+			if (tile_candidates != nullptr)
+			{
+				for (size_t i = 0; i < tile_candidates->size(); i++)
+				{
+					uint32_t idx = tile_candidates->at(i);
+					if (is_in_range[idx] == RECV_IN_RANGE)
+					{
+						is_in_range[idx] = 0;
+						remove_in_range(idx);
+						n_changed++;
+					}
+				}
+			}
+			if (new_candidates != nullptr)
+			{
+				for (size_t i = 0; i < new_candidates->size(); i++)
+				{
+					is_in_range[new_candidates->at(i)] &= RECV_IN_RANGE;
+				}
+			}
+			ac_tile = new_tile;
+			tile_candidates = new_candidates;
+		}
+
+		if (tile_candidates != nullptr)
+		{
+			for (size_t i = 0; i < tile_candidates->size(); i++)
+			{
+				uint32_t idx = tile_candidates->at(i);
+				const recv_navaid* navaid = &snap->recv_navaids[idx];
+				double dist_nm = ac_pos.getGreatCircleDistanceNM(navaid->data.wpt);
+				uint8_t curr_in_range = dist_nm <= double(navaid->data.max_recv) ? RECV_IN_RANGE : 0;
+				if (curr_in_range != is_in_range[idx])
+				{
+					is_in_range[idx] = curr_in_range;
+					if (curr_in_range)
+					{
+						add_in_range(snap.get(), idx);
+					}
+					else
+					{
+						remove_in_range(idx);
+					}
+					n_changed++;
+				}
+				if (curr_in_range)
+				{
+					// Navaids that stay in range only get their distance and bearing updated.
+					double brng_deg = ac_pos.getGreatCircleBearingDeg(navaid->data.wpt);
+					if (brng_deg < 0) // Navaid is due north or due south
+					{
+						brng_deg = navaid->data.wpt.lat_deg >= ac_pos.lat_deg ? 0 : 180;
+					}
+					navaid_in_range* item = &in_range[in_range_slot[idx]];
+					item->dist_nm = dist_nm;
+					item->brng_deg = brng_deg;
+				}
+			}
+		}
+		return n_changed;
+	}
+
+	size_t NavaidDB::get_navaids_in_range(std::vector<navaid_in_range>* out)
+	{
+		std::lock_guard<std::mutex> lock(in_range_mutex);
+		for (size_t i = 0; i < in_range.size(); i++)
+		{
+			out->push_back(in_range[i]);
+		}
+		return in_range.size();
+	}
+
+	size_t NavaidDB::get_dme_dme_pairs(std::vector<dme_dme_pair>* out, size_t max_pairs)
+	{
+		std::lock_guard<std::mutex> lock(in_range_mutex);
+		double min_angle = MIN_DME_DME_ANGLE_DEG;
+		double max_angle = 180.0 - min_angle;
+		std::vector<dme_dme_pair> pairs;
+		for (size_t i = 0; i < in_range.size(); i++)
+		{
+			if (!is_dme_type(in_range[i].data.type))
+			{
+				continue;
+			}
+			for (size_t j = i + 1; j < in_range.size(); j++)
+			{
+				if (!is_dme_type(in_range[j].data.type))
+				{
+					continue;
+				}
+				double angle = abs(in_range[i].brng_deg - in_range[j].brng_deg);
+				if (angle > 180.0)
+				{
+					angle = 360.0 - angle;
+				}
+				if (angle >= min_angle && angle <= max_angle)
+				{
+					pairs.push_back({ in_range[i], in_range[j], sin(angle * DEG_TO_RAD) });
+				}
+			}
+		}
+		// Prefer the best crossing angle. Closer stations win ties.
+		std::sort(pairs.begin(), pairs.end(), [](const dme_dme_pair& a, const dme_dme_pair& b) -> bool {
+			if (a.score != b.score)
+			{
+				return a.score > b.score;
+			}
+			double dist_a = a.first.dist_nm + a.second.dist_nm;
+			double dist_b = b.first.dist_nm + b.second.dist_nm;
+			return dist_a < dist_b;
+		});
+		size_t n_pairs = pairs.size();
+		if (n_pairs > max_pairs)
+		{
+			n_pairs = max_pairs;
+		}
+		for (size_t i = 0; i < n_pairs; i++)
+		{
+			out->push_back(pairs[i]);
+		}
+		return n_pairs;
+	}
+
+	void NavaidDB::add_in_range(const navaid_snapshot* snap, uint32_t idx)
+	{
+		const recv_navaid* navaid = &snap->recv_navaids[idx];
+		in_range_slot[idx] = uint32_t(in_range.size());
+		in_range.push_back({ navaid->id, navaid->data, 0, 0 });
+		in_range_idx.push_back(idx);
+	}
+
+	void NavaidDB::remove_in_range(uint32_t idx)
+	{
+		uint32_t slot = in_range_slot[idx];
+		size_t last = in_range.size() - 1;
+		if (slot != last)
+		{
+			in_range[slot] = std::move(in_range[last]);
+			in_range_idx[slot] = in_range_idx[last];
+			in_range_slot[in_range_idx[slot]] = slot;
+		}
+		in_range.pop_back();
+		in_range_idx.pop_back();
+	}
+
+	bool NavaidDB::is_recv_type(uint16_t type)
+	{
+		return type == NAV_VOR || type == NAV_DME || type == NAV_DME_ONLY || type == NAV_VOR_DME;
+	}
+
+	bool NavaidDB::is_dme_type(uint16_t type)
+	{
+		return type == NAV_DME || type == NAV_DME_ONLY || type == NAV_VOR_DME;
+	}
+
+	int64_t NavaidDB::get_tile_key(int lat_idx, int lon_idx)
+	{
+		return (int64_t(lat_idx) << 32) | uint32_t(lon_idx);
+	}
+
+	int64_t NavaidDB::get_tile_key(geo::point pos)
+	{
+		double tile_size = N_RECV_TILE_DEG;
+		int lat_idx = int(floor(pos.lat_deg / tile_size));
+		int lon_idx = int(floor(pos.lon_deg / tile_size));
+		return get_tile_key(lat_idx, lon_idx);
+	}
+
+	bool NavaidDB::is_cancelled()
+	{
+		return stop_flag->load(std::memory_order_relaxed);
+	}
+
+	std::shared_ptr<const navaid_snapshot> NavaidDB::get_snapshot()
+	{
+		return std::atomic_load(&snapshot);
+	}
+
+	void NavaidDB::publish(std::shared_ptr<const navaid_snapshot> snap)
+	{
+		std::atomic_store(&snapshot, snap);
+	}
+
+	bool NavaidDB::is_valid(const navaid_snapshot* snap)
+	{
+		if (snap->waypoints.size() == 0 || snap->navaids.size() == 0)
+		{
+			return false;
+		}
+		std::shared_ptr<const navaid_snapshot> curr = get_snapshot();
+		double min_ratio = MIN_RELOAD_SIZE_RATIO;
+		return curr == nullptr || (double(snap->waypoints.size()) >= double(curr->waypoints.size()) * min_ratio &&
+			double(snap->navaids.size()) >= double(curr->navaids.size()) * min_ratio);
+	}
+
+	void NavaidDB::finish_build(int loader_ret)
+	{
+		if (!loader_ret)
+		{
+			is_build_failed.store(true, std::memory_order_relaxed);
+		}
+		if (n_build_tasks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			if (!is_cancelled() && !is_build_failed.load(std::memory_order_relaxed) && is_valid(build_snap.get()))
+			{
+				publish(build_snap);
+				build_status.store(1, std::memory_order_seq_cst);
+			}
+			build_snap = nullptr;
+		}
+	}
+
+	void NavaidDB::build_recv_index(navaid_snapshot* snap)
+	{
+		/*
+		* Puts every VOR/DME into each tile that its reception circle overlaps.
+		* This way the candidates for the aircraft's position are found by a
+		* single look up.
+		*/
+		double tile_size = N_RECV_TILE_DEG;
+		int n_lon_tiles = int(360.0 / tile_size);
+		for (auto it = snap->navaids.begin(); it != snap->navaids.end(); it++)
+		{
+			for (size_t i = 0; i < it->second.size(); i++)
+			{
+				navaid_entry* navaid = &it->second[i];
+				if (!is_recv_type(navaid->type) || navaid->max_recv == 0)
+				{
+					continue;
+				}
+				uint32_t idx = uint32_t(snap->recv_navaids.size());
+				snap->recv_navaids.push_back({ it->first, *navaid });
+
+				double lat_dev = double(navaid->max_recv) / 60.0;
+				double lat_min = navaid->wpt.lat_deg - lat_dev;
+				double lat_max = navaid->wpt.lat_deg + lat_dev;
+				double cos_lat = cos(std::max(abs(lat_min), abs(lat_max)) * DEG_TO_RAD);
+				double lon_dev = 180.0;
+				if (lat_max < 90.0 && lat_min > -90.0 && cos_lat * 360.0 > lat_dev * 2)
+				{
+					lon_dev = lat_dev / cos_lat;
+				}
+				lat_min = std::max(lat_min, -90.0);
+				lat_max = std::min(lat_max, 90.0);
+
+				int lat_start = int(floor(lat_min / tile_size));
+				int lat_end = int(floor(lat_max / tile_size));
+				int lon_start = int(floor((navaid->wpt.lon_deg - lon_dev) / tile_size));
+				int lon_end = int(floor((navaid->wpt.lon_deg + lon_dev) / tile_size));
+				if (lon_end - lon_start >= n_lon_tiles)
+				{
+					lon_start = -n_lon_tiles / 2;
+					lon_end = lon_start + n_lon_tiles - 1;
+				}
+
+				for (int lat_idx = lat_start; lat_idx <= lat_end; lat_idx++)
+				{
+					for (int lon_idx = lon_start; lon_idx <= lon_end; lon_idx++)
+					{
+						// Wrap around the antimeridian
+						int lon_wrapped = lon_idx;
+						if (lon_wrapped < -n_lon_tiles / 2)
+						{
+							lon_wrapped += n_lon_tiles;
+						}
+						else if (lon_wrapped >= n_lon_tiles / 2)
+						{
+							lon_wrapped -= n_lon_tiles;
+						}
+						snap->recv_tiles[get_tile_key(lat_idx, lon_wrapped)].push_back(idx);
+					}
+				}
+			}
+		}
+	}
+
 	NavDB::NavDB(NavaidDB* navaid_ptr, ArptDB* arpt_ptr)
 	{
 		navaid_db = navaid_ptr;
@@ -577,4 +1070,43 @@ namespace navdb
 		}
 		return 0;
 	}
+
+	size_t NavDB::get_poi_info(std::string id, uint8_t type, POI* out)
+	{
+		size_t n_found = 0;
+		if (type == POI_AIRPORT)
+		{
+			n_found = arpt_db->get_airport_data(id, &out->arpt.data);
+		}
+		else if (type == POI_NAVAID)
+		{
+			n_found = navaid_db->get_navaid_info(id, &out->navaid);
+		}
+		else if (type == POI_WAYPOINT)
+		{
+			n_found = navaid_db->get_wpt_info(id, &out->wpt);
+		}
+		if (n_found)
+		{
+			out->id = id;
+			out->type = type;
+		}
+		return n_found;
+	}
+
+	void get_snapshots(ArptDB* arpt_db, NavaidDB* navaid_db, std::shared_ptr<const arpt_snapshot>* arpt_out,
+		std::shared_ptr<const navaid_snapshot>* nav_out)
+	{
+		while (true)
+		{
+			*arpt_out = arpt_db->get_snapshot();
+			*nav_out = navaid_db->get_snapshot();
+			if (*arpt_out == nullptr || *nav_out == nullptr || (*arpt_out)->generation == (*nav_out)->generation)
+			{
+				return;
+			}
+			// The reload is between its publishes. It finishes them right away.
+			std::this_thread::yield();
+		}
+	}
 }
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <cstdint>
 #include <unordered_map>
 #include <fstream>
 #include <future>
 #include <utility>
 #include <atomic>
 #include <mutex>
+#include <memory>
+#include <cstdio>
 #include "common.h"
+#include "thread_pool.h"
 #include "geo_utils.h"
 
 
@@ -17,6 +22,10 @@
 #define N_RNW_ITEMS_IGNORE_END 5;
 #define N_DOUBLE_OUT_PRECISION 9; // Number of indices after the decimal in the string representation of a double number
 #define MIN_RWY_LENGTH_M 2000; // If the longest runway of the airport is less than this, the airport will not be included in the database
+#define N_RECV_TILE_DEG 1; // Size of a reception tile in degrees of lat/lon
+#define MIN_DME_DME_ANGLE_DEG 30; // DME/DME pairs with a crossing angle below this(or above 180 - this) are rejected
+#define DB_TMP_SUFFIX ".tmp" // Caches are written under this suffix and renamed once complete
+#define MIN_RELOAD_SIZE_RATIO 0.5; // Reloaded databases smaller than this fraction of the current one are rejected
 
 
 enum xplm_arpt_row_codes {
@@ -39,6 +48,12 @@ enum navaid_types {
 	NAV_ILS_DME = 18
 };
 
+enum recv_flags
+{
+	RECV_IN_RANGE = 1,
+	RECV_IN_TILE = 2 // Set only while switching tiles
+};
+
 enum POI_types
 {
 	POI_WAYPOINT = 1,
@@ -77,6 +92,20 @@ namespace navdb
 		double elevation, mag_var, freq;
 	};
 
+	struct navaid_in_range
+	{
+		std::string id;
+		navaid_entry data;
+		double dist_nm, brng_deg;
+	};
+
+	struct dme_dme_pair
+	{
+		// Copies of both stations, taken under the same lock as the pair itself.
+		navaid_in_range first, second;
+		double score; // 1 means perpendicular lines of position, 0 means colinear.
+	};
+
 	struct airport_data
 	{
 		geo::point pos;
@@ -110,6 +139,38 @@ namespace navdb
 		uint8_t type;
 	};
 
+	struct recv_navaid
+	{
+		std::string id;
+		navaid_entry data;
+	};
+
+	/*
+		Snapshots are never modified once published. Readers load the current
+		one and keep using it for as long as they hold the shared_ptr, so a
+		rebuilt database can be swapped in without stopping them.
+	*/
+
+	struct arpt_snapshot
+	{
+		// Snapshots that were published by the same reload have the same generation.
+		uint64_t generation = 0;
+		std::unordered_map<std::string, airport_data> airports;
+		std::unordered_map<std::string, std::unordered_map<std::string, runway_entry>> runways;
+	};
+
+	struct navaid_snapshot
+	{
+		uint64_t generation = 0;
+		std::unordered_map<std::string, std::vector<geo::point>> waypoints;
+		std::unordered_map<std::string, std::vector<navaid_entry>> navaids;
+
+		// Reception range index. Built from navaids by NavaidDB::build_recv_index.
+		std::vector<recv_navaid> recv_navaids;
+		// Maps a tile to every navaid whose reception circle overlaps it.
+		std::unordered_map<int64_t, std::vector<uint32_t>> recv_tiles;
+	};
+
 	class ArptDB
 	{
 	public:
@@ -118,62 +179,82 @@ namespace navdb
 		double ac_lat;
 		double ac_lon;
 
-		ArptDB(std::unordered_map<std::string, airport_data>* a_db, std::unordered_map<std::string, std::unordered_map<std::string, runway_entry>>* r_db,
-			   std::string sim_arpt_path, std::string custom_arpt_path, std::string custom_rnw_path, double lat, double lon);
+		// Loading and cache writing are submitted to pool.
+		// Setting *stop cancels them. Caches that weren't finished are discarded.
+		// The snapshot is published once loading is complete, if every loader
+		// succeeded and the result passes validation.
+		ArptDB(std::string sim_arpt_path, std::string custom_arpt_path, std::string custom_rnw_path, double lat, double lon,
+			   common::ThreadPool* pool, std::atomic<bool>* stop);
 
+		// Returns 1 if the initial snapshot was published.
 		int get_load_status();
 
-		int load_from_sim_db();
+		// Builds a new database from the sim's apt.dat on the calling thread.
+		// Returns 1 and writes it to out if it passes validation. Nothing is published,
+		// so that it can be swapped in together with the other databases. Not thread safe.
+		int build_reload(std::shared_ptr<arpt_snapshot>* out);
+
+		int load_from_sim_db(arpt_snapshot* snap);
 
-		void write_to_arpt_db();
+		void write_to_arpt_db(const arpt_snapshot* snap);
 
-		void write_to_rnw_db();
+		void write_to_rnw_db(const arpt_snapshot* snap);
 
-		void load_from_custom_arpt(); // Load data from custom airport database
+		int load_from_custom_arpt(arpt_snapshot* snap); // Load data from custom airport database. Returns 0 on failure.
 
-		void load_from_custom_rnw(); // Load data from custom runway database
+		int load_from_custom_rnw(arpt_snapshot* snap); // Load data from custom runway database. Returns 0 on failure.
 
 		size_t get_airport_data(std::string icao_code, airport_data* out);
 
+		// Returns the current snapshot or nullptr if nothing has been loaded yet.
+		std::shared_ptr<const arpt_snapshot> get_snapshot();
+
+		// Replaces the current snapshot. Readers that hold the old one aren't affected.
+		void publish(std::shared_ptr<const arpt_snapshot> snap);
+
 	private:
 		std::string custom_arpt_db_sign = "ARPTDB";
 		std::string custom_rnw_db_sign = "RNWDB";
 		bool apt_db_created = false;
 		bool rnw_db_created = false;
 
-		// Data for creating a custom airport database
-
-		std::atomic<bool> write_arpt_db{false};
-
-		std::vector<arpt_data> arpt_queue;
-		std::vector<rnw_data> rnw_queue;
-
-		std::mutex arpt_queue_mutex;
-		std::mutex rnw_queue_mutex;
-
-		std::mutex arpt_db_mutex;
-		std::mutex rnw_db_mutex;
-
 		std::string sim_arpt_db_path;
 		std::string custom_arpt_db_path;
 		std::string custom_rnw_db_path;
 
-		std::future<int> sim_db_loaded;
-		std::future<void> arpt_db_task;
-		std::future<void> rnw_db_task;
+		common::ThreadPool* task_pool;
+		std::atomic<bool>* stop_flag;
+		std::shared_future<int> sim_db_loaded;
+		std::shared_future<void> arpt_db_task;
+		std::shared_future<void> rnw_db_task;
 
-		std::unordered_map<std::string, airport_data>* arpt_db;
-		std::unordered_map<std::string, std::unordered_map<std::string, runway_entry>>* rnw_db;
+		// Only accessed through std::atomic_load/std::atomic_store.
+		std::shared_ptr<const arpt_snapshot> snapshot;
+		// Filled by the loaders and published by the last one to finish.
+		std::shared_ptr<arpt_snapshot> build_snap;
+		std::atomic<int> n_build_tasks{0};
+		std::atomic<bool> is_build_failed{false};
+		std::atomic<int> build_status{0};
 
 		static bool does_db_exist(std::string path, std::string sign);
 
+		// Moves the file at tmp_path to path if is_complete is true. Otherwise removes it.
+		// Returns true if path was replaced.
+		static bool commit_db_file(std::string tmp_path, std::string path, bool is_complete);
+
+		bool is_cancelled();
+
 		double parse_runway(std::string line, std::vector<runway>* rnw); // Returns runway length in meters
 
-		void add_to_arpt_queue(arpt_data arpt);
+		// Returns the loaded snapshot or nullptr if loading failed.
+		std::shared_ptr<const arpt_snapshot> wait_for_sim_db();
+
+		void wait_for_tasks();
 
-		void add_to_rnw_queue(rnw_data rnw);
+		bool is_valid(const arpt_snapshot* snap);
 
-		
+		// Called by every loader with its return value.
+		void finish_build(int loader_ret);
 	};
 
 	class NavaidDB
@@ -183,17 +264,22 @@ namespace navdb
 		//std::string sim_arpt_db_path;
 		//std::string arpt_db_path;
 
-		NavaidDB(std::string wpt_path, std::string navaid_path,
-			  std::unordered_map<std::string, std::vector<geo::point>>* wpt_db,
-			  std::unordered_map<std::string, std::vector<navaid_entry>>* navaid_db);
+		// The snapshot is published once both files are loaded, if both loads
+		// succeeded and the result passes validation.
+		NavaidDB(std::string wpt_path, std::string navaid_path, common::ThreadPool* pool, std::atomic<bool>* stop);
 
+		// Returns 1 if the initial snapshot was published.
 		int get_load_status();
 
+		// Builds a new database from the sim's files on the calling thread.
+		// Returns 1 and writes it to out if it passes validation. Not thread safe.
+		int build_reload(std::shared_ptr<navaid_snapshot>* out);
+
 		//void update_cache();
 
-		int load_waypoints();
+		int load_waypoints(navaid_snapshot* snap);
 
-		int load_navaids();
+		int load_navaids(navaid_snapshot* snap);
 
 		// get_wpt_info returns 0 if waypoint is not in the database. 
 		// Otherwise, returns number of items written to out.
@@ -205,6 +291,29 @@ namespace navdb
 
 		//size_t get_poi_info(std::string id, POI* out);
 
+		// update_in_range updates the set of navaids whose reception range covers ac_pos.
+		// Only the navaids from the aircraft's reception tile are considered, so the
+		// candidate set changes only when the aircraft crosses into a different tile.
+		// Returns number of navaids that entered or left the set.
+		size_t update_in_range(geo::point ac_pos);
+
+		// get_navaids_in_range appends the navaids in range to out.
+		// Returns number of items written to out.
+		size_t get_navaids_in_range(std::vector<navaid_in_range>* out);
+
+		// get_dme_dme_pairs writes pairs of navaids in range, best geometry first.
+		// Returns number of items written to out.
+		size_t get_dme_dme_pairs(std::vector<dme_dme_pair>* out, size_t max_pairs);
+
+		// Returns the current snapshot or nullptr if nothing has been loaded yet.
+		std::shared_ptr<const navaid_snapshot> get_snapshot();
+
+		// Replaces the current snapshot. Readers that hold the old one aren't affected.
+		// snap has to have its reception index built.
+		void publish(std::shared_ptr<const navaid_snapshot> snap);
+
+		static void build_recv_index(navaid_snapshot* snap);
+
 		~NavaidDB();
 
 	private:
@@ -213,15 +322,54 @@ namespace navdb
 		std::string sim_wpt_db_path;
 		std::string sim_navaid_db_path;
 
-		std::future<int> wpt_loaded;
-		std::future<int> navaid_loaded;
+		common::ThreadPool* task_pool;
+		std::atomic<bool>* stop_flag;
+		std::shared_future<int> wpt_loaded;
+		std::shared_future<int> navaid_loaded;
 
 		// For checking existence
 		std::unordered_map<std::string, uint64_t> airports;
 
-		std::unordered_map<std::string, std::vector<geo::point>>* wpt_cache;
-		std::unordered_map<std::string, std::vector<navaid_entry>>* navaid_cache;
+		// Only accessed through std::atomic_load/std::atomic_store.
+		std::shared_ptr<const navaid_snapshot> snapshot;
+		std::shared_ptr<navaid_snapshot> build_snap;
+		std::atomic<int> n_build_tasks{0};
+		std::atomic<bool> is_build_failed{false};
+		std::atomic<int> build_status{0};
 
+		// Reception range tracking
+
+		std::mutex in_range_mutex;
+		// Snapshot that the state below refers to
+		std::shared_ptr<const navaid_snapshot> in_range_snap;
+		int64_t ac_tile = INT64_MAX;
+		const std::vector<uint32_t>* tile_candidates = nullptr;
+		std::vector<uint8_t> is_in_range;
+		// Navaids in range, in no particular order. in_range_idx holds the index into
+		// recv_navaids of every item and in_range_slot maps it back to its position here.
+		std::vector<navaid_in_range> in_range;
+		std::vector<uint32_t> in_range_idx;
+		std::vector<uint32_t> in_range_slot;
+
+		void add_in_range(const navaid_snapshot* snap, uint32_t idx);
+
+		// Swaps the last item into the slot of idx.
+		void remove_in_range(uint32_t idx);
+
+		static bool is_recv_type(uint16_t type);
+
+		static bool is_dme_type(uint16_t type);
+
+		static int64_t get_tile_key(int lat_idx, int lon_idx);
+
+		static int64_t get_tile_key(geo::point pos);
+
+		bool is_cancelled();
+
+		bool is_valid(const navaid_snapshot* snap);
+
+		// Called by every loader with its return value.
+		void finish_build(int loader_ret);
 	};
 
 	class NavDB
@@ -231,8 +379,17 @@ namespace navdb
 
 		size_t get_poi_info(std::string id, POI* out);
 
+		// Same as above but only looks for POIs of type, one of POI_types.
+		size_t get_poi_info(std::string id, uint8_t type, POI* out);
+
 	private:
 		NavaidDB* navaid_db;
 		ArptDB* arpt_db;
 	};
+
+	// Writes the current snapshots of both databases to arpt_out and nav_out.
+	// A reload publishes them one after another, so they are taken again until
+	// both come from the same generation. Either one is nullptr if nothing has been loaded.
+	void get_snapshots(ArptDB* arpt_db, NavaidDB* navaid_db, std::shared_ptr<const arpt_snapshot>* arpt_out,
+		std::shared_ptr<const navaid_snapshot>* nav_out);
 }
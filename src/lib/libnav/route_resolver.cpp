@@ -0,0 +1,308 @@
+#include "route_resolver.h"
+
+
+namespace navdb
+{
+	RouteResolver::RouteResolver(ArptDB* arpt_ptr, NavaidDB* navaid_ptr, AwyDB* awy_ptr)
+	{
+		arpt_db = arpt_ptr;
+		navaid_db = navaid_ptr;
+		awy_db = awy_ptr;
+	}
+
+	size_t RouteResolver::resolve(std::string route, std::vector<route_elem>* out, std::vector<route_error>* errors)
+	{
+		// The same snapshots are used for the whole route, even if a reload publishes new ones.
+		std::shared_ptr<const arpt_snapshot> arpt_snap;
+		std::shared_ptr<const navaid_snapshot> nav_snap;
+		std::shared_ptr<const awy_snapshot> awy_snap;
+		get_snapshots(arpt_db, navaid_db, awy_db, &arpt_snap, &nav_snap, &awy_snap);
+
+		std::vector<std::string> ids;
+		tokenize(route, &ids);
+
+		std::vector<route_token> tokens(ids.size());
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			route_token* tok = &tokens[i];
+			tok->id = ids[i];
+			tok->arpt = nullptr;
+			tok->navaids = nullptr;
+			tok->wpts = nullptr;
+			tok->awy = UINT32_MAX;
+			tok->n_candidates = 0;
+			if (arpt_snap != nullptr)
+			{
+				auto it = arpt_snap->airports.find(tok->id);
+				if (it != arpt_snap->airports.end())
+				{
+					tok->arpt = &it->second;
+					tok->n_candidates++;
+				}
+			}
+			if (nav_snap != nullptr)
+			{
+				auto navaid = nav_snap->navaids.find(tok->id);
+				if (navaid != nav_snap->navaids.end())
+				{
+					tok->navaids = &navaid->second;
+					tok->n_candidates += navaid->second.size();
+				}
+				auto wpt = nav_snap->waypoints.find(tok->id);
+				if (wpt != nav_snap->waypoints.end())
+				{
+					tok->wpts = &wpt->second;
+					tok->n_candidates += wpt->second.size();
+				}
+			}
+			if (awy_snap != nullptr)
+			{
+				auto awy = awy_snap->awy_ids.find(tok->id);
+				if (awy != awy_snap->awy_ids.end())
+				{
+					tok->awy = awy->second;
+				}
+			}
+		}
+
+		size_t n_written = 0;
+		bool has_prev = false;
+		route_elem prev;
+		uint32_t via = UINT32_MAX;
+		size_t via_idx = 0;
+		for (size_t i = 0; i < tokens.size(); i++)
+		{
+			route_token* tok = &tokens[i];
+			// Airways can only be between two fixes or follow another airway
+			if (tok->awy != UINT32_MAX && has_prev && i + 1 < tokens.size())
+			{
+				if (via != UINT32_MAX)
+				{
+					// Two airways in a row meet at the first fix of the previous one that is on this one
+					size_t n_legs = expand_to_intersection(awy_snap.get(), via, prev.id, prev.pos, tok->awy, out);
+					if (n_legs)
+					{
+						n_written += n_legs;
+						prev = out->back();
+					}
+					else
+					{
+						errors->push_back({ via_idx, tokens[via_idx].id, RTE_AWY_NO_INTERSECTION });
+					}
+				}
+				via = tok->awy;
+				via_idx = i;
+				continue;
+			}
+			if (!tok->n_candidates)
+			{
+				errors->push_back({ i, tok->id, RTE_NOT_FOUND });
+				continue;
+			}
+
+			if (via != UINT32_MAX)
+			{
+				// The airway decides which of the fixes with this ident is meant
+				size_t n_legs = expand_airway(awy_snap.get(), via, prev.id, prev.pos, tok->id, out);
+				via = UINT32_MAX;
+				if (n_legs)
+				{
+					n_written += n_legs;
+					prev = out->back();
+					continue;
+				}
+				errors->push_back({ via_idx, tokens[via_idx].id, RTE_AWY_NO_PATH });
+			}
+
+			route_elem elem;
+			geo::point ref = { 0, 0 };
+			if (tok->n_candidates > 1)
+			{
+				/*
+				* Pick the candidate closest to the previous fix. The first fix of the
+				* route has nothing before it, so the next fix with a unique ident is
+				* used instead.
+				*/
+				if (has_prev)
+				{
+					ref = prev.pos;
+				}
+				else
+				{
+					for (size_t j = i + 1; j < tokens.size(); j++)
+					{
+						if (tokens[j].n_candidates == 1)
+						{
+							route_elem next;
+							pick_closest(&tokens[j], ref, &next);
+							ref = next.pos;
+							break;
+						}
+					}
+				}
+				pick_closest(tok, ref, &elem);
+				errors->push_back({ i, tok->id, RTE_AMBIGUOUS });
+			}
+			else
+			{
+				pick_closest(tok, ref, &elem);
+			}
+			out->push_back(elem);
+			n_written++;
+			prev = elem;
+			has_prev = true;
+		}
+		// None of the tokens after the last airway could end it
+		if (via != UINT32_MAX)
+		{
+			errors->push_back({ via_idx, tokens[via_idx].id, RTE_AWY_NO_PATH });
+		}
+		return n_written;
+	}
+
+	//Private member functions:
+
+	void RouteResolver::tokenize(std::string route, std::vector<std::string>* out)
+	{
+		std::stringstream s(route);
+		std::string token;
+		while (s >> token)
+		{
+			size_t sep = token.find('/');
+			if (sep != std::string::npos)
+			{
+				token.erase(sep);
+			}
+			for (size_t i = 0; i < token.size(); i++)
+			{
+				token[i] = char(toupper(token[i]));
+			}
+			if (token != "" && token != "DCT")
+			{
+				out->push_back(token);
+			}
+		}
+	}
+
+	void RouteResolver::pick_closest(const route_token* token, geo::point ref, route_elem* out)
+	{
+		double min_dist = INFINITY;
+		out->id = token->id;
+		out->via = "";
+		if (token->arpt != nullptr)
+		{
+			min_dist = ref.getGreatCircleDistanceNM(token->arpt->pos);
+			out->type = POI_AIRPORT;
+			out->pos = token->arpt->pos;
+		}
+		if (token->navaids != nullptr)
+		{
+			for (size_t i = 0; i < token->navaids->size(); i++)
+			{
+				geo::point pos = token->navaids->at(i).wpt;
+				double dist = ref.getGreatCircleDistanceNM(pos);
+				if (dist < min_dist)
+				{
+					min_dist = dist;
+					out->type = POI_NAVAID;
+					out->pos = pos;
+				}
+			}
+		}
+		if (token->wpts != nullptr)
+		{
+			for (size_t i = 0; i < token->wpts->size(); i++)
+			{
+				double dist = ref.getGreatCircleDistanceNM(token->wpts->at(i));
+				if (dist < min_dist)
+				{
+					min_dist = dist;
+					out->type = POI_WAYPOINT;
+					out->pos = token->wpts->at(i);
+				}
+			}
+		}
+	}
+
+	size_t RouteResolver::expand_airway(const awy_snapshot* snap, uint32_t awy, std::string from, geo::point from_pos,
+		std::string to, std::vector<route_elem>* out)
+	{
+		// The airway node of the previous fix is the one at its position
+		uint32_t start = get_closest_node(snap, from, from_pos);
+		if (start == UINT32_MAX)
+		{
+			return 0;
+		}
+		return walk_airway(snap, awy, start, to, UINT32_MAX, out);
+	}
+
+	size_t RouteResolver::expand_to_intersection(const awy_snapshot* snap, uint32_t awy, std::string from, geo::point from_pos,
+		uint32_t next_awy, std::vector<route_elem>* out)
+	{
+		uint32_t start = get_closest_node(snap, from, from_pos);
+		if (start == UINT32_MAX)
+		{
+			return 0;
+		}
+		return walk_airway(snap, awy, start, "", next_awy, out);
+	}
+
+	size_t RouteResolver::walk_airway(const awy_snapshot* snap, uint32_t awy, uint32_t start, std::string to,
+		uint32_t next_awy, std::vector<route_elem>* out)
+	{
+		// Airways are short chains, so a breadth first search along their edges is enough.
+		std::unordered_map<uint32_t, uint32_t> parents;
+		std::vector<uint32_t> queue = { start };
+		parents[start] = UINT32_MAX;
+		uint32_t found = UINT32_MAX;
+		for (size_t i = 0; i < queue.size() && found == UINT32_MAX; i++)
+		{
+			uint32_t node = queue[i];
+			for (uint32_t j = snap->edge_start[node]; j < snap->edge_start[node + 1]; j++)
+			{
+				const awy_edge* edge = &snap->edges[j];
+				if (edge->awy != awy || parents.find(edge->to) != parents.end())
+				{
+					continue;
+				}
+				parents[edge->to] = node;
+				bool is_end = next_awy != UINT32_MAX ? is_on_airway(snap, edge->to, next_awy) : snap->node_names[edge->to] == to;
+				if (is_end)
+				{
+					found = edge->to;
+					break;
+				}
+				queue.push_back(edge->to);
+			}
+		}
+		if (found == UINT32_MAX)
+		{
+			return 0;
+		}
+
+		std::vector<uint32_t> path;
+		for (uint32_t node = found; node != start; node = parents[node])
+		{
+			path.push_back(node);
+		}
+		for (size_t i = path.size(); i > 0; i--)
+		{
+			uint32_t node = path[i - 1];
+			route_elem elem = { snap->node_names[node], snap->awy_names[awy], snap->node_types[node], snap->node_pos[node] };
+			out->push_back(elem);
+		}
+		return path.size();
+	}
+
+	bool RouteResolver::is_on_airway(const awy_snapshot* snap, uint32_t node, uint32_t awy)
+	{
+		for (uint32_t i = snap->edge_start[node]; i < snap->edge_start[node + 1]; i++)
+		{
+			if (snap->edges[i].awy == awy)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
@@ -0,0 +1,88 @@
+/*
+	This header file contains the declaration of RouteResolver. It turns a route
+	string like "KSEA BANGR9 ONP J1 SEA KSFO" into a list of fixes. All idents are
+	looked up in one pass over the current snapshots of the databases.
+*/
+
+#pragma once
+
+#include "airway_database.h"
+#include <cctype>
+
+
+enum route_error_types
+{
+	RTE_NOT_FOUND = 1, // Not an airport, navaid, waypoint or airway. The token is skipped.
+	RTE_AMBIGUOUS = 2, // Several fixes have this ident. The one closest to the route was picked.
+	RTE_AWY_NO_PATH = 3, // The airway doesn't lead to the next fix. The fix is flown direct instead.
+	RTE_AWY_NO_INTERSECTION = 4 // The airway doesn't cross the airway after it. The next one starts at the previous fix instead.
+};
+
+namespace navdb
+{
+	struct route_elem
+	{
+		std::string id;
+		std::string via; // Airway that leads to this fix. Empty for direct legs.
+		uint8_t type; // One of POI_types
+		geo::point pos;
+	};
+
+	struct route_error
+	{
+		size_t token_idx;
+		std::string token;
+		uint8_t type; // One of route_error_types
+	};
+
+	class RouteResolver
+	{
+	public:
+		RouteResolver(ArptDB* arpt_ptr, NavaidDB* navaid_ptr, AwyDB* awy_ptr);
+
+		// Appends the fixes of route to out. Airways are replaced by the fixes along them.
+		// Tokens that can't be used are appended to errors and the rest of the route is
+		// still resolved. Returns number of fixes appended to out. Ran from any thread.
+		size_t resolve(std::string route, std::vector<route_elem>* out, std::vector<route_error>* errors);
+
+	private:
+		// Points into the snapshots, so that nothing is copied until a candidate is picked.
+		struct route_token
+		{
+			std::string id;
+			const airport_data* arpt;
+			const std::vector<navaid_entry>* navaids;
+			const std::vector<geo::point>* wpts;
+			uint32_t awy; // UINT32_MAX if there is no airway with this name
+			size_t n_candidates;
+		};
+
+		ArptDB* arpt_db;
+		NavaidDB* navaid_db;
+		AwyDB* awy_db;
+
+		// Splits route at whitespace. Suffixes like "/16L" or "/N0450F350" are dropped
+		// and DCT is skipped, since any two fixes without an airway are direct.
+		static void tokenize(std::string route, std::vector<std::string>* out);
+
+		// Writes the candidate of token closest to ref to out.
+		static void pick_closest(const route_token* token, geo::point ref, route_elem* out);
+
+		// Appends the fixes along airway awy from the fix at from_pos up to the first fix called to.
+		// Returns number of fixes appended or 0 if to can't be reached along the airway.
+		static size_t expand_airway(const awy_snapshot* snap, uint32_t awy, std::string from, geo::point from_pos,
+			std::string to, std::vector<route_elem>* out);
+
+		// Same as above, but up to the first fix where airway next_awy can be joined.
+		static size_t expand_to_intersection(const awy_snapshot* snap, uint32_t awy, std::string from, geo::point from_pos,
+			uint32_t next_awy, std::vector<route_elem>* out);
+
+		// Appends the fixes along airway awy from node start up to the first other node that is
+		// called to or, if next_awy isn't UINT32_MAX, that has a segment of next_awy.
+		// Returns number of fixes appended or 0 if there is no such node.
+		static size_t walk_airway(const awy_snapshot* snap, uint32_t awy, uint32_t start, std::string to,
+			uint32_t next_awy, std::vector<route_elem>* out);
+
+		static bool is_on_airway(const awy_snapshot* snap, uint32_t node, uint32_t awy);
+	};
+}
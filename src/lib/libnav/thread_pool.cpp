@@ -0,0 +1,175 @@
+/*
+	This source file contains definitions of member functions of ThreadPool.
+*/
+
+#include "thread_pool.h"
+
+
+namespace common
+{
+	// Pool and queue index of the worker that runs on this thread.
+	// Tasks submitted from a worker go to its own queue.
+	static thread_local ThreadPool* tls_pool = nullptr;
+	static thread_local size_t tls_idx = 0;
+
+	ThreadPool::ThreadPool(size_t n_threads)
+	{
+		if (n_threads == 0)
+		{
+			size_t n_hw = size_t(std::thread::hardware_concurrency());
+			if (n_hw > N_POOL_RESERVED_THREADS)
+			{
+				n_threads = n_hw - N_POOL_RESERVED_THREADS;
+			}
+			if (n_threads < N_POOL_MIN_THREADS)
+			{
+				n_threads = N_POOL_MIN_THREADS;
+			}
+		}
+
+		for (size_t i = 0; i < n_threads; i++)
+		{
+			queues.push_back(std::make_unique<worker_queue>());
+		}
+		for (size_t i = 0; i < n_threads; i++)
+		{
+			workers.push_back(std::thread([this, i]() { worker_loop(i); }));
+		}
+	}
+
+	bool ThreadPool::run_one()
+	{
+		task_t task;
+		size_t own_idx = tls_pool == this ? tls_idx : queues.size();
+		if (pop(own_idx, &task))
+		{
+			run_task(&task);
+			return true;
+		}
+		return false;
+	}
+
+	void ThreadPool::wait_idle()
+	{
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		idle_cv.wait(lock, [this]() { return n_pending.load(std::memory_order_seq_cst) == 0; });
+	}
+
+	size_t ThreadPool::get_n_threads()
+	{
+		return workers.size();
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		wait_idle();
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			is_stopped.store(true, std::memory_order_seq_cst);
+		}
+		work_cv.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	//Private member functions:
+
+	void ThreadPool::push(task_t task, task_priority priority)
+	{
+		n_pending.fetch_add(1, std::memory_order_seq_cst);
+		{
+			// Taking the lock makes sure that a worker that is about to sleep sees the task.
+			// Counted before the push, so that a thief can't take it below zero.
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			n_queued.fetch_add(1, std::memory_order_seq_cst);
+		}
+		if (priority == TASK_LOW)
+		{
+			std::lock_guard<std::mutex> lock(low_mutex);
+			low_tasks.push_back(std::move(task));
+		}
+		else
+		{
+			size_t idx = tls_pool == this ? tls_idx :
+				size_t(next_queue.fetch_add(1, std::memory_order_relaxed)) % queues.size();
+			std::lock_guard<std::mutex> lock(queues[idx]->mtx);
+			queues[idx]->tasks.push_back(std::move(task));
+		}
+		work_cv.notify_one();
+	}
+
+	bool ThreadPool::pop(size_t own_idx, task_t* out)
+	{
+		size_t n_queues = queues.size();
+		// Own queue is used as a stack, so that the data of the latest task is still warm.
+		if (own_idx < n_queues)
+		{
+			std::lock_guard<std::mutex> lock(queues[own_idx]->mtx);
+			if (queues[own_idx]->tasks.size())
+			{
+				*out = std::move(queues[own_idx]->tasks.back());
+				queues[own_idx]->tasks.pop_back();
+				n_queued.fetch_sub(1, std::memory_order_seq_cst);
+				return true;
+			}
+		}
+		// Steal the oldest task of another worker
+		for (size_t i = 1; i <= n_queues; i++)
+		{
+			size_t idx = (own_idx + i) % n_queues;
+			std::lock_guard<std::mutex> lock(queues[idx]->mtx);
+			if (queues[idx]->tasks.size())
+			{
+				*out = std::move(queues[idx]->tasks.front());
+				queues[idx]->tasks.pop_front();
+				n_queued.fetch_sub(1, std::memory_order_seq_cst);
+				return true;
+			}
+		}
+		std::lock_guard<std::mutex> lock(low_mutex);
+		if (low_tasks.size())
+		{
+			*out = std::move(low_tasks.front());
+			low_tasks.pop_front();
+			n_queued.fetch_sub(1, std::memory_order_seq_cst);
+			return true;
+		}
+		return false;
+	}
+
+	void ThreadPool::run_task(task_t* task)
+	{
+		(*task)();
+		if (n_pending.fetch_sub(1, std::memory_order_seq_cst) == 1)
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			idle_cv.notify_all();
+		}
+	}
+
+	void ThreadPool::worker_loop(size_t idx)
+	{
+		tls_pool = this;
+		tls_idx = idx;
+		while (true)
+		{
+			task_t task;
+			if (pop(idx, &task))
+			{
+				run_task(&task);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(idle_mutex);
+			work_cv.wait(lock, [this]() {
+				return is_stopped.load(std::memory_order_seq_cst) || n_queued.load(std::memory_order_seq_cst) != 0;
+				});
+			if (is_stopped.load(std::memory_order_seq_cst) && !n_queued.load(std::memory_order_seq_cst))
+			{
+				return;
+			}
+		}
+	}
+}
@@ -0,0 +1,113 @@
+/*
+	This header file contains the declaration of ThreadPool. It's a fixed set of
+	worker threads with a task deque per worker. Idle workers steal from the others.
+	Low priority tasks are only picked up when there is no normal work left.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace common
+{
+	enum task_priority
+	{
+		TASK_NORMAL = 0,
+		TASK_LOW = 1 // Cache writing and other work nothing is waiting for
+	};
+
+	enum thread_pool_constants
+	{
+		N_POOL_RESERVED_THREADS = 2, // Left for the sim and the avionics threads
+		N_POOL_MIN_THREADS = 2,
+		POOL_HELP_WAIT_MS = 1 // Sleep between polls of a future while there is nothing to help with
+	};
+
+	class ThreadPool
+	{
+	public:
+		// If n_threads is 0, the pool is sized to the host.
+		ThreadPool(size_t n_threads = 0);
+
+		// Returns a future to the result of fn. Ran from any thread.
+		template<typename F>
+		auto submit(F fn, task_priority priority = TASK_NORMAL) -> std::future<decltype(fn())>
+		{
+			typedef decltype(fn()) ret_t;
+			std::shared_ptr<std::packaged_task<ret_t()>> task =
+				std::make_shared<std::packaged_task<ret_t()>>(std::move(fn));
+			std::future<ret_t> out = task->get_future();
+			push([task]() { (*task)(); }, priority);
+			return out;
+		}
+
+		// Waits until fut is ready, running queued tasks in the mean time.
+		// Tasks that wait for other tasks have to use this, otherwise
+		// a small pool can run out of workers.
+		template<typename T>
+		void wait(const T& fut)
+		{
+			while (fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			{
+				if (!run_one())
+				{
+					fut.wait_for(std::chrono::milliseconds(POOL_HELP_WAIT_MS));
+				}
+			}
+		}
+
+		// Runs one queued task on the calling thread.
+		// Returns true if there was a task to run.
+		bool run_one();
+
+		// Blocks until all submitted tasks have finished.
+		void wait_idle();
+
+		size_t get_n_threads();
+
+		// Finishes the queued tasks and joins the workers.
+		~ThreadPool();
+
+	private:
+		typedef std::function<void()> task_t;
+
+		struct worker_queue
+		{
+			std::mutex mtx;
+			std::deque<task_t> tasks;
+		};
+
+		std::vector<std::unique_ptr<worker_queue>> queues;
+		std::mutex low_mutex;
+		std::deque<task_t> low_tasks;
+
+		std::vector<std::thread> workers;
+		std::atomic<bool> is_stopped{false};
+		std::atomic<uint32_t> next_queue{0};
+		std::atomic<size_t> n_queued{0};
+
+		// Counts tasks that were submitted but haven't finished yet.
+		std::atomic<size_t> n_pending{0};
+		std::mutex idle_mutex;
+		std::condition_variable idle_cv;
+		std::condition_variable work_cv;
+
+		void push(task_t task, task_priority priority);
+
+		bool pop(size_t own_idx, task_t* out);
+
+		void run_task(task_t* task);
+
+		void worker_loop(size_t idx);
+	};
+}
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "XPLMDataAccess.h"
+#include "small_str.h"
 #include <string>
 
 
@@ -51,6 +52,9 @@ inline void strip_str(std::string* src, std::string* dst)
 
 namespace XPDataBus
 {
+	// Not an XPLM type. Used for custom double array datarefs and double buffers.
+	constexpr int DR_TYPE_DOUBLE_ARRAY = 64;
+
 	struct generic_ptr
 	{
 		void* ptr;
@@ -58,16 +62,76 @@ namespace XPDataBus
 		size_t n_length;
 	};
 
+	struct dr_handle
+	{
+		int idx; // -1 means invalid handle
+	};
+
 	struct generic_val
 	{
+		// Should fit into a single cache line.
 		union
 		{
 			int int_val;
 			float float_val;
 			double double_val;
 		};
-		std::string str;
+		SmallString str;
 		int val_type;
 		int offset;
 	};
+
+	inline int generic_val_to_i(generic_val* val)
+	{
+		int ret_val = 0;
+		if (val->val_type == xplmType_Int)
+		{
+			ret_val = val->int_val;
+		}
+		else if (val->val_type == xplmType_Float)
+		{
+			ret_val = int(val->float_val);
+		}
+		else if (val->val_type == xplmType_Double)
+		{
+			ret_val = int(val->double_val);
+		}
+		return ret_val;
+	}
+
+	inline float generic_val_to_f(generic_val* val)
+	{
+		float ret_val = 0;
+		if (val->val_type == xplmType_Int)
+		{
+			ret_val = float(val->int_val);
+		}
+		else if (val->val_type == xplmType_Float)
+		{
+			ret_val = val->float_val;
+		}
+		else if (val->val_type == xplmType_Double)
+		{
+			ret_val = float(val->double_val);
+		}
+		return ret_val;
+	}
+
+	inline double generic_val_to_d(generic_val* val)
+	{
+		double ret_val = 0;
+		if (val->val_type == xplmType_Int)
+		{
+			ret_val = double(val->int_val);
+		}
+		else if (val->val_type == xplmType_Float)
+		{
+			ret_val = double(val->float_val);
+		}
+		else if (val->val_type == xplmType_Double)
+		{
+			ret_val = val->double_val;
+		}
+		return ret_val;
+	}
 }
@@ -6,7 +6,9 @@
 
 namespace XPDataBus
 {
-	DataBus::DataBus(std::vector<custom_data_ref_entry>* data_refs, uint64_t max_q_refresh)
+	DataBus::DataBus(std::vector<custom_data_ref_entry>* data_refs, uint64_t max_q_refresh):
+		get_queue(N_DATABUS_QUEUE_SIZE), set_queue(N_DATABUS_QUEUE_SIZE), range_queue(N_DATABUS_QUEUE_SIZE),
+		async_queue(N_DATABUS_QUEUE_SIZE)
 	{
 		//Get x-plane/sdk versions and path.
 
@@ -28,6 +30,7 @@ namespace XPDataBus
 			custom_data_refs.insert(tmp);
 		}
 		max_queue_refresh = max_q_refresh;
+		handles = std::vector<dr_handle_entry>(N_MAX_DR_HANDLES);
 		flt_loop_id = reg_flt_loop();
 		XPLMScheduleFlightLoop(flt_loop_id, 1, true);
 	}
@@ -43,8 +46,9 @@ namespace XPDataBus
 	{
 		char buf[CHAR_BUF_SIZE];
 		XPLMGetPrefsPath(buf);
-		char* file_name = XPLMExtractFileAndPath(buf);
-		return std::string(buf, 0, file_name - buf);
+		// XPLMExtractFileAndPath terminates buf at the last separator.
+		XPLMExtractFileAndPath(buf);
+		return std::string(buf);
 	}
 
 	std::string DataBus::get_apt_dat_path()
@@ -91,116 +95,551 @@ namespace XPDataBus
 		return path;
 	}
 
-	void DataBus::add_to_get_queue(std::string dr_name, std::promise<generic_val>* prom, int offset)
+	bool DataBus::add_to_get_queue(const std::string& dr_name, dr_handle handle, std::promise<generic_val>* prom, int offset)
 	{
-		std::lock_guard<std::mutex> lock(get_queue_mutex);
-		get_queue.push(get_req{ dr_name, prom, offset });
+		/*
+		* Returns false if the data bus has been stopped.
+		* If the queue is full, waits until the flight loop makes room.
+		*/
+		if (is_stopped.load(std::memory_order_seq_cst))
+		{
+			return false;
+		}
+		if (handle.idx < 0)
+		{
+			handle = get_name_handle(dr_name);
+		}
+		get_req req = { handle.idx < 0 ? dr_name : std::string(), handle, prom, offset, get_enq_time() };
+		while (!get_queue.push(req))
+		{
+			if (is_stopped.load(std::memory_order_relaxed))
+			{
+				return false;
+			}
+			std::this_thread::yield();
+		}
+		check_stopped_after_push();
+		return true;
+	}
+
+	void DataBus::add_to_set_queue(set_req req)
+	{
+		if (is_stopped.load(std::memory_order_seq_cst))
+		{
+			return;
+		}
+		while (!set_queue.push(req) && !is_stopped.load(std::memory_order_relaxed))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	void DataBus::check_stopped_after_push()
+	{
+		// Pairs with the fence in cleanup: either this sees is_stopped or cleanup sees the push.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (is_stopped.load(std::memory_order_relaxed))
+		{
+			drain_stopped_queues();
+		}
 	}
 
-	XPLMDataRef DataBus::add_data_ref_entry(std::string* dr_name)
+	data_ref_entry* DataBus::add_data_ref_entry(std::string* dr_name)
 	{
-		size_t length = dr_name->length() + 1;
-		char* cstr = new char[length];
-		strcpy_safe(cstr, length, dr_name->c_str());
-		XPLMDataRef ref_ptr = XPLMFindDataRef(cstr);
-		delete[] cstr;
+		XPLMDataRef ref_ptr = XPLMFindDataRef(dr_name->c_str());
 		if (ref_ptr != nullptr)
 		{
-			data_refs[*dr_name] = data_ref_entry{ ref_ptr, XPLMGetDataRefTypes(ref_ptr) };
+			data_ref_entry* entry = &data_refs[*dr_name];
+			entry->ref = ref_ptr;
+			entry->dr_type = XPLMGetDataRefTypes(ref_ptr);
+			return entry;
+		}
+		return nullptr;
+	}
+
+	dr_handle DataBus::register_data_ref(const std::string& dr_name, int priority)
+	{
+		/*
+		* Returns a handle that can be used instead of the dataref's name.
+		* The dataref itself is resolved by the main thread the first time
+		* the handle is used. Registering the same name twice returns the same handle.
+		*/
+		std::lock_guard<std::mutex> lock(handle_mutex);
+		auto it = handle_ids.find(dr_name);
+		if (it != handle_ids.end())
+		{
+			dr_handle_entry* entry = &handles[it->second.idx];
+			if (entry->is_implicit)
+			{
+				entry->priority.store(priority, std::memory_order_relaxed);
+				entry->is_implicit = false;
+			}
+			return it->second;
+		}
+		dr_handle out = add_handle(dr_name, priority, false);
+		if (out.idx < 0)
+		{
+			failed_handles.push_back(dr_name);
+			has_failed_handles.store(true, std::memory_order_release);
+		}
+		return out;
+	}
+
+	dr_handle DataBus::get_name_handle(const std::string& dr_name)
+	{
+		/*
+		* A full table isn't logged here: the request just keeps its name.
+		*/
+		std::lock_guard<std::mutex> lock(handle_mutex);
+		auto it = handle_ids.find(dr_name);
+		if (it != handle_ids.end())
+		{
+			return it->second;
+		}
+		return add_handle(dr_name, DB_PRIORITY_NORMAL, true);
+	}
+
+	dr_handle DataBus::add_handle(const std::string& dr_name, int priority, bool is_implicit)
+	{
+		int idx = n_handles.load(std::memory_order_relaxed);
+		if (idx >= int(handles.size()))
+		{
+			return dr_handle{ -1 };
+		}
+		handles[idx].name = dr_name;
+		handles[idx].priority.store(priority, std::memory_order_relaxed);
+		handles[idx].is_implicit = is_implicit;
+		handles[idx].is_resolved = false;
+		n_handles.store(idx + 1, std::memory_order_release);
+		dr_handle out = { idx };
+		handle_ids.insert(std::make_pair(dr_name, out));
+		return out;
+	}
+
+	generic_val DataBus::get_data(const std::string& dr_name, int offset)
+	{
+		std::promise<generic_val> prom;
+		std::future<generic_val> fut_val = prom.get_future();
+		if (!add_to_get_queue(dr_name, dr_handle{ -1 }, &prom, offset))
+		{
+			return generic_val{ {0}, "", 0, -1 };
 		}
-		return ref_ptr;
+		return fut_val.get();
 	}
 
-	generic_val DataBus::get_data(std::string dr_name, int offset)
+	generic_val DataBus::get_data(dr_handle handle, int offset)
 	{
 		std::promise<generic_val> prom;
 		std::future<generic_val> fut_val = prom.get_future();
-		add_to_get_queue(dr_name, &prom, offset);
+		if (!add_to_get_queue("", handle, &prom, offset))
+		{
+			return generic_val{ {0}, "", 0, -1 };
+		}
 		return fut_val.get();
 	}
 
-	int DataBus::get_datai(std::string dr_name, int offset)
+	int DataBus::get_datai(const std::string& dr_name, int offset)
+	{
+		generic_val val = get_data(dr_name, offset);
+		return generic_val_to_i(&val);
+	}
+
+	int DataBus::get_datai(dr_handle handle, int offset)
+	{
+		generic_val val = get_data(handle, offset);
+		return generic_val_to_i(&val);
+	}
+
+	float DataBus::get_dataf(const std::string& dr_name, int offset)
+	{
+		generic_val val = get_data(dr_name, offset);
+		return generic_val_to_f(&val);
+	}
+
+	float DataBus::get_dataf(dr_handle handle, int offset)
+	{
+		generic_val val = get_data(handle, offset);
+		return generic_val_to_f(&val);
+	}
+
+	double DataBus::get_datad(const std::string& dr_name, int offset)
+	{
+		generic_val val = get_data(dr_name, offset);
+		return generic_val_to_d(&val);
+	}
+
+	double DataBus::get_datad(dr_handle handle, int offset)
+	{
+		generic_val val = get_data(handle, offset);
+		return generic_val_to_d(&val);
+	}
+
+	std::string DataBus::get_data_s(const std::string& dr_name, int offset)
 	{
 		generic_val val = get_data(dr_name, offset);
-		int ret_val = 0;
-		if (val.val_type == xplmType_Int)
+		return val.str;
+	}
+
+	std::string DataBus::get_data_s(dr_handle handle, int offset)
+	{
+		generic_val val = get_data(handle, offset);
+		return val.str;
+	}
+
+	int DataBus::get_data_vi(const std::string& dr_name, int* out, int offset, int n_max)
+	{
+		return get_data_range(dr_name, dr_handle{ -1 }, xplmType_IntArray, out, offset, n_max);
+	}
+
+	int DataBus::get_data_vf(const std::string& dr_name, float* out, int offset, int n_max)
+	{
+		return get_data_range(dr_name, dr_handle{ -1 }, xplmType_FloatArray, out, offset, n_max);
+	}
+
+	int DataBus::get_data_vd(const std::string& dr_name, double* out, int offset, int n_max)
+	{
+		return get_data_range(dr_name, dr_handle{ -1 }, DR_TYPE_DOUBLE_ARRAY, out, offset, n_max);
+	}
+
+	int DataBus::get_data_b(const std::string& dr_name, char* out, int offset, int n_max)
+	{
+		return get_data_range(dr_name, dr_handle{ -1 }, xplmType_Data, out, offset, n_max);
+	}
+
+	int DataBus::get_data_vi(dr_handle handle, int* out, int offset, int n_max)
+	{
+		return get_data_range("", handle, xplmType_IntArray, out, offset, n_max);
+	}
+
+	int DataBus::get_data_vf(dr_handle handle, float* out, int offset, int n_max)
+	{
+		return get_data_range("", handle, xplmType_FloatArray, out, offset, n_max);
+	}
+
+	int DataBus::get_data_vd(dr_handle handle, double* out, int offset, int n_max)
+	{
+		return get_data_range("", handle, DR_TYPE_DOUBLE_ARRAY, out, offset, n_max);
+	}
+
+	int DataBus::get_data_b(dr_handle handle, char* out, int offset, int n_max)
+	{
+		return get_data_range("", handle, xplmType_Data, out, offset, n_max);
+	}
+
+	void DataBus::set_data_vi(const std::string& dr_name, int* in, int offset, int n)
+	{
+		set_data_range(dr_name, dr_handle{ -1 }, xplmType_IntArray, in, offset, n);
+	}
+
+	void DataBus::set_data_vf(const std::string& dr_name, float* in, int offset, int n)
+	{
+		set_data_range(dr_name, dr_handle{ -1 }, xplmType_FloatArray, in, offset, n);
+	}
+
+	void DataBus::set_data_vd(const std::string& dr_name, double* in, int offset, int n)
+	{
+		set_data_range(dr_name, dr_handle{ -1 }, DR_TYPE_DOUBLE_ARRAY, in, offset, n);
+	}
+
+	void DataBus::set_data_b(const std::string& dr_name, char* in, int offset, int n)
+	{
+		set_data_range(dr_name, dr_handle{ -1 }, xplmType_Data, in, offset, n);
+	}
+
+	void DataBus::set_data_vi(dr_handle handle, int* in, int offset, int n)
+	{
+		set_data_range("", handle, xplmType_IntArray, in, offset, n);
+	}
+
+	void DataBus::set_data_vf(dr_handle handle, float* in, int offset, int n)
+	{
+		set_data_range("", handle, xplmType_FloatArray, in, offset, n);
+	}
+
+	void DataBus::set_data_vd(dr_handle handle, double* in, int offset, int n)
+	{
+		set_data_range("", handle, DR_TYPE_DOUBLE_ARRAY, in, offset, n);
+	}
+
+	void DataBus::set_data_b(dr_handle handle, char* in, int offset, int n)
+	{
+		set_data_range("", handle, xplmType_Data, in, offset, n);
+	}
+
+	size_t DataBus::get_range_item_size(int val_type)
+	{
+		if (val_type == xplmType_IntArray)
 		{
-			ret_val = val.int_val;
+			return sizeof(int);
 		}
-		else if (val.val_type == xplmType_Float)
+		else if (val_type == xplmType_FloatArray)
 		{
-			ret_val = int(val.float_val);
+			return sizeof(float);
 		}
-		else if (val.val_type == xplmType_Double)
+		else if (val_type == DR_TYPE_DOUBLE_ARRAY)
 		{
-			ret_val = int(val.double_val);
+			return sizeof(double);
 		}
-		return ret_val;
+		return sizeof(char);
 	}
 
-	float DataBus::get_dataf(std::string dr_name, int offset)
+	size_t DataBus::get_custom_data_ref_size(generic_ptr* custom_ref)
 	{
-		generic_val val = get_data(dr_name, offset);
-		float ret_val = 0;
-		if (val.val_type == xplmType_Int)
+		size_t n_items = custom_ref->n_length;
+		if (n_items == 0)
 		{
-			ret_val = float(val.int_val);
+			n_items = 1;
 		}
-		else if (val.val_type == xplmType_Float)
+		if (custom_ref->ptr_type & (xplmType_Double | DR_TYPE_DOUBLE_ARRAY))
 		{
-			ret_val = val.float_val;
+			return n_items * sizeof(double);
 		}
-		else if (val.val_type == xplmType_Double)
+		else if (custom_ref->ptr_type & xplmType_Data)
 		{
-			ret_val = float(val.double_val);
+			return n_items;
 		}
-		return ret_val;
+		return n_items * sizeof(int);
 	}
 
-	double DataBus::get_datad(std::string dr_name, int offset)
+	void DataBus::mark_written(void* val_ptr)
 	{
-		generic_val val = get_data(dr_name, offset);
-		double ret_val = 0;
-		if (val.val_type == xplmType_Int)
+		/*
+		* Only marks the watches. Whether the value has actually changed
+		* is checked once per frame by dispatch_watches.
+		*/
+		for (size_t i = 0; i < watches.size(); i++)
+		{
+			if (watches[i].custom_ref.ptr == val_ptr)
+			{
+				watches[i].is_changed = true;
+				watches_dirty = true;
+			}
+		}
+	}
+
+	int DataBus::get_data_range(const std::string& dr_name, dr_handle handle, int val_type, void* out, int offset, int n_max)
+	{
+		if (out == nullptr || n_max <= 0 || offset < 0)
+		{
+			return 0;
+		}
+		if (is_stopped.load(std::memory_order_seq_cst))
 		{
-			ret_val = double(val.int_val);
+			return 0;
 		}
-		else if (val.val_type == xplmType_Float)
+		std::promise<int> prom;
+		std::future<int> fut_val = prom.get_future();
+		if (handle.idx < 0)
 		{
-			ret_val = double(val.float_val);
+			handle = get_name_handle(dr_name);
 		}
-		else if (val.val_type == xplmType_Double)
+		range_req req = { handle.idx < 0 ? dr_name : std::string(), handle, val_type, offset, n_max, out, &prom, {},
+			get_enq_time() };
+		while (!range_queue.push(req))
 		{
-			ret_val = val.double_val;
+			if (is_stopped.load(std::memory_order_relaxed))
+			{
+				return 0;
+			}
+			std::this_thread::yield();
 		}
-		return ret_val;
+		check_stopped_after_push();
+		return fut_val.get();
 	}
 
-	std::string DataBus::get_data_s(std::string dr_name, int offset)
+	void DataBus::set_data_range(const std::string& dr_name, dr_handle handle, int val_type, void* in, int offset, int n)
 	{
-		generic_val val = get_data(dr_name, offset);
-		return val.str;
+		if (in == nullptr || n <= 0 || offset < 0 || is_stopped.load(std::memory_order_seq_cst))
+		{
+			return;
+		}
+		char* in_bytes = reinterpret_cast<char*>(in);
+		size_t n_bytes = size_t(n) * get_range_item_size(val_type);
+		if (handle.idx < 0)
+		{
+			handle = get_name_handle(dr_name);
+		}
+		range_req req = { handle.idx < 0 ? dr_name : std::string(), handle, val_type, offset, n, nullptr, nullptr,
+			std::vector<char>(in_bytes, in_bytes + n_bytes), {} };
+		while (!range_queue.push(req) && !is_stopped.load(std::memory_order_relaxed))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	std::future<std::vector<generic_val>> DataBus::get_data_async(std::vector<batch_entry> drs)
+	{
+		/*
+		* Returns immediately. The values are available through the future
+		* after the next flight loop, in the same order as drs.
+		*/
+		std::shared_ptr<std::promise<std::vector<generic_val>>> prom = std::make_shared<std::promise<std::vector<generic_val>>>();
+		std::future<std::vector<generic_val>> fut_val = prom->get_future();
+		add_to_async_queue(async_get_req{ std::move(drs), prom, nullptr, get_enq_time() });
+		return fut_val;
+	}
+
+	void DataBus::get_data_async(std::vector<batch_entry> drs, std::function<void(std::vector<generic_val>*)> callback)
+	{
+		/*
+		* Returns immediately. The callback is called from the main thread,
+		* so it should do nothing more than hand the values over to its owner.
+		*/
+		add_to_async_queue(async_get_req{ std::move(drs), nullptr, callback, get_enq_time() });
+	}
+
+	void DataBus::add_to_async_queue(async_get_req req)
+	{
+		for (size_t i = 0; i < req.entries.size(); i++)
+		{
+			batch_entry* entry = &req.entries[i];
+			if (entry->handle.idx < 0)
+			{
+				entry->handle = get_name_handle(entry->dref);
+				if (entry->handle.idx >= 0)
+				{
+					entry->dref.clear();
+				}
+			}
+		}
+		while (is_stopped.load(std::memory_order_seq_cst) || !async_queue.push(req))
+		{
+			if (is_stopped.load(std::memory_order_relaxed))
+			{
+				// Nobody will process the request, so fail it right away.
+				std::vector<generic_val> vals(req.entries.size(), generic_val{ {0}, "", 0, -1 });
+				complete_async_req(&req, &vals);
+				return;
+			}
+			std::this_thread::yield();
+		}
+		check_stopped_after_push();
+	}
+
+	DataRefSnapshot* DataBus::subscribe(std::vector<snapshot_entry>* drs)
+	{
+		/*
+		* Returns a snapshot of drs that is refreshed by the flight loop every frame.
+		* The snapshot is owned by the data bus and stays valid until it is destroyed.
+		*/
+		for (size_t i = 0; i < drs->size(); i++)
+		{
+			drs->at(i).handle = register_data_ref(drs->at(i).dref);
+		}
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		std::unique_ptr<DataRefSnapshot> snapshot = std::make_unique<DataRefSnapshot>(drs);
+		DataRefSnapshot* ptr = snapshot.get();
+		snapshots_pending.push_back(std::move(snapshot));
+		snapshots_added.store(true, std::memory_order_release);
+		return ptr;
+	}
+
+	int DataBus::watch_data_ref(std::string dr_name, std::function<void(generic_val*)> callback)
+	{
+		// custom_data_refs isn't modified after construction, so it's safe to read here.
+		generic_ptr* custom_ref = find_custom_data_ref(&dr_name);
+		if (custom_ref == nullptr)
+		{
+			return 0;
+		}
+		std::lock_guard<std::mutex> lock(watch_mutex);
+		watches_pending.push_back(dr_watch{ *custom_ref, callback, {}, true });
+		watches_added.store(true, std::memory_order_release);
+		return 1;
+	}
+
+	int DataBus::export_data_refs(std::string shm_name, std::vector<std::string>* dr_names)
+	{
+		std::vector<shm_export_entry> drs;
+		for (size_t i = 0; i < dr_names->size(); i++)
+		{
+			generic_ptr* custom_ref = find_custom_data_ref(&dr_names->at(i));
+			if (custom_ref != nullptr && dr_names->at(i).length() < XPShm::N_SHM_NAME_LENGTH)
+			{
+				drs.push_back({ dr_names->at(i), *custom_ref, get_custom_data_ref_size(custom_ref) });
+			}
+		}
+		std::unique_ptr<ShmExport> tmp = std::make_unique<ShmExport>();
+		if (drs.empty() || !tmp->open(shm_name, &drs))
+		{
+			return 0;
+		}
+		shm_export = std::move(tmp);
+		return int(drs.size());
+	}
+
+	void DataBus::set_data(const std::string& dr_name, generic_val value, int priority)
+	{
+		dr_handle handle = get_name_handle(dr_name);
+		add_to_set_queue(set_req{ handle.idx < 0 ? dr_name : std::string(), handle, value, priority });
+	}
+
+	void DataBus::set_datai(const std::string& dr_name, int value, int offset, int priority)
+	{
+		set_data(dr_name, make_val_i(value, offset), priority);
+	}
+
+	void DataBus::set_dataf(const std::string& dr_name, float value, int offset, int priority)
+	{
+		set_data(dr_name, make_val_f(value, offset), priority);
+	}
+
+	void DataBus::set_datad(const std::string& dr_name, double value, int priority)
+	{
+		set_data(dr_name, make_val_d(value), priority);
+	}
+
+	void DataBus::set_data_s(const std::string& dr_name, std::string in, int offset, int priority)
+	{
+		/*
+		* This function is for custom datarefs only.
+		*/
+		set_data(dr_name, make_val_s(in, offset), priority);
+	}
+
+	void DataBus::set_data(dr_handle handle, generic_val value)
+	{
+		int priority = DB_PRIORITY_NORMAL;
+		if (handle.idx >= 0 && handle.idx < n_handles.load(std::memory_order_acquire))
+		{
+			priority = handles[handle.idx].priority.load(std::memory_order_relaxed);
+		}
+		add_to_set_queue(set_req{ "", handle, value, priority });
+	}
+
+	void DataBus::set_datai(dr_handle handle, int value, int offset)
+	{
+		set_data(handle, make_val_i(value, offset));
+	}
+
+	void DataBus::set_dataf(dr_handle handle, float value, int offset)
+	{
+		set_data(handle, make_val_f(value, offset));
+	}
+
+	void DataBus::set_datad(dr_handle handle, double value)
+	{
+		set_data(handle, make_val_d(value));
 	}
 
-	void DataBus::set_data(std::string dr_name, generic_val value)
+	void DataBus::set_data_s(dr_handle handle, std::string in, int offset)
 	{
-		std::lock_guard<std::mutex> lock(set_queue_mutex);
-		set_queue.push(set_req{ dr_name, value });
+		set_data(handle, make_val_s(in, offset));
 	}
 
-	void DataBus::set_datai(std::string dr_name, int value, int offset)
+	generic_val DataBus::make_val_i(int value, int offset)
 	{
 		int val_type = xplmType_Int;
 		if (offset > 0)
 		{
 			val_type = xplmType_IntArray;
 		}
-		generic_val tmp = { {0}, "", val_type, offset};
+		generic_val tmp = { {0}, "", val_type, offset };
 		tmp.int_val = value;
-		set_data(dr_name, tmp);
+		return tmp;
 	}
 
-	void DataBus::set_dataf(std::string dr_name, float value, int offset)
+	generic_val DataBus::make_val_f(float value, int offset)
 	{
 		int val_type = xplmType_Float;
 		if (offset > 0)
@@ -209,69 +648,65 @@ namespace XPDataBus
 		}
 		generic_val tmp = { {0}, "", val_type, offset };
 		tmp.float_val = value;
-		set_data(dr_name, tmp);
+		return tmp;
 	}
 
-	void DataBus::set_datad(std::string dr_name, double value)
+	generic_val DataBus::make_val_d(double value)
 	{
 		generic_val tmp = { {0}, "", xplmType_Double, 0 };
 		tmp.double_val = value;
-		set_data(dr_name, tmp);
+		return tmp;
 	}
 
-	void DataBus::set_data_s(std::string dr_name, std::string in, int offset)
+	generic_val DataBus::make_val_s(std::string in, int offset)
 	{
-		/*
-		* This function is for custom datarefs only.
-		*/
 		generic_val tmp = { {0}, in, xplmType_Data, offset };
-		set_data(dr_name, tmp);
+		return tmp;
 	}
 
-	int DataBus::get_data_ref_value(std::string* dr_name, generic_val* out)
+	int DataBus::get_data_ref_value(data_ref_entry* ref, generic_val* out)
 	{
 		/*
 		* This function gets a value of a dataref that isn't owned by this plugin
 		*/
-		data_ref_entry ref = data_refs[*dr_name];
-		if (ref.dr_type == xplmType_Int)
+		if (ref->dr_type == xplmType_Int)
 		{
 			out->val_type = xplmType_Int;
-			out->int_val = XPLMGetDatai(ref.ref);
+			out->int_val = XPLMGetDatai(ref->ref);
 			return 1;
 		}
-		else if (ref.dr_type == xplmType_Float)
+		else if (ref->dr_type == xplmType_Float)
 		{
 			out->val_type = xplmType_Float;
-			out->float_val = XPLMGetDataf(ref.ref);
+			out->float_val = XPLMGetDataf(ref->ref);
 			return 1;
 		}
-		else if (ref.dr_type == xplmType_Double)
+		else if (ref->dr_type == xplmType_Double)
 		{
 			out->val_type = xplmType_Double;
-			out->double_val = XPLMGetDatad(ref.ref);
+			out->double_val = XPLMGetDatad(ref->ref);
 			return 1;
 		}
-		else if (xplmType_IntArray & ref.dr_type)
+		else if (xplmType_IntArray & ref->dr_type)
 		{
 			out->val_type = xplmType_Int;
-			return XPLMGetDatavi(ref.ref, &out->int_val, out->offset, 1);
+			return XPLMGetDatavi(ref->ref, &out->int_val, out->offset, 1);
 		}
-		else if (xplmType_FloatArray & ref.dr_type)
+		else if (xplmType_FloatArray & ref->dr_type)
 		{
 			out->val_type = xplmType_Float;
-			return XPLMGetDatavf(ref.ref, &out->float_val, out->offset, 1);
+			return XPLMGetDatavf(ref->ref, &out->float_val, out->offset, 1);
 		}
 		return 0;
 	}
 
-	int DataBus::get_custom_data_ref_value(std::string* dr_name, generic_val* out)
+	int DataBus::get_custom_data_ref_value(generic_ptr* custom_ref, generic_val* out)
 	{
 		/*
 		* This function gets a value of a dataref that is owned by this plugin
 		*/
 		int offset = out->offset;
-		generic_ptr ptr = custom_data_refs[*dr_name];
+		generic_ptr ptr = *custom_ref;
 		if (ptr.ptr_type == xplmType_Int)
 		{
 			out->val_type = xplmType_Int;
@@ -306,49 +741,46 @@ namespace XPDataBus
 		{
 			out->val_type = xplmType_Data;
 			char* data = reinterpret_cast<char*>(ptr.ptr);
-			for (int i = offset; i < ptr.n_length; i++)
-			{
-				out->str.push_back(data[i]);
-			}
+			out->str.assign(data + offset, ptr.n_length - size_t(offset));
 			return 1;
 		}
 		return 0;
 	}
 
-	void DataBus::set_data_ref_value(std::string* dr_name, generic_val* in)
+	void DataBus::set_data_ref_value(data_ref_entry* ref, generic_val* in)
 	{
 		/*
 		* This function sets a value of a dataref that isn't owned by this plugin
 		*/
-		data_ref_entry ref = data_refs[*dr_name];
-		if (ref.dr_type == xplmType_Int)
+		if (ref->dr_type == xplmType_Int)
 		{
-			XPLMSetDatai(ref.ref, in->int_val);
+			XPLMSetDatai(ref->ref, in->int_val);
 		}
-		else if (ref.dr_type == xplmType_Float)
+		else if (ref->dr_type == xplmType_Float)
 		{
-			XPLMSetDataf(ref.ref, in->float_val);
+			XPLMSetDataf(ref->ref, in->float_val);
 		}
-		else if (ref.dr_type == xplmType_Double)
+		else if (ref->dr_type == xplmType_Double)
 		{
-			XPLMSetDatad(ref.ref, in->double_val);
+			XPLMSetDatad(ref->ref, in->double_val);
 		}
-		else if (xplmType_IntArray & ref.dr_type)
+		else if (xplmType_IntArray & ref->dr_type)
 		{
-			XPLMSetDatavi(data_refs[*dr_name].ref, &in->int_val, in->offset, 1);
+			XPLMSetDatavi(ref->ref, &in->int_val, in->offset, 1);
 		}
-		else if (xplmType_FloatArray & data_refs[*dr_name].dr_type)
+		else if (xplmType_FloatArray & ref->dr_type)
 		{
-			XPLMSetDatavf(data_refs[*dr_name].ref, &in->float_val, in->offset, 1);
+			XPLMSetDatavf(ref->ref, &in->float_val, in->offset, 1);
 		}
 	}
 
-	void DataBus::set_custom_data_ref_value(std::string* dr_name, generic_val* in)
+	void DataBus::set_custom_data_ref_value(generic_ptr* custom_ref, generic_val* in)
 	{
 		/*
 		* This function sets a value of a dataref that is owned by this plugin.
 		*/
-		generic_ptr ptr = custom_data_refs[*dr_name];
+		mark_written(custom_ref->ptr);
+		generic_ptr ptr = *custom_ref;
 		if (ptr.ptr_type == xplmType_Int)
 		{
 			*reinterpret_cast<int*>(ptr.ptr) = in->int_val;
@@ -395,49 +827,54 @@ namespace XPDataBus
 		}
 	}
 
-	int DataBus::get_data_ref(std::string* dr_name, generic_val* out)
+	data_ref_entry* DataBus::find_data_ref(std::string* dr_name)
 	{
-		XPLMDataRef ref_ptr = nullptr;
-		if (data_refs.find(*dr_name) != data_refs.end())
+		auto it = data_refs.find(*dr_name);
+		if (it != data_refs.end())
 		{
-			ref_ptr = data_refs[*dr_name].ref;
+			return &it->second;
 		}
-		else
+		return add_data_ref_entry(dr_name);
+	}
+
+	generic_ptr* DataBus::find_custom_data_ref(std::string* dr_name)
+	{
+		auto it = custom_data_refs.find(*dr_name);
+		if (it != custom_data_refs.end())
 		{
-			ref_ptr = add_data_ref_entry(dr_name);
+			return &it->second;
 		}
-		if (ref_ptr != nullptr)
+		return nullptr;
+	}
+
+	int DataBus::get_data_ref(std::string* dr_name, generic_val* out)
+	{
+		data_ref_entry* ref = find_data_ref(dr_name);
+		if (ref != nullptr)
 		{
-			return get_data_ref_value(dr_name, out);
+			return get_data_ref_value(ref, out);
 		}
 		return 0;
 	}
 
 	int DataBus::get_custom_data_ref(std::string* dr_name, generic_val* out)
 	{
-		if (custom_data_refs.find(*dr_name) != custom_data_refs.end())
+		generic_ptr* custom_ref = find_custom_data_ref(dr_name);
+		if (custom_ref != nullptr)
 		{
-			return get_custom_data_ref_value(dr_name, out);
+			return get_custom_data_ref_value(custom_ref, out);
 		}
 		return 0;
 	}
 
 	int DataBus::set_data_ref(std::string* dr_name, generic_val* in)
 	{
-		XPLMDataRef ref_ptr = nullptr;
-		if (data_refs.find(*dr_name) != data_refs.end())
+		data_ref_entry* ref = find_data_ref(dr_name);
+		if (ref != nullptr)
 		{
-			ref_ptr = data_refs[*dr_name].ref;
-		}
-		else
-		{
-			ref_ptr = add_data_ref_entry(dr_name);
-		}
-		if (ref_ptr != nullptr)
-		{
-			if (data_refs[*dr_name].dr_type & in->val_type)
+			if (ref->dr_type & in->val_type)
 			{
-				set_data_ref_value(dr_name, in);
+				set_data_ref_value(ref, in);
 				return 1;
 			}
 			return 3;
@@ -447,11 +884,12 @@ namespace XPDataBus
 
 	int DataBus::set_custom_data_ref(std::string* dr_name, generic_val* in)
 	{
-		if (custom_data_refs.find(*dr_name) != custom_data_refs.end())
+		generic_ptr* custom_ref = find_custom_data_ref(dr_name);
+		if (custom_ref != nullptr)
 		{
-			if (custom_data_refs[*dr_name].ptr_type & in->val_type)
+			if (custom_ref->ptr_type & in->val_type)
 			{
-				set_custom_data_ref_value(dr_name, in);
+				set_custom_data_ref_value(custom_ref, in);
 				return 1;
 			}
 			return 3;
@@ -459,42 +897,758 @@ namespace XPDataBus
 		return 0;
 	}
 
-	void DataBus::get_data_refs()
+	int DataBus::get_data_ref_range(data_ref_entry* ref, range_req* req)
 	{
-		uint64_t counter = 0;
-		while (get_queue.size() && counter < max_queue_refresh)
+		/*
+		* This function gets a slice of a dataref that isn't owned by this plugin.
+		* There are no double arrays in X-plane, so double buffers are filled from float arrays.
+		*/
+		if (req->val_type == xplmType_IntArray && (xplmType_IntArray & ref->dr_type))
 		{
-			std::lock_guard<std::mutex> lock(get_queue_mutex);
-			get_req data = get_queue.front();
-			get_queue.pop();
-			generic_val tmp = { {0}, "", 0, data.offset};
-			if (get_custom_data_ref(&data.dref, &tmp) != 1)
+			return XPLMGetDatavi(ref->ref, reinterpret_cast<int*>(req->out), req->offset, req->n_max);
+		}
+		else if (req->val_type == xplmType_FloatArray && (xplmType_FloatArray & ref->dr_type))
+		{
+			return XPLMGetDatavf(ref->ref, reinterpret_cast<float*>(req->out), req->offset, req->n_max);
+		}
+		else if (req->val_type == DR_TYPE_DOUBLE_ARRAY && (xplmType_FloatArray & ref->dr_type))
+		{
+			if (range_tmp.size() < size_t(req->n_max))
+			{
+				range_tmp.resize(req->n_max);
+			}
+			int n_read = XPLMGetDatavf(ref->ref, range_tmp.data(), req->offset, req->n_max);
+			double* out = reinterpret_cast<double*>(req->out);
+			for (int i = 0; i < n_read; i++)
+			{
+				out[i] = double(range_tmp[i]);
+			}
+			return n_read;
+		}
+		else if (req->val_type == xplmType_Data && (xplmType_Data & ref->dr_type))
+		{
+			return XPLMGetDatab(ref->ref, req->out, req->offset, req->n_max);
+		}
+		return 0;
+	}
+
+	int DataBus::get_custom_data_ref_range(generic_ptr* custom_ref, range_req* req)
+	{
+		/*
+		* This function gets a slice of a dataref that is owned by this plugin.
+		*/
+		if (size_t(req->offset) >= custom_ref->n_length)
+		{
+			return 0;
+		}
+		int n_read = int(custom_ref->n_length) - req->offset;
+		if (n_read > req->n_max)
+		{
+			n_read = req->n_max;
+		}
+		if (req->val_type == DR_TYPE_DOUBLE_ARRAY && (xplmType_FloatArray & custom_ref->ptr_type))
+		{
+			float* src = reinterpret_cast<float*>(custom_ref->ptr) + req->offset;
+			double* out = reinterpret_cast<double*>(req->out);
+			for (int i = 0; i < n_read; i++)
+			{
+				out[i] = double(src[i]);
+			}
+			return n_read;
+		}
+		else if (req->val_type & custom_ref->ptr_type)
+		{
+			size_t item_size = get_range_item_size(req->val_type);
+			char* src = reinterpret_cast<char*>(custom_ref->ptr) + size_t(req->offset) * item_size;
+			memcpy(req->out, src, size_t(n_read) * item_size);
+			return n_read;
+		}
+		return 0;
+	}
+
+	int DataBus::set_data_ref_range(data_ref_entry* ref, range_req* req)
+	{
+		/*
+		* This function sets a slice of a dataref that isn't owned by this plugin.
+		*/
+		if (req->val_type == xplmType_IntArray && (xplmType_IntArray & ref->dr_type))
+		{
+			XPLMSetDatavi(ref->ref, reinterpret_cast<int*>(req->in.data()), req->offset, req->n_max);
+			return req->n_max;
+		}
+		else if (req->val_type == xplmType_FloatArray && (xplmType_FloatArray & ref->dr_type))
+		{
+			XPLMSetDatavf(ref->ref, reinterpret_cast<float*>(req->in.data()), req->offset, req->n_max);
+			return req->n_max;
+		}
+		else if (req->val_type == DR_TYPE_DOUBLE_ARRAY && (xplmType_FloatArray & ref->dr_type))
+		{
+			if (range_tmp.size() < size_t(req->n_max))
+			{
+				range_tmp.resize(req->n_max);
+			}
+			double* in = reinterpret_cast<double*>(req->in.data());
+			for (int i = 0; i < req->n_max; i++)
+			{
+				range_tmp[i] = float(in[i]);
+			}
+			XPLMSetDatavf(ref->ref, range_tmp.data(), req->offset, req->n_max);
+			return req->n_max;
+		}
+		else if (req->val_type == xplmType_Data && (xplmType_Data & ref->dr_type))
+		{
+			XPLMSetDatab(ref->ref, req->in.data(), req->offset, req->n_max);
+			return req->n_max;
+		}
+		return 0;
+	}
+
+	int DataBus::set_custom_data_ref_range(generic_ptr* custom_ref, range_req* req)
+	{
+		/*
+		* This function sets a slice of a dataref that is owned by this plugin.
+		*/
+		if (size_t(req->offset) >= custom_ref->n_length)
+		{
+			return 0;
+		}
+		mark_written(custom_ref->ptr);
+		int n_written = int(custom_ref->n_length) - req->offset;
+		if (n_written > req->n_max)
+		{
+			n_written = req->n_max;
+		}
+		if (req->val_type == DR_TYPE_DOUBLE_ARRAY && (xplmType_FloatArray & custom_ref->ptr_type))
+		{
+			float* dst = reinterpret_cast<float*>(custom_ref->ptr) + req->offset;
+			double* in = reinterpret_cast<double*>(req->in.data());
+			for (int i = 0; i < n_written; i++)
+			{
+				dst[i] = float(in[i]);
+			}
+			return n_written;
+		}
+		else if (req->val_type & custom_ref->ptr_type)
+		{
+			size_t item_size = get_range_item_size(req->val_type);
+			char* dst = reinterpret_cast<char*>(custom_ref->ptr) + size_t(req->offset) * item_size;
+			memcpy(dst, req->in.data(), size_t(n_written) * item_size);
+			return n_written;
+		}
+		return 0;
+	}
+
+	int DataBus::apply_range_req(range_req* req)
+	{
+		bool is_set = req->prom == nullptr;
+		generic_ptr* custom_ref = nullptr;
+		data_ref_entry* ref = nullptr;
+		if (req->handle.idx >= 0)
+		{
+			dr_handle_entry* entry = resolve_handle(req->handle);
+			if (entry == nullptr)
+			{
+				return 0;
+			}
+			if (entry->is_custom)
+			{
+				custom_ref = &entry->custom_ref;
+			}
+			else
+			{
+				ref = &entry->ref;
+			}
+		}
+		else
+		{
+			custom_ref = find_custom_data_ref(&req->dref);
+			if (custom_ref == nullptr)
+			{
+				ref = find_data_ref(&req->dref);
+			}
+		}
+
+		if (custom_ref != nullptr)
+		{
+			if (is_set)
+			{
+				return set_custom_data_ref_range(custom_ref, req);
+			}
+			return get_custom_data_ref_range(custom_ref, req);
+		}
+		else if (ref != nullptr)
+		{
+			if (is_set)
+			{
+				return set_data_ref_range(ref, req);
+			}
+			return get_data_ref_range(ref, req);
+		}
+		return 0;
+	}
+
+	dr_handle_entry* DataBus::resolve_handle(dr_handle handle)
+	{
+		/*
+		* Returns nullptr if the handle is invalid or if the dataref doesn't exist(yet).
+		*/
+		if (handle.idx < 0 || handle.idx >= n_handles.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		dr_handle_entry* entry = &handles[handle.idx];
+		if (!entry->is_resolved)
+		{
+			generic_ptr* custom_ref = find_custom_data_ref(&entry->name);
+			if (custom_ref != nullptr)
+			{
+				entry->is_custom = true;
+				entry->custom_ref = *custom_ref;
+			}
+			else
 			{
-				if (get_data_ref(&data.dref, &tmp) != 1)
+				data_ref_entry* ref = find_data_ref(&entry->name);
+				if (ref == nullptr)
 				{
-					tmp.offset = -1;
+					return nullptr;
 				}
+				entry->is_custom = false;
+				entry->ref = *ref;
+			}
+			entry->is_resolved = true;
+		}
+		return entry;
+	}
+
+	int DataBus::get_data_ref(dr_handle handle, generic_val* out)
+	{
+		dr_handle_entry* entry = resolve_handle(handle);
+		if (entry != nullptr)
+		{
+			if (entry->is_custom)
+			{
+				return get_custom_data_ref_value(&entry->custom_ref, out);
+			}
+			return get_data_ref_value(&entry->ref, out);
+		}
+		return 0;
+	}
+
+	int DataBus::set_data_ref(dr_handle handle, generic_val* in)
+	{
+		dr_handle_entry* entry = resolve_handle(handle);
+		if (entry != nullptr)
+		{
+			if (entry->is_custom && (entry->custom_ref.ptr_type & in->val_type))
+			{
+				set_custom_data_ref_value(&entry->custom_ref, in);
+				return 1;
+			}
+			else if (!entry->is_custom && (entry->ref.dr_type & in->val_type))
+			{
+				set_data_ref_value(&entry->ref, in);
+				return 1;
+			}
+			return 3;
+		}
+		return 0;
+	}
+
+	void DataBus::get_data_refs()
+	{
+		uint64_t counter = 0;
+		get_req data;
+		while (counter < max_queue_refresh && !is_over_budget(counter) && get_queue.pop(&data))
+		{
+			generic_val tmp = { {0}, "", 0, data.offset};
+			read_data_ref(&data.dref, data.handle, &tmp);
+			if (recorder != nullptr)
+			{
+				recorder->add_get(get_rec_name_id(&data.dref, data.handle), &tmp, add_get_latency(data.t_enq));
+			}
+			else
+			{
+				add_get_latency(data.t_enq);
 			}
 			data.prom->set_value(tmp);
 			counter++;
 		}
+		frame_n_served += counter;
+	}
+
+	std::chrono::steady_clock::time_point DataBus::get_enq_time()
+	{
+		if (!is_timing_reqs.load(std::memory_order_relaxed))
+		{
+			return std::chrono::steady_clock::time_point();
+		}
+		return std::chrono::steady_clock::now();
+	}
+
+	uint32_t DataBus::add_get_latency(std::chrono::steady_clock::time_point t_enq)
+	{
+		if (t_enq == std::chrono::steady_clock::time_point())
+		{
+			return 0;
+		}
+		std::chrono::steady_clock::duration latency = std::chrono::steady_clock::now() - t_enq;
+		uint64_t latency_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+		if (is_metrics_enabled)
+		{
+			metrics.add_get_latency(latency_us);
+		}
+		return uint32_t(latency_us);
+	}
+
+	uint32_t DataBus::get_rec_name_id(std::string* dr_name, dr_handle handle)
+	{
+		/*
+		* Returns id of the dataref in the log. Datarefs are added
+		* to the log along with their type the first time they are used.
+		*/
+		std::string* name = dr_name;
+		if (handle.idx >= 0 && handle.idx < n_handles.load(std::memory_order_acquire))
+		{
+			name = &handles[handle.idx].name;
+		}
+		uint32_t id = recorder->find_name(name);
+		if (id != UINT32_MAX)
+		{
+			return id;
+		}
+		generic_ptr* custom_ref = find_custom_data_ref(name);
+		if (custom_ref != nullptr)
+		{
+			return recorder->add_name(name, custom_ref->ptr_type, uint32_t(custom_ref->n_length), true);
+		}
+		int type = xplmType_Unknown;
+		int n_length = 0;
+		data_ref_entry* ref = find_data_ref(name);
+		if (ref != nullptr)
+		{
+			type = ref->dr_type;
+			if (type & xplmType_IntArray)
+			{
+				n_length = XPLMGetDatavi(ref->ref, nullptr, 0, 0);
+			}
+			else if (type & xplmType_FloatArray)
+			{
+				n_length = XPLMGetDatavf(ref->ref, nullptr, 0, 0);
+			}
+			else if (type & xplmType_Data)
+			{
+				n_length = XPLMGetDatab(ref->ref, nullptr, 0, 0);
+			}
+		}
+		return recorder->add_name(name, type, uint32_t(n_length), false);
+	}
+
+	void DataBus::process_async_reqs()
+	{
+		/*
+		* Resolves every batch that has been queued since the last frame
+		* in a single pass.
+		*/
+		uint64_t counter = 0;
+		async_get_req data;
+		while (counter < max_queue_refresh && !is_over_budget(counter) && async_queue.pop(&data))
+		{
+			std::vector<generic_val> vals(data.entries.size());
+			for (size_t i = 0; i < data.entries.size(); i++)
+			{
+				batch_entry* entry = &data.entries[i];
+				vals[i] = { {0}, "", 0, entry->offset };
+				read_data_ref(&entry->dref, entry->handle, &vals[i]);
+			}
+			uint32_t latency_us = add_get_latency(data.t_enq);
+			if (recorder != nullptr)
+			{
+				// complete_async_req hands vals over to the caller, so they're recorded first.
+				for (size_t i = 0; i < data.entries.size(); i++)
+				{
+					batch_entry* entry = &data.entries[i];
+					recorder->add_get(get_rec_name_id(&entry->dref, entry->handle), &vals[i], latency_us);
+				}
+			}
+			complete_async_req(&data, &vals);
+			counter += data.entries.size();
+		}
+		frame_n_served += counter;
+	}
+
+	void DataBus::complete_async_req(async_get_req* req, std::vector<generic_val>* vals)
+	{
+		if (req->callback)
+		{
+			req->callback(vals);
+		}
+		else if (req->prom != nullptr)
+		{
+			req->prom->set_value(std::move(*vals));
+		}
+	}
+
+	int DataBus::read_data_ref(std::string* dr_name, dr_handle handle, generic_val* out)
+	{
+		/*
+		* Sets out->offset to -1 if the value couldn't be read.
+		*/
+		if (handle.idx >= 0)
+		{
+			if (get_data_ref(handle, out) == 1)
+			{
+				return 1;
+			}
+		}
+		else if (get_custom_data_ref(dr_name, out) == 1 || get_data_ref(dr_name, out) == 1)
+		{
+			return 1;
+		}
+		out->offset = -1;
+		return 0;
+	}
+
+	void DataBus::set_coalescing(bool enable)
+	{
+		coalesce_sets.store(enable, std::memory_order_relaxed);
+	}
+
+	int DataBus::apply_set_req(set_req* req)
+	{
+		if (req->handle.idx >= 0)
+		{
+			return set_data_ref(req->handle, &req->val);
+		}
+		int retval = set_custom_data_ref(&req->dref, &req->val);
+		if (retval == 0)
+		{
+			retval = set_data_ref(&req->dref, &req->val);
+		}
+		return retval;
+	}
+
+	void DataBus::set_time_budget(uint64_t budget_us)
+	{
+		time_budget_us.store(budget_us, std::memory_order_relaxed);
+	}
+
+	databus_stats DataBus::get_stats()
+	{
+		return metrics.get_stats();
+	}
+
+	DataBusMetrics* DataBus::get_metrics()
+	{
+		return &metrics;
+	}
+
+	void DataBus::enable_metrics(std::string dr_prefix, double log_interval_sec)
+	{
+		/*
+		* Registers read-only metrics datarefs named dr_prefix + metric name.
+		* If log_interval_sec is above 0, a summary is written to Log.txt
+		* every log_interval_sec seconds.
+		*/
+		metrics.register_data_refs(dr_prefix);
+		is_metrics_enabled = true;
+		is_timing_reqs.store(true, std::memory_order_relaxed);
+		metrics_log_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(log_interval_sec));
+		metrics_last_log = std::chrono::steady_clock::now();
+	}
+
+	int DataBus::start_recording(std::string path)
+	{
+		/*
+		* The log header stores the settings that affect the order in which
+		* requests are served, so that a replay can use the same ones.
+		*/
+		rec_file_header hdr = {};
+		hdr.coalesce_sets = coalesce_sets.load(std::memory_order_relaxed);
+		hdr.max_queue_refresh = max_queue_refresh;
+		hdr.time_budget_us = time_budget_us.load(std::memory_order_relaxed);
+		std::unique_ptr<DataBusRecorder> tmp = std::make_unique<DataBusRecorder>();
+		if (!tmp->open(path, &hdr))
+		{
+			return 0;
+		}
+		recorder = std::move(tmp);
+		is_timing_reqs.store(true, std::memory_order_relaxed);
+		return 1;
+	}
+
+	void DataBus::stop_recording()
+	{
+		recorder.reset();
+		is_timing_reqs.store(is_metrics_enabled, std::memory_order_relaxed);
+	}
+
+	bool DataBus::is_over_budget(uint64_t n_served)
+	{
+		if (frame_budget_us == 0 || n_served == 0)
+		{
+			return false;
+		}
+		return std::chrono::steady_clock::now() >= frame_deadline;
+	}
+
+	void DataBus::drain_set_queue()
+	{
+		/*
+		* Moves set requests from the lock-free queue to the pending list of their priority.
+		* With coalescing enabled, only the latest value for every (dataref, offset) pair
+		* is kept. A request that replaces an older one is moved to the back, so that
+		* writes to overlapping parts of the same dataref stay in order.
+		* Writes that don't fit into this frame wait for the next one and
+		* can still be replaced by newer values meanwhile.
+		*/
+		bool coalesce = coalesce_sets.load(std::memory_order_relaxed);
+		set_req data;
+		while (n_pending_sets < N_DATABUS_QUEUE_SIZE && set_queue.pop(&data))
+		{
+			int priority = data.priority;
+			if (priority < 0 || priority >= N_DB_PRIORITIES)
+			{
+				priority = DB_PRIORITY_NORMAL;
+			}
+			std::deque<set_req>* pending = &pending_sets[priority];
+			size_t seq = pending_base[priority] + pending->size();
+			if (coalesce)
+			{
+				set_key key = { data.dref, data.handle.idx, data.val.offset };
+				auto it = coalesced_idx.find(key);
+				if (it != coalesced_idx.end())
+				{
+					pending_set_idx* old = &it->second;
+					size_t old_pos = old->seq - pending_base[old->priority];
+					pending_sets[old->priority][old_pos].handle.idx = SET_REQ_REPLACED;
+					n_pending_sets--;
+					old->priority = priority;
+					old->seq = seq;
+				}
+				else
+				{
+					coalesced_idx.insert(std::make_pair(key, pending_set_idx{ priority, seq }));
+				}
+			}
+			pending->push_back(std::move(data));
+			n_pending_sets++;
+		}
+	}
+
+	void DataBus::set_data_refs(int priority)
+	{
+		std::deque<set_req>* pending = &pending_sets[priority];
+		uint64_t n_served = 0;
+		while (pending->size() && frame_n_sets < max_queue_refresh && !is_over_budget(n_served))
+		{
+			set_req* req = &pending->front();
+			if (req->handle.idx != SET_REQ_REPLACED)
+			{
+				if (coalesced_idx.size())
+				{
+					coalesced_idx.erase(set_key{ req->dref, req->handle.idx, req->val.offset });
+				}
+				apply_set_req(req);
+				if (recorder != nullptr)
+				{
+					recorder->add_set(get_rec_name_id(&req->dref, req->handle), priority, &req->val);
+				}
+				frame_n_sets++;
+				frame_n_served++;
+				n_served++;
+				n_pending_sets--;
+			}
+			pending->pop_front();
+			pending_base[priority]++;
+		}
 	}
 
-	void DataBus::set_data_refs()
+	void DataBus::process_range_reqs()
 	{
 		uint64_t counter = 0;
-		while (set_queue.size() && counter < max_queue_refresh)
+		range_req data;
+		while (counter < max_queue_refresh && !is_over_budget(counter) && range_queue.pop(&data))
 		{
-			std::lock_guard<std::mutex> lock(set_queue_mutex);
-			set_req data = set_queue.front();
-			set_queue.pop();
-			int retval = 0;
-			if (set_custom_data_ref(&data.dref, &data.val) == 0)
+			int n_items = apply_range_req(&data);
+			uint32_t latency_us = 0;
+			if (data.prom != nullptr)
+			{
+				latency_us = add_get_latency(data.t_enq);
+			}
+			if (recorder != nullptr)
+			{
+				recorder->add_range(get_rec_name_id(&data.dref, data.handle), data.prom == nullptr,
+					data.val_type, data.offset, data.n_max, &data.in, latency_us);
+			}
+			if (data.prom != nullptr)
 			{
-				retval = set_data_ref(&data.dref, &data.val);
+				data.prom->set_value(n_items);
 			}
 			counter++;
 		}
+		frame_n_served += counter;
+	}
+
+	void DataBus::publish_snapshots()
+	{
+		if (snapshots_added.load(std::memory_order_acquire))
+		{
+			// Don't stall the sim if a worker thread is subscribing right now.
+			// New subscriptions will be picked up during the next frame.
+			std::unique_lock<std::mutex> lock(snapshot_mutex, std::try_to_lock);
+			if (lock.owns_lock())
+			{
+				for (size_t i = 0; i < snapshots_pending.size(); i++)
+				{
+					snapshots.push_back(std::move(snapshots_pending[i]));
+				}
+				snapshots_pending.clear();
+				snapshots_added.store(false, std::memory_order_relaxed);
+			}
+		}
+
+		for (size_t i = 0; i < snapshots.size(); i++)
+		{
+			DataRefSnapshot* snapshot = snapshots[i].get();
+			generic_val* buf = snapshot->get_back_buf();
+			for (size_t j = 0; j < snapshot->entries.size(); j++)
+			{
+				snapshot_entry* entry = &snapshot->entries[j];
+				generic_val* out = &buf[j];
+				out->str.clear();
+				out->val_type = 0;
+				out->offset = entry->offset;
+				if (get_data_ref(entry->handle, out) != 1)
+				{
+					out->offset = -1;
+				}
+			}
+			snapshot->publish(frame_counter);
+		}
+	}
+
+	void DataBus::on_flight_loop()
+	{
+		/*
+		* User-facing writes go first. Everything that doesn't fit into
+		* the time budget is left for the next frame. Snapshots are always
+		* published, so that their readers never see a stale frame.
+		*/
+		if (is_stopped.load(std::memory_order_acquire))
+		{
+			// The queues belong to drain_stopped_queues now.
+			return;
+		}
+		std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+		frame_counter++;
+		frame_budget_us = time_budget_us.load(std::memory_order_relaxed);
+		frame_deadline = frame_start + std::chrono::microseconds(frame_budget_us);
+		frame_n_sets = 0;
+		frame_n_served = 0;
+
+		databus_frame_info info;
+		info.get_queue_depth = get_queue.size() + async_queue.size() + range_queue.size();
+		info.set_queue_depth = set_queue.size() + n_pending_sets;
+
+		drain_set_queue();
+		set_data_refs(DB_PRIORITY_USER);
+		get_data_refs();
+		process_async_reqs();
+		set_data_refs(DB_PRIORITY_NORMAL);
+		process_range_reqs();
+		set_data_refs(DB_PRIORITY_LOW);
+		dispatch_watches();
+		publish_snapshots();
+		if (shm_export != nullptr)
+		{
+			shm_export->publish(frame_counter);
+		}
+
+		std::chrono::steady_clock::time_point frame_end = std::chrono::steady_clock::now();
+		info.n_served = frame_n_served;
+		info.n_deferred = get_queue.size() + async_queue.size() + range_queue.size() +
+			set_queue.size() + n_pending_sets;
+		info.callback_time_us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(frame_end - frame_start).count());
+		info.is_over_budget = frame_budget_us != 0 && frame_end >= frame_deadline;
+		metrics.add_frame(&info);
+		if (recorder != nullptr)
+		{
+			recorder->add_frame(frame_counter, uint32_t(info.callback_time_us));
+		}
+
+		if (metrics_log_interval.count() > 0 && frame_end - metrics_last_log >= metrics_log_interval)
+		{
+			metrics_last_log = frame_end;
+			XPLMDebugString(metrics.get_summary().c_str());
+		}
+		if (has_failed_handles.load(std::memory_order_acquire))
+		{
+			log_failed_handles();
+		}
+	}
+
+	void DataBus::log_failed_handles()
+	{
+		std::lock_guard<std::mutex> lock(handle_mutex);
+		for (size_t i = 0; i < failed_handles.size(); i++)
+		{
+			std::string msg = "DataBus: Handle table is full. Failed to register " + failed_handles[i] + "\n";
+			XPLMDebugString(msg.c_str());
+		}
+		failed_handles.clear();
+		has_failed_handles.store(false, std::memory_order_release);
+	}
+
+	void DataBus::dispatch_watches()
+	{
+		if (watches_added.load(std::memory_order_acquire))
+		{
+			std::unique_lock<std::mutex> lock(watch_mutex, std::try_to_lock);
+			if (lock.owns_lock())
+			{
+				for (size_t i = 0; i < watches_pending.size(); i++)
+				{
+					watches.push_back(std::move(watches_pending[i]));
+				}
+				watches_pending.clear();
+				watches_added.store(false, std::memory_order_relaxed);
+				watches_dirty = true;
+			}
+		}
+		if (!watches_dirty)
+		{
+			return;
+		}
+		watches_dirty = false;
+
+		for (size_t i = 0; i < watches.size(); i++)
+		{
+			dr_watch* watch = &watches[i];
+			if (!watch->is_changed)
+			{
+				continue;
+			}
+			watch->is_changed = false;
+			char* data = reinterpret_cast<char*>(watch->custom_ref.ptr);
+			size_t n_bytes = get_custom_data_ref_size(&watch->custom_ref);
+			if (watch->last_val.size() == n_bytes && memcmp(watch->last_val.data(), data, n_bytes) == 0)
+			{
+				continue;
+			}
+			watch->last_val.assign(data, data + n_bytes);
+			generic_val val = { {0}, "", 0, 0 };
+			if (get_custom_data_ref_value(&watch->custom_ref, &val))
+			{
+				watch->callback(&val);
+			}
+		}
+	}
+
+	void DataBus::on_custom_data_ref_write(void* val_ptr, void* ref)
+	{
+		DataBus* ptr = reinterpret_cast<DataBus*>(ref);
+		ptr->mark_written(val_ptr);
 	}
 
 	XPLMFlightLoopID DataBus::reg_flt_loop()
@@ -506,8 +1660,7 @@ namespace XPDataBus
 		loop.callbackFunc = [](float elapsedMe, float elapsedSim, int counter, void* ref) -> float 
 								{
 									DataBus* ptr = reinterpret_cast<DataBus*>(ref);
-									ptr->get_data_refs();
-									ptr->set_data_refs();
+									ptr->on_flight_loop();
 									return -1;
 								};
 		return XPLMCreateFlightLoop(&loop);
@@ -515,17 +1668,39 @@ namespace XPDataBus
 
 	void DataBus::cleanup()
 	{
-		while (get_queue.size())
+		is_stopped.store(true, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		drain_stopped_queues();
+	}
+
+	void DataBus::drain_stopped_queues()
+	{
+		std::lock_guard<std::mutex> lock(drain_mutex);
+		get_req data;
+		while (get_queue.pop(&data))
 		{
 			generic_val tmp = { {0}, "", 0, 0 };
-			get_req data = get_queue.front();
-			get_queue.pop();
 			data.prom->set_value(tmp);
 		}
+		async_get_req async_data;
+		while (async_queue.pop(&async_data))
+		{
+			std::vector<generic_val> vals(async_data.entries.size(), generic_val{ {0}, "", 0, -1 });
+			complete_async_req(&async_data, &vals);
+		}
+		range_req range_data;
+		while (range_queue.pop(&range_data))
+		{
+			if (range_data.prom != nullptr)
+			{
+				range_data.prom->set_value(0);
+			}
+		}
 	}
 
 	DataBus::~DataBus()
 	{
+		metrics.unregister_data_refs();
 		delete[] path_sep;
 		if (flt_loop_id != nullptr)
 		{
@@ -10,29 +10,117 @@
 #include "XPLMUtilities.h"
 #include "XPLMPlugin.h"
 #include "common.h"
+#include "dr_snapshot.h"
+#include "mpsc_queue.h"
+#include "databus_metrics.h"
+#include "shm_export.h"
+#include "databus_recorder.h"
 #include <vector>
-#include <queue>
+#include <cstring>
 #include <future>
 #include <unordered_map>
 #include <mutex>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <chrono>
 
 
 constexpr size_t CHAR_BUF_SIZE = 2048;
+constexpr size_t N_MAX_DR_HANDLES = 4096;
+constexpr size_t N_DATABUS_QUEUE_SIZE = 4096; // Must be a power of 2
+constexpr int SET_REQ_REPLACED = -2; // Handle index of a coalesced set request that has been replaced
+
+
+enum databus_priorities
+{
+	DB_PRIORITY_USER = 0, // User-facing writes, e.g. CDU screen
+	DB_PRIORITY_NORMAL = 1,
+	DB_PRIORITY_LOW = 2,
+	N_DB_PRIORITIES = 3
+};
 
 
 namespace XPDataBus
 {
+	/*
+		Name-based requests are given a handle when they are queued, so requests
+		don't carry a copy of the name. dref is only set if the handle table is full.
+	*/
+
 	struct get_req
 	{
 		std::string dref;
+		dr_handle handle; // Used instead of dref if valid
 		std::promise<generic_val>* prom;
 		int offset;
+		std::chrono::steady_clock::time_point t_enq;
+	};
+
+	struct batch_entry
+	{
+		std::string dref;
+		dr_handle handle; // Used instead of dref if valid
+		int offset;
+	};
+
+	struct async_get_req
+	{
+		std::vector<batch_entry> entries;
+		std::shared_ptr<std::promise<std::vector<generic_val>>> prom;
+		std::function<void(std::vector<generic_val>*)> callback; // Used instead of prom if set
+		std::chrono::steady_clock::time_point t_enq;
 	};
 
 	struct set_req
 	{
 		std::string dref;
+		dr_handle handle; // Used instead of dref if valid
 		generic_val val;
+		int priority;
+	};
+
+	struct range_req
+	{
+		std::string dref;
+		dr_handle handle; // Used instead of dref if valid
+		int val_type; // xplmType_IntArray, xplmType_FloatArray, DR_TYPE_DOUBLE_ARRAY or xplmType_Data
+		int offset;
+		int n_max;
+		void* out; // Get requests only: caller's buffer
+		std::promise<int>* prom; // Get requests only: number of items written to out
+		std::vector<char> in; // Set requests only: copy of caller's data
+		std::chrono::steady_clock::time_point t_enq;
+	};
+
+	struct set_key
+	{
+		std::string dref;
+		int handle;
+		int offset;
+
+		bool operator==(const set_key& other) const
+		{
+			return handle == other.handle && offset == other.offset && dref == other.dref;
+		}
+	};
+
+	struct set_key_hash
+	{
+		size_t operator()(const set_key& key) const
+		{
+			size_t h = std::hash<std::string>()(key.dref);
+			h ^= std::hash<int>()(key.handle) + 0x9e3779b9 + (h << 6) + (h >> 2);
+			h ^= std::hash<int>()(key.offset) + 0x9e3779b9 + (h << 6) + (h >> 2);
+			return h;
+		}
+	};
+
+	struct pending_set_idx
+	{
+		int priority;
+		size_t seq; // Position in the pending list of the priority since the first frame
 	};
 
 	struct data_ref_entry
@@ -47,13 +135,32 @@ namespace XPDataBus
 		generic_ptr val;
 	};
 
+	struct dr_watch
+	{
+		generic_ptr custom_ref;
+		std::function<void(generic_val*)> callback;
+		std::vector<char> last_val; // Value that was last passed to callback
+		bool is_changed;
+	};
+
+	struct dr_handle_entry
+	{
+		std::string name;
+		std::atomic<int> priority{ DB_PRIORITY_NORMAL }; // Priority of set requests made with the handle
+		bool is_implicit = false; // Created for name-based requests. Guarded by handle_mutex.
+		bool is_resolved = false; // Accessed by main thread only
+		bool is_custom = false;
+		data_ref_entry ref;
+		generic_ptr custom_ref;
+	};
+
 	class DataBus
 	{
 	public:
-		std::queue<get_req> get_queue;
-		std::mutex get_queue_mutex;
-		std::queue<set_req> set_queue;
-		std::mutex set_queue_mutex;
+		MPSCQueue<get_req> get_queue;
+		MPSCQueue<set_req> set_queue;
+		MPSCQueue<range_req> range_queue; // Not ordered with set_queue. See set_data_vi
+		MPSCQueue<async_get_req> async_queue;
 		uint64_t max_queue_refresh;
 
 		int xplane_version;
@@ -69,43 +176,230 @@ namespace XPDataBus
 
 		//Ran from any thread:
 
-		generic_val get_data(std::string dr_name, int offset=0);
+		// If the same name is registered twice, the priority from the first call is kept.
+		// Name-based requests don't count as a registration.
+		dr_handle register_data_ref(const std::string& dr_name, int priority=DB_PRIORITY_NORMAL);
+
+		generic_val get_data(const std::string& dr_name, int offset=0);
+
+		int get_datai(const std::string& dr_name, int offset=0);
+
+		float get_dataf(const std::string& dr_name, int offset=0);
+
+		double get_datad(const std::string& dr_name, int offset=0);
+
+		std::string get_data_s(const std::string& dr_name, int offset=0);
+
+		// Non-blocking reads. Every read issued before a flight loop is resolved during that flight loop.
+		// Values that couldn't be read have their offset set to -1.
+
+		std::future<std::vector<generic_val>> get_data_async(std::vector<batch_entry> drs);
+
+		void get_data_async(std::vector<batch_entry> drs, std::function<void(std::vector<generic_val>*)> callback);
+
+		// The functions below transfer a slice of an array/byte dataref with a single request.
+		// get_ functions return number of items written to out.
+
+		int get_data_vi(const std::string& dr_name, int* out, int offset, int n_max);
+
+		int get_data_vf(const std::string& dr_name, float* out, int offset, int n_max);
+
+		int get_data_vd(const std::string& dr_name, double* out, int offset, int n_max);
+
+		int get_data_b(const std::string& dr_name, char* out, int offset, int n_max);
+
+		int get_data_vi(dr_handle handle, int* out, int offset, int n_max);
+
+		int get_data_vf(dr_handle handle, float* out, int offset, int n_max);
+
+		int get_data_vd(dr_handle handle, double* out, int offset, int n_max);
+
+		int get_data_b(dr_handle handle, char* out, int offset, int n_max);
+
+		// Range sets have their own queue. Every flight loop applies them in the order
+		// they were made, after the user and normal priority scalar sets and before the
+		// low priority ones. They are never coalesced. So a scalar set and a range set
+		// to the same items may be applied in a different order than they were made in.
+		// Use one kind of set per dataref.
+		void set_data_vi(const std::string& dr_name, int* in, int offset, int n);
+
+		void set_data_vf(const std::string& dr_name, float* in, int offset, int n);
+
+		void set_data_vd(const std::string& dr_name, double* in, int offset, int n);
+
+		void set_data_b(const std::string& dr_name, char* in, int offset, int n);
+
+		void set_data_vi(dr_handle handle, int* in, int offset, int n);
+
+		void set_data_vf(dr_handle handle, float* in, int offset, int n);
+
+		void set_data_vd(dr_handle handle, double* in, int offset, int n);
+
+		void set_data_b(dr_handle handle, char* in, int offset, int n);
 
-		int get_datai(std::string dr_name, int offset=0);
+		DataRefSnapshot* subscribe(std::vector<snapshot_entry>* drs);
 
-		float get_dataf(std::string dr_name, int offset=0);
+		// Calls callback from the main thread during the first flight loop after
+		// the value of a custom dataref has changed. The first call delivers the
+		// initial value. Returns 0 if dr_name isn't a custom dataref.
+		int watch_data_ref(std::string dr_name, std::function<void(generic_val*)> callback);
 
-		double get_datad(std::string dr_name, int offset=0);
+		// Ran from main thread only. Publishes custom datarefs from dr_names to the
+		// shared memory segment shm_name at the end of every flight loop.
+		// Returns number of datarefs exported.
+		int export_data_refs(std::string shm_name, std::vector<std::string>* dr_names);
 
-		std::string get_data_s(std::string dr_name, int offset=0);
+		// When enabled, only the latest value of each (dataref, offset) pair
+		// is written during a flight loop. Note that a dataref set by name
+		// and by handle is treated as two different datarefs. Range sets
+		// aren't coalesced.
+		void set_coalescing(bool enable);
 
-		void set_data(std::string dr_name, generic_val value);
+		// Limits the time spent by each flight loop to budget_us microseconds.
+		// 0 means no limit. Requests that don't fit are processed during the next frame.
+		// Every queue and set priority still gets at least one request served per frame,
+		// so they keep moving even if the budget is used up before they are reached.
+		void set_time_budget(uint64_t budget_us);
 
-		void set_datai(std::string dr_name, int value, int offset=0);
+		databus_stats get_stats();
 
-		void set_dataf(std::string dr_name, float value, int offset=0);
+		DataBusMetrics* get_metrics();
 
-		void set_datad(std::string dr_name, double value);
+		void set_data(const std::string& dr_name, generic_val value, int priority=DB_PRIORITY_NORMAL);
 
-		void set_data_s(std::string dr_name, std::string in, int offset=0);
+		void set_datai(const std::string& dr_name, int value, int offset=0, int priority=DB_PRIORITY_NORMAL);
+
+		void set_dataf(const std::string& dr_name, float value, int offset=0, int priority=DB_PRIORITY_NORMAL);
+
+		void set_datad(const std::string& dr_name, double value, int priority=DB_PRIORITY_NORMAL);
+
+		void set_data_s(const std::string& dr_name, std::string in, int offset=0, int priority=DB_PRIORITY_NORMAL);
+
+		// Same as above but without looking up the dataref by name:
+
+		generic_val get_data(dr_handle handle, int offset=0);
+
+		int get_datai(dr_handle handle, int offset=0);
+
+		float get_dataf(dr_handle handle, int offset=0);
+
+		double get_datad(dr_handle handle, int offset=0);
+
+		std::string get_data_s(dr_handle handle, int offset=0);
+
+		void set_data(dr_handle handle, generic_val value);
+
+		void set_datai(dr_handle handle, int value, int offset=0);
+
+		void set_dataf(dr_handle handle, float value, int offset=0);
+
+		void set_datad(dr_handle handle, double value);
+
+		void set_data_s(dr_handle handle, std::string in, int offset=0);
 
 		//Ran from main thread only:
 
+		void on_flight_loop();
+
 		void get_data_refs();
+
+		void process_async_reqs();
+
+		void drain_set_queue();
 		
-		void set_data_refs();
+		void set_data_refs(int priority);
+
+		void process_range_reqs();
+
+		void publish_snapshots();
+
+		void dispatch_watches();
+
+		// XPLM may only be called from the main thread, so register_data_ref leaves this to the flight loop.
+		void log_failed_handles();
+
+		// Fails the requests in the get, async and range queues.
+		void drain_stopped_queues();
+
+		// Called by producers right after a successful push. A push that lands after cleanup
+		// has drained the queues would never be served, so the producer drains them itself.
+		void check_stopped_after_push();
+
+		// Write accessors of custom datarefs call this with the dataref's storage.
+		// ref has to point to the data bus.
+		static void on_custom_data_ref_write(void* val_ptr, void* ref);
 
 		XPLMFlightLoopID reg_flt_loop();
 
+		// Requests are only timestamped and get latencies collected once metrics
+		// or recording have been enabled.
+		void enable_metrics(std::string dr_prefix, double log_interval_sec);
+
+		// Writes every request served from now on to a binary log at path.
+		// See databus_recorder.h for the format. Returns 1 on success.
+		int start_recording(std::string path);
+
+		void stop_recording();
+
+		// Fails every queued request and all requests made after it. Called from the main thread.
 		void cleanup();
 
 		~DataBus();
 		
 	private:
 		XPLMFlightLoopID flt_loop_id;
+		std::atomic<bool> is_stopped{false};
+		// Once the data bus is stopped, the flight loop no longer pops the queues. cleanup and
+		// producers that pushed after it both drain them, so the single consumer is whoever holds this.
+		std::mutex drain_mutex;
+		std::atomic<bool> coalesce_sets{false};
+		std::atomic<uint64_t> time_budget_us{0};
+
+		DataBusMetrics metrics;
+		bool is_metrics_enabled = false; // Accessed by main thread only
+		// Requests are only timestamped while metrics or recording are enabled.
+		std::atomic<bool> is_timing_reqs{false};
+		std::chrono::steady_clock::duration metrics_log_interval{0};
+		std::chrono::steady_clock::time_point metrics_last_log;
+
+		// Accessed by main thread only
+		std::deque<set_req> pending_sets[N_DB_PRIORITIES];
+		size_t pending_base[N_DB_PRIORITIES] = { 0 };
+		size_t n_pending_sets = 0;
+		std::unordered_map<set_key, pending_set_idx, set_key_hash> coalesced_idx;
+		std::vector<float> range_tmp;
+		uint64_t frame_counter = 0;
+		uint64_t frame_budget_us = 0;
+		uint64_t frame_n_sets = 0;
+		uint64_t frame_n_served = 0;
+		std::chrono::steady_clock::time_point frame_deadline;
+
+		std::mutex snapshot_mutex;
+		std::atomic<bool> snapshots_added{false};
+		std::vector<std::unique_ptr<DataRefSnapshot>> snapshots_pending;
+		std::vector<std::unique_ptr<DataRefSnapshot>> snapshots;
+		std::mutex watch_mutex;
+		std::atomic<bool> watches_added{false};
+		std::vector<dr_watch> watches_pending;
+		std::vector<dr_watch> watches; // Accessed by main thread only
+		bool watches_dirty = false;
+
+		std::unique_ptr<ShmExport> shm_export;
+		std::unique_ptr<DataBusRecorder> recorder;
+
 		std::unordered_map<std::string, data_ref_entry> data_refs; //Datarefs not owned by this plugin
 		std::unordered_map<std::string, generic_ptr> custom_data_refs; //Datarefs owned by this plugin
 
+		// Handles are never removed, so the main thread can index handles
+		// without locking. handle_ids is used by register_data_ref only.
+		std::vector<dr_handle_entry> handles;
+		std::atomic<int> n_handles{0};
+		std::unordered_map<std::string, dr_handle> handle_ids;
+		std::mutex handle_mutex;
+		// Names that didn't fit into the handle table. They're logged by the main thread.
+		std::vector<std::string> failed_handles;
+		std::atomic<bool> has_failed_handles{false};
+
 		std::string get_xplane_path();
 
 		std::string get_prefs_path();
@@ -114,26 +408,96 @@ namespace XPDataBus
 
 		std::string get_default_data_path();
 
-		void add_to_get_queue(std::string dr_name, std::promise<generic_val>* prom, int offset);
+		static generic_val make_val_i(int value, int offset);
+
+		static generic_val make_val_f(float value, int offset);
 
-		XPLMDataRef add_data_ref_entry(std::string* dr_name);
+		static generic_val make_val_d(double value);
+
+		static generic_val make_val_s(std::string in, int offset);
+
+		// Returns the handle of dr_name, creating it if it doesn't exist yet.
+		// Returns an invalid handle if the handle table is full.
+		dr_handle get_name_handle(const std::string& dr_name);
+
+		// Ran with handle_mutex held.
+		dr_handle add_handle(const std::string& dr_name, int priority, bool is_implicit);
+
+		bool add_to_get_queue(const std::string& dr_name, dr_handle handle, std::promise<generic_val>* prom, int offset);
+
+		void add_to_set_queue(set_req req);
+
+		void add_to_async_queue(async_get_req req);
+
+		static void complete_async_req(async_get_req* req, std::vector<generic_val>* vals);
+
+		static size_t get_range_item_size(int val_type);
+
+		static size_t get_custom_data_ref_size(generic_ptr* custom_ref);
+
+		void mark_written(void* val_ptr);
+
+		int get_data_range(const std::string& dr_name, dr_handle handle, int val_type, void* out, int offset, int n_max);
+
+		void set_data_range(const std::string& dr_name, dr_handle handle, int val_type, void* in, int offset, int n);
+
+		data_ref_entry* add_data_ref_entry(std::string* dr_name);
+
+		data_ref_entry* find_data_ref(std::string* dr_name);
+
+		generic_ptr* find_custom_data_ref(std::string* dr_name);
+
+		dr_handle_entry* resolve_handle(dr_handle handle);
 
 		//The get_ functions below return number of data items returned
 
-		int get_data_ref_value(std::string* dr_name, generic_val* out);
+		int get_data_ref_value(data_ref_entry* ref, generic_val* out);
 
-		int get_custom_data_ref_value(std::string* dr_name, generic_val* out);
+		int get_custom_data_ref_value(generic_ptr* custom_ref, generic_val* out);
 
 		int get_data_ref(std::string* dr_name, generic_val* out);
 
 		int get_custom_data_ref(std::string* dr_name, generic_val* out);
 
-		void set_data_ref_value(std::string* dr_name, generic_val* in);
+		int get_data_ref(dr_handle handle, generic_val* out);
+
+		int read_data_ref(std::string* dr_name, dr_handle handle, generic_val* out);
 
-		void set_custom_data_ref_value(std::string* dr_name, generic_val* in);
+		void set_data_ref_value(data_ref_entry* ref, generic_val* in);
+
+		void set_custom_data_ref_value(generic_ptr* custom_ref, generic_val* in);
 
 		int set_data_ref(std::string* dr_name, generic_val* in);
 
 		int set_custom_data_ref(std::string* dr_name, generic_val* in);
+
+		int set_data_ref(dr_handle handle, generic_val* in);
+
+		int apply_set_req(set_req* req);
+
+		//The range functions below return number of items transferred
+
+		int get_data_ref_range(data_ref_entry* ref, range_req* req);
+
+		int get_custom_data_ref_range(generic_ptr* custom_ref, range_req* req);
+
+		int set_data_ref_range(data_ref_entry* ref, range_req* req);
+
+		int set_custom_data_ref_range(generic_ptr* custom_ref, range_req* req);
+
+		int apply_range_req(range_req* req);
+
+		// n_served is the number of requests already served from the current queue
+		// this frame. The first one is always allowed.
+		bool is_over_budget(uint64_t n_served);
+
+		// Returns latency in microseconds
+		// Returns the time to put into a new request. Zero while requests aren't timed.
+		std::chrono::steady_clock::time_point get_enq_time();
+
+		// Returns 0 for requests that weren't timed.
+		uint32_t add_get_latency(std::chrono::steady_clock::time_point t_enq);
+
+		uint32_t get_rec_name_id(std::string* dr_name, dr_handle handle);
 	};
 }
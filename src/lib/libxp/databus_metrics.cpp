@@ -0,0 +1,201 @@
+/*
+	This source file contains definitions of all methods found in databus_metrics.h
+*/
+
+#include "databus_metrics.h"
+
+namespace XPDataBus
+{
+	DataBusMetrics::DataBusMetrics()
+	{
+		for (int i = 0; i < N_LATENCY_BUCKETS; i++)
+		{
+			latency_hist[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	databus_stats DataBusMetrics::get_stats()
+	{
+		databus_stats out;
+		out.n_frames = n_frames.load(std::memory_order_relaxed);
+		out.n_frames_over_budget = n_frames_over_budget.load(std::memory_order_relaxed);
+		out.n_deferred = n_deferred.load(std::memory_order_relaxed);
+		out.n_deferred_last = n_deferred_last.load(std::memory_order_relaxed);
+		return out;
+	}
+
+	double DataBusMetrics::get_latency_percentile_us(double pct)
+	{
+		/*
+		* Returns the upper bound of the histogram bucket that contains the percentile.
+		*/
+		uint64_t counts[N_LATENCY_BUCKETS];
+		uint64_t n_total = 0;
+		for (int i = 0; i < N_LATENCY_BUCKETS; i++)
+		{
+			counts[i] = latency_hist[i].load(std::memory_order_relaxed);
+			n_total += counts[i];
+		}
+		if (n_total == 0)
+		{
+			return 0;
+		}
+		double tgt = double(n_total) * pct / 100.0;
+		uint64_t n_curr = 0;
+		for (int i = 0; i < N_LATENCY_BUCKETS; i++)
+		{
+			n_curr += counts[i];
+			if (double(n_curr) >= tgt)
+			{
+				return double(uint64_t(1) << i);
+			}
+		}
+		return double(uint64_t(1) << (N_LATENCY_BUCKETS - 1));
+	}
+
+	std::string DataBusMetrics::get_summary()
+	{
+		uint64_t frames = n_frames.load(std::memory_order_relaxed);
+		uint64_t frames_div = frames;
+		if (frames_div == 0)
+		{
+			frames_div = 1;
+		}
+		std::string out = "DataBus: frames=" + std::to_string(frames);
+		out.append(" served/frame=" + std::to_string(n_served_total.load(std::memory_order_relaxed) / frames_div));
+		out.append(" cb_avg_us=" + std::to_string(cb_time_total_us.load(std::memory_order_relaxed) / frames_div));
+		out.append(" cb_max_us=" + std::to_string(cb_time_max_us.load(std::memory_order_relaxed)));
+		out.append(" get_p50_us=" + std::to_string(uint64_t(get_latency_percentile_us(50))));
+		out.append(" get_p99_us=" + std::to_string(uint64_t(get_latency_percentile_us(99))));
+		out.append(" over_budget=" + std::to_string(n_frames_over_budget.load(std::memory_order_relaxed)));
+		out.append(" deferred=" + std::to_string(n_deferred.load(std::memory_order_relaxed)));
+		out.append("\n");
+		return out;
+	}
+
+	void DataBusMetrics::add_get_latency(uint64_t latency_us)
+	{
+		int bucket = 0;
+		while (latency_us && bucket < N_LATENCY_BUCKETS - 1)
+		{
+			latency_us >>= 1;
+			bucket++;
+		}
+		latency_hist[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void DataBusMetrics::add_frame(databus_frame_info* info)
+	{
+		n_frames.fetch_add(1, std::memory_order_relaxed);
+		if (info->is_over_budget)
+		{
+			n_frames_over_budget.fetch_add(1, std::memory_order_relaxed);
+		}
+		n_deferred.fetch_add(info->n_deferred, std::memory_order_relaxed);
+		n_deferred_last.store(info->n_deferred, std::memory_order_relaxed);
+		get_queue_depth.store(info->get_queue_depth, std::memory_order_relaxed);
+		set_queue_depth.store(info->set_queue_depth, std::memory_order_relaxed);
+		n_served_last.store(info->n_served, std::memory_order_relaxed);
+		n_served_total.fetch_add(info->n_served, std::memory_order_relaxed);
+		cb_time_last_us.store(info->callback_time_us, std::memory_order_relaxed);
+		cb_time_total_us.fetch_add(info->callback_time_us, std::memory_order_relaxed);
+		if (info->callback_time_us > cb_time_max_us.load(std::memory_order_relaxed))
+		{
+			cb_time_max_us.store(info->callback_time_us, std::memory_order_relaxed);
+		}
+	}
+
+	void DataBusMetrics::register_counter(std::string name, std::atomic<uint64_t>* counter)
+	{
+		XPLMDataRef dr = XPLMRegisterDataAccessor(name.c_str(), xplmType_Int, 0,
+			[](void* ref) -> int {
+				std::atomic<uint64_t>* ptr = reinterpret_cast<std::atomic<uint64_t>*>(ref);
+				return int(ptr->load(std::memory_order_relaxed));
+			},
+			nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			counter, nullptr);
+		data_refs.push_back(dr);
+	}
+
+	void DataBusMetrics::register_data_refs(std::string prefix)
+	{
+		/*
+		* Registers read-only datarefs. Their values are computed
+		* only when somebody reads them.
+		*/
+		register_counter(prefix + "frames", &n_frames);
+		register_counter(prefix + "frames_over_budget", &n_frames_over_budget);
+		register_counter(prefix + "deferred_last", &n_deferred_last);
+		register_counter(prefix + "get_queue_depth", &get_queue_depth);
+		register_counter(prefix + "set_queue_depth", &set_queue_depth);
+		register_counter(prefix + "served_last", &n_served_last);
+		register_counter(prefix + "callback_time_us", &cb_time_last_us);
+		register_counter(prefix + "callback_time_max_us", &cb_time_max_us);
+
+		std::string pct_names[2] = { prefix + "get_latency_p50_us", prefix + "get_latency_p99_us" };
+		XPLMGetDataf_f pct_getters[2] = {
+			[](void* ref) -> float {
+				return float(reinterpret_cast<DataBusMetrics*>(ref)->get_latency_percentile_us(50));
+			},
+			[](void* ref) -> float {
+				return float(reinterpret_cast<DataBusMetrics*>(ref)->get_latency_percentile_us(99));
+			}
+		};
+		for (int i = 0; i < 2; i++)
+		{
+			XPLMDataRef dr = XPLMRegisterDataAccessor(pct_names[i].c_str(), xplmType_Float, 0,
+				nullptr, nullptr,
+				pct_getters[i], nullptr,
+				nullptr, nullptr,
+				nullptr, nullptr,
+				nullptr, nullptr,
+				nullptr, nullptr,
+				this, nullptr);
+			data_refs.push_back(dr);
+		}
+
+		XPLMDataRef hist_dr = XPLMRegisterDataAccessor((prefix + "get_latency_hist").c_str(), xplmType_IntArray, 0,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			[](void* ref, int* out_values, int in_offset, int in_max) -> int {
+				DataBusMetrics* ptr = reinterpret_cast<DataBusMetrics*>(ref);
+				if (out_values == nullptr || in_offset >= N_LATENCY_BUCKETS)
+				{
+					return N_LATENCY_BUCKETS;
+				}
+				int r = N_LATENCY_BUCKETS - in_offset;
+				if (r > in_max)
+				{
+					r = in_max;
+				}
+				for (int i = 0; i < r; i++)
+				{
+					out_values[i] = int(ptr->latency_hist[i + in_offset].load(std::memory_order_relaxed));
+				}
+				return r;
+			},
+			nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			this, nullptr);
+		data_refs.push_back(hist_dr);
+	}
+
+	void DataBusMetrics::unregister_data_refs()
+	{
+		for (size_t i = 0; i < data_refs.size(); i++)
+		{
+			if (data_refs[i] != nullptr)
+			{
+				XPLMUnregisterDataAccessor(data_refs[i]);
+			}
+		}
+		data_refs.clear();
+	}
+}
@@ -0,0 +1,81 @@
+/*
+	This header file contains the declaration of DataBusMetrics.
+	It keeps lock-free counters of what the data bus costs the sim.
+	The counters can be read through plugin datarefs and are summarized
+	in Log.txt periodically. Nothing is computed unless somebody reads them.
+*/
+
+#pragma once
+
+#include "XPLMDataAccess.h"
+#include "XPLMUtilities.h"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+namespace XPDataBus
+{
+	// Bucket 0 holds latencies below 1 us. Bucket i holds latencies in [2^(i-1), 2^i) us.
+	// The last bucket holds everything above.
+	constexpr int N_LATENCY_BUCKETS = 24;
+
+	struct databus_stats
+	{
+		uint64_t n_frames;
+		uint64_t n_frames_over_budget;
+		uint64_t n_deferred; // Requests left for the next frame, summed over all frames
+		uint64_t n_deferred_last; // Requests left for the next frame by the last frame
+	};
+
+	struct databus_frame_info
+	{
+		uint64_t get_queue_depth; // Get requests(including async and range) waiting at the start of the frame
+		uint64_t set_queue_depth; // Set requests waiting at the start of the frame
+		uint64_t n_served;
+		uint64_t n_deferred;
+		uint64_t callback_time_us;
+		bool is_over_budget;
+	};
+
+	class DataBusMetrics
+	{
+	public:
+		DataBusMetrics();
+
+		databus_stats get_stats();
+
+		double get_latency_percentile_us(double pct);
+
+		std::string get_summary();
+
+		//Ran from main thread only:
+
+		void add_get_latency(uint64_t latency_us);
+
+		void add_frame(databus_frame_info* info);
+
+		void register_data_refs(std::string prefix);
+
+		void unregister_data_refs();
+
+	private:
+		std::atomic<uint64_t> n_frames{0};
+		std::atomic<uint64_t> n_frames_over_budget{0};
+		std::atomic<uint64_t> n_deferred{0};
+		std::atomic<uint64_t> n_deferred_last{0};
+		std::atomic<uint64_t> get_queue_depth{0};
+		std::atomic<uint64_t> set_queue_depth{0};
+		std::atomic<uint64_t> n_served_last{0};
+		std::atomic<uint64_t> n_served_total{0};
+		std::atomic<uint64_t> cb_time_last_us{0};
+		std::atomic<uint64_t> cb_time_max_us{0};
+		std::atomic<uint64_t> cb_time_total_us{0};
+		std::atomic<uint64_t> latency_hist[N_LATENCY_BUCKETS];
+
+		std::vector<XPLMDataRef> data_refs;
+
+		void register_counter(std::string name, std::atomic<uint64_t>* counter);
+	};
+}
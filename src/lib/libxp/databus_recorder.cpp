@@ -0,0 +1,345 @@
+/*
+	This source file contains definitions of member functions of
+	DataBusRecorder and DataBusLogReader.
+*/
+
+#include "databus_recorder.h"
+
+
+namespace XPDataBus
+{
+	// DataBusRecorder definitions:
+
+	DataBusRecorder::DataBusRecorder()
+	{
+		file = nullptr;
+		is_closing = false;
+	}
+
+	int DataBusRecorder::open(std::string path, rec_file_header* hdr)
+	{
+		close();
+		file = fopen(path.c_str(), "wb");
+		if (file == nullptr)
+		{
+			return 0;
+		}
+		memcpy(hdr->magic, REC_MAGIC, sizeof(hdr->magic));
+		hdr->version = REC_VERSION;
+		fwrite(hdr, sizeof(rec_file_header), 1, file);
+
+		t_start = std::chrono::steady_clock::now();
+		name_ids.clear();
+		buf.clear();
+		write_buf.clear();
+		is_closing = false;
+		writer = std::thread([this]() { writer_main(); });
+		return 1;
+	}
+
+	uint32_t DataBusRecorder::find_name(std::string* name)
+	{
+		auto it = name_ids.find(*name);
+		if (it != name_ids.end())
+		{
+			return it->second;
+		}
+		return UINT32_MAX;
+	}
+
+	uint32_t DataBusRecorder::add_name(std::string* name, int type, uint32_t n_length, bool is_custom)
+	{
+		uint32_t id = uint32_t(name_ids.size());
+		name_ids[*name] = id;
+		put<uint8_t>(REC_NAME);
+		put<uint32_t>(id);
+		put<int32_t>(type);
+		put<uint32_t>(n_length);
+		put<uint8_t>(is_custom);
+		put<uint16_t>(uint16_t(name->length()));
+		buf.insert(buf.end(), name->begin(), name->end());
+		return id;
+	}
+
+	void DataBusRecorder::add_get(uint32_t name_id, generic_val* val, uint32_t latency_us)
+	{
+		put<uint8_t>(REC_GET);
+		put<uint32_t>(name_id);
+		put<int32_t>(val->val_type);
+		put<int32_t>(val->offset);
+		put<uint32_t>(latency_us);
+	}
+
+	void DataBusRecorder::add_set(uint32_t name_id, int priority, generic_val* val)
+	{
+		put<uint8_t>(REC_SET);
+		put<uint32_t>(name_id);
+		put<uint8_t>(uint8_t(priority));
+		put<int32_t>(val->offset);
+		put_val(val);
+	}
+
+	void DataBusRecorder::add_range(uint32_t name_id, bool is_set, int val_type, int offset, int n_max,
+		std::vector<char>* in, uint32_t latency_us)
+	{
+		put<uint8_t>(is_set ? REC_RANGE_SET : REC_RANGE_GET);
+		put<uint32_t>(name_id);
+		put<int32_t>(val_type);
+		put<int32_t>(offset);
+		put<int32_t>(n_max);
+		if (is_set)
+		{
+			put<uint32_t>(uint32_t(in->size()));
+			buf.insert(buf.end(), in->begin(), in->end());
+		}
+		else
+		{
+			put<uint32_t>(latency_us);
+		}
+	}
+
+	void DataBusRecorder::add_frame(uint64_t frame, uint32_t callback_time_us)
+	{
+		std::chrono::steady_clock::duration t = std::chrono::steady_clock::now() - t_start;
+		put<uint8_t>(REC_FRAME);
+		put<uint64_t>(frame);
+		put<uint64_t>(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(t).count()));
+		put<uint32_t>(callback_time_us);
+
+		if (buf.size() >= N_REC_FLUSH_BYTES)
+		{
+			// Don't stall the sim if the writer thread is busy. The buffer
+			// is handed over during one of the next frames.
+			std::unique_lock<std::mutex> lock(write_mutex, std::try_to_lock);
+			if (lock.owns_lock() && write_buf.empty())
+			{
+				buf.swap(write_buf);
+				write_cv.notify_one();
+			}
+		}
+	}
+
+	void DataBusRecorder::put_val(generic_val* val)
+	{
+		put<int32_t>(val->val_type);
+		if (val->val_type & xplmType_Data)
+		{
+			put<uint32_t>(uint32_t(val->str.length()));
+			buf.insert(buf.end(), val->str.data(), val->str.data() + val->str.length());
+		}
+		else
+		{
+			put<double>(val->double_val);
+		}
+	}
+
+	void DataBusRecorder::writer_main()
+	{
+		std::vector<char> tmp;
+		std::unique_lock<std::mutex> lock(write_mutex);
+		while (true)
+		{
+			write_cv.wait(lock, [this]() { return is_closing || !write_buf.empty(); });
+			tmp.swap(write_buf);
+			bool is_last = is_closing;
+			lock.unlock();
+			if (tmp.size())
+			{
+				fwrite(tmp.data(), 1, tmp.size(), file);
+				tmp.clear();
+			}
+			lock.lock();
+			if (is_last && write_buf.empty())
+			{
+				return;
+			}
+		}
+	}
+
+	void DataBusRecorder::close()
+	{
+		if (file == nullptr)
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(write_mutex);
+			// Anything the writer hasn't picked up yet goes first.
+			write_buf.insert(write_buf.end(), buf.begin(), buf.end());
+			buf.clear();
+			is_closing = true;
+		}
+		write_cv.notify_one();
+		writer.join();
+		fclose(file);
+		file = nullptr;
+	}
+
+	DataBusRecorder::~DataBusRecorder()
+	{
+		close();
+	}
+
+	// DataBusLogReader definitions:
+
+	DataBusLogReader::DataBusLogReader()
+	{
+		file = nullptr;
+		hdr = {};
+	}
+
+	int DataBusLogReader::open(std::string path)
+	{
+		close();
+		names.clear();
+		file = fopen(path.c_str(), "rb");
+		if (file == nullptr)
+		{
+			return 0;
+		}
+		if (!get(&hdr) || memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version != REC_VERSION)
+		{
+			close();
+			return 0;
+		}
+		return 1;
+	}
+
+	int DataBusLogReader::read_frame(rec_frame* out)
+	{
+		/*
+		* A truncated record at the end of the log(e.g. after a crash)
+		* is treated as the end of the log.
+		*/
+		if (file == nullptr)
+		{
+			return 0;
+		}
+		out->reqs.clear();
+		uint8_t kind;
+		while (get(&kind))
+		{
+			if (kind == REC_FRAME)
+			{
+				if (get(&out->frame) && get(&out->t_us) && get(&out->callback_time_us))
+				{
+					return 1;
+				}
+				return 0;
+			}
+			else if (kind == REC_NAME)
+			{
+				uint32_t id;
+				int32_t type;
+				uint32_t n_length;
+				uint8_t is_custom;
+				uint16_t length;
+				if (!(get(&id) && get(&type) && get(&n_length) && get(&is_custom) && get(&length)))
+				{
+					return 0;
+				}
+				std::string name(length, '\0');
+				if (fread(&name[0], 1, length, file) != length || id != names.size())
+				{
+					return 0;
+				}
+				names.push_back({ name, type, n_length, is_custom != 0 });
+				continue;
+			}
+
+			rec_req req = {};
+			req.kind = kind;
+			bool is_ok = get(&req.name_id);
+			if (kind == REC_GET)
+			{
+				int32_t val_type, offset;
+				is_ok = is_ok && get(&val_type) && get(&offset) && get(&req.latency_us);
+				req.val_type = val_type;
+				req.offset = offset;
+			}
+			else if (kind == REC_SET)
+			{
+				uint8_t priority;
+				int32_t offset;
+				is_ok = is_ok && get(&priority) && get(&offset) && get_val(&req.val);
+				req.priority = priority;
+				req.offset = offset;
+				req.val.offset = offset;
+				req.val_type = req.val.val_type;
+			}
+			else if (kind == REC_RANGE_GET || kind == REC_RANGE_SET)
+			{
+				int32_t val_type, offset, n_max;
+				is_ok = is_ok && get(&val_type) && get(&offset) && get(&n_max);
+				req.val_type = val_type;
+				req.offset = offset;
+				req.n_max = n_max;
+				if (is_ok && kind == REC_RANGE_SET)
+				{
+					uint32_t length;
+					is_ok = get(&length);
+					if (is_ok)
+					{
+						req.data.resize(length);
+						is_ok = fread(req.data.data(), 1, length, file) == length;
+					}
+				}
+				else if (is_ok)
+				{
+					is_ok = get(&req.latency_us);
+				}
+			}
+			else
+			{
+				return 0;
+			}
+			if (!is_ok || req.name_id >= names.size())
+			{
+				return 0;
+			}
+			out->reqs.push_back(std::move(req));
+		}
+		return 0;
+	}
+
+	bool DataBusLogReader::get_val(generic_val* out)
+	{
+		int32_t val_type;
+		if (!get(&val_type))
+		{
+			return false;
+		}
+		out->val_type = val_type;
+		if (val_type & xplmType_Data)
+		{
+			uint32_t length;
+			if (!get(&length))
+			{
+				return false;
+			}
+			std::vector<char> tmp(length);
+			if (fread(tmp.data(), 1, length, file) != length)
+			{
+				return false;
+			}
+			out->str.assign(tmp.data(), length);
+			return true;
+		}
+		return get(&out->double_val);
+	}
+
+	void DataBusLogReader::close()
+	{
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+	}
+
+	DataBusLogReader::~DataBusLogReader()
+	{
+		close();
+	}
+}
@@ -0,0 +1,168 @@
+/*
+	This header file contains declarations of DataBusRecorder and DataBusLogReader.
+	The recorder writes every request served by the data bus to a compact
+	binary log, so that the same traffic can be replayed later.
+
+	Log layout: rec_file_header followed by records. Every record starts
+	with a 1 byte kind. Integers are stored in native byte order.
+	REC_NAME:      u32 id, i32 type, u32 n_length, u8 is_custom, u16 length, name
+	REC_FRAME:     u64 frame, u64 t_us, u32 callback_time_us
+	REC_GET:       u32 name id, i32 val_type, i32 offset, u32 latency_us
+	REC_SET:       u32 name id, u8 priority, i32 offset, value
+	REC_RANGE_GET: u32 name id, i32 val_type, i32 offset, i32 n_max, u32 latency_us
+	REC_RANGE_SET: u32 name id, i32 val_type, i32 offset, i32 n_max, u32 length, data
+	Values are stored as i32 val_type followed by 8 bytes for numbers
+	or by u32 length and the string for xplmType_Data.
+	Requests are written when they are served and are followed by the
+	REC_FRAME record of the flight loop that served them.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+
+namespace XPDataBus
+{
+	constexpr char REC_MAGIC[8] = "XPDBREC";
+	constexpr uint32_t REC_VERSION = 1;
+	constexpr size_t N_REC_FLUSH_BYTES = 1 << 16; // Buffered bytes that wake up the writer thread
+
+	enum rec_kinds
+	{
+		REC_NAME = 1,
+		REC_FRAME = 2,
+		REC_GET = 3,
+		REC_SET = 4,
+		REC_RANGE_GET = 5,
+		REC_RANGE_SET = 6
+	};
+
+	struct rec_file_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t coalesce_sets;
+		uint64_t max_queue_refresh;
+		uint64_t time_budget_us;
+	};
+
+	struct rec_name
+	{
+		std::string name;
+		int type; // XPLMDataTypeID of the dataref
+		uint32_t n_length; // Number of items in array datarefs
+		bool is_custom;
+	};
+
+	struct rec_req
+	{
+		int kind;
+		uint32_t name_id;
+		int val_type;
+		int offset;
+		int n_max; // Range requests only
+		int priority; // Set requests only
+		uint32_t latency_us; // Get requests only
+		generic_val val; // Set requests only
+		std::vector<char> data; // Range set requests only
+	};
+
+	struct rec_frame
+	{
+		uint64_t frame;
+		uint64_t t_us; // Time since the start of recording
+		uint32_t callback_time_us;
+		std::vector<rec_req> reqs;
+	};
+
+	class DataBusRecorder
+	{
+	public:
+		DataBusRecorder();
+
+		// Returns 1 on success.
+		int open(std::string path, rec_file_header* hdr);
+
+		//Ran from main thread only:
+
+		// Returns UINT32_MAX if the name hasn't been added yet.
+		uint32_t find_name(std::string* name);
+
+		uint32_t add_name(std::string* name, int type, uint32_t n_length, bool is_custom);
+
+		void add_get(uint32_t name_id, generic_val* val, uint32_t latency_us);
+
+		void add_set(uint32_t name_id, int priority, generic_val* val);
+
+		void add_range(uint32_t name_id, bool is_set, int val_type, int offset, int n_max,
+			std::vector<char>* in, uint32_t latency_us);
+
+		void add_frame(uint64_t frame, uint32_t callback_time_us);
+
+		void close();
+
+		~DataBusRecorder();
+
+	private:
+		FILE* file;
+		std::chrono::steady_clock::time_point t_start;
+		std::unordered_map<std::string, uint32_t> name_ids;
+		std::vector<char> buf; // Filled by the main thread
+
+		std::mutex write_mutex;
+		std::condition_variable write_cv;
+		std::vector<char> write_buf; // Written to file by the writer thread
+		bool is_closing;
+		std::thread writer;
+
+		template <class T>
+		void put(T val)
+		{
+			const char* ptr = reinterpret_cast<const char*>(&val);
+			buf.insert(buf.end(), ptr, ptr + sizeof(T));
+		}
+
+		void put_val(generic_val* val);
+
+		void writer_main();
+	};
+
+	class DataBusLogReader
+	{
+	public:
+		rec_file_header hdr;
+		std::vector<rec_name> names;
+
+		DataBusLogReader();
+
+		// Returns 1 on success.
+		int open(std::string path);
+
+		// Returns 1 if a frame has been read, 0 at the end of the log.
+		// Names defined by the frame are appended to names.
+		int read_frame(rec_frame* out);
+
+		void close();
+
+		~DataBusLogReader();
+
+	private:
+		FILE* file;
+
+		template <class T>
+		bool get(T* out)
+		{
+			return fread(out, sizeof(T), 1, file) == 1;
+		}
+
+		bool get_val(generic_val* out);
+	};
+}
@@ -49,6 +49,9 @@ namespace DRUtil
 		*/
 		dref dr;
 		int* val;
+		// Called by the write accessor with val as the first argument and on_write_ref as the second.
+		void (*on_write)(void* val_ptr, void* ref) = nullptr;
+		void* on_write_ref = nullptr;
 
 		int get()
 		{
@@ -86,6 +89,10 @@ namespace DRUtil
 						[](void* ref, int newVal) {
 							dref_i* ptr = reinterpret_cast<dref_i*>(ref);
 							*(ptr->val) = newVal;
+							if (ptr->on_write != nullptr)
+							{
+								ptr->on_write(ptr->val, ptr->on_write_ref);
+							}
 						},
 						nullptr, nullptr,
 						nullptr, nullptr,
@@ -402,6 +409,9 @@ namespace DRUtil
 		dref dr;
 		char* str;
 		int n_length;
+		// Called by the write accessor with str as the first argument and on_write_ref as the second.
+		void (*on_write)(void* val_ptr, void* ref) = nullptr;
+		void* on_write_ref = nullptr;
 
 		//TODO: add get() and set()
 
@@ -454,6 +464,10 @@ namespace DRUtil
 							{
 								ptr->str[i + in_offset] = in_ptr[i];
 							}
+							if (ptr->on_write != nullptr)
+							{
+								ptr->on_write(ptr->str, ptr->on_write_ref);
+							}
 						}
 					},
 						this, this);
@@ -0,0 +1,69 @@
+/*
+	This source file contains definitions of all methods found in dr_snapshot.h
+*/
+
+#include "dr_snapshot.h"
+
+namespace XPDataBus
+{
+	DataRefSnapshot::DataRefSnapshot(std::vector<snapshot_entry>* drs)
+	{
+		entries = *drs;
+		for (int i = 0; i < 3; i++)
+		{
+			generic_val tmp = { {0}, "", xplmType_Unknown, 0 };
+			bufs[i] = std::vector<generic_val>(entries.size(), tmp);
+			frames[i] = 0;
+		}
+		front = 0;
+		middle.store(1, std::memory_order_relaxed);
+		back = 2;
+	}
+
+	uint64_t DataRefSnapshot::update()
+	{
+		if (middle.load(std::memory_order_relaxed) & SNAPSHOT_BUF_FRESH)
+		{
+			uint8_t prev = middle.exchange(front, std::memory_order_acq_rel);
+			front = prev & SNAPSHOT_BUF_IDX_MASK;
+		}
+		return frames[front];
+	}
+
+	generic_val DataRefSnapshot::get_val(size_t idx)
+	{
+		return bufs[front][idx];
+	}
+
+	int DataRefSnapshot::get_vali(size_t idx)
+	{
+		return generic_val_to_i(&bufs[front][idx]);
+	}
+
+	float DataRefSnapshot::get_valf(size_t idx)
+	{
+		return generic_val_to_f(&bufs[front][idx]);
+	}
+
+	double DataRefSnapshot::get_vald(size_t idx)
+	{
+		return generic_val_to_d(&bufs[front][idx]);
+	}
+
+	std::string DataRefSnapshot::get_val_s(size_t idx)
+	{
+		return bufs[front][idx].str;
+	}
+
+	generic_val* DataRefSnapshot::get_back_buf()
+	{
+		return bufs[back].data();
+	}
+
+	void DataRefSnapshot::publish(uint64_t frame)
+	{
+		frames[back] = frame;
+		uint8_t prev = middle.exchange(back | SNAPSHOT_BUF_FRESH, std::memory_order_acq_rel);
+		back = prev & SNAPSHOT_BUF_IDX_MASK;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+	This header file contains the declaration of DataRefSnapshot.
+	A snapshot is a set of datarefs that a worker thread reads often.
+	The flight loop copies all of them into a triple buffer once per frame,
+	so the reader always gets the latest coherent set of values without
+	locking or waiting for the main thread.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <vector>
+#include <atomic>
+
+
+namespace XPDataBus
+{
+	enum snapshot_buf_flags
+	{
+		SNAPSHOT_BUF_IDX_MASK = 3,
+		SNAPSHOT_BUF_FRESH = 4
+	};
+
+	struct snapshot_entry
+	{
+		std::string dref;
+		int offset;
+		dr_handle handle = { -1 }; // Set by DataBus::subscribe
+	};
+
+	class DataRefSnapshot
+	{
+	public:
+		std::vector<snapshot_entry> entries;
+
+		DataRefSnapshot(std::vector<snapshot_entry>* drs);
+
+		//Ran from the reader thread only. There must be only one reader per snapshot.
+
+		// update grabs the latest snapshot published by the flight loop.
+		// Returns frame number of that snapshot or 0 if nothing has been published yet.
+		uint64_t update();
+
+		generic_val get_val(size_t idx);
+
+		int get_vali(size_t idx);
+
+		float get_valf(size_t idx);
+
+		double get_vald(size_t idx);
+
+		std::string get_val_s(size_t idx);
+
+		//Ran from main thread only:
+
+		generic_val* get_back_buf();
+
+		void publish(uint64_t frame);
+
+	private:
+		std::vector<generic_val> bufs[3];
+		uint64_t frames[3];
+		std::atomic<uint8_t> middle;
+		uint8_t front;
+		uint8_t back;
+	};
+}
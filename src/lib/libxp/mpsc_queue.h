@@ -0,0 +1,105 @@
+/*
+	This header file contains a bounded lock-free queue with multiple
+	producers and a single consumer. It is used by the data bus so that
+	the avionics threads never make X-plane's main thread wait on a mutex.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+
+namespace XPDataBus
+{
+	constexpr size_t CACHE_LINE_SIZE = 64;
+
+	template <class T>
+	class MPSCQueue
+	{
+	public:
+		MPSCQueue(size_t size) // size must be a power of 2
+		{
+			buf = std::unique_ptr<cell[]>(new cell[size]);
+			mask = size - 1;
+			for (size_t i = 0; i < size; i++)
+			{
+				buf[i].seq.store(i, std::memory_order_relaxed);
+			}
+			enqueue_pos.store(0, std::memory_order_relaxed);
+			dequeue_pos = 0;
+		}
+
+		//Ran from any thread:
+
+		bool push(T item) // Returns false if the queue is full
+		{
+			cell* curr;
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while (true)
+			{
+				curr = &buf[pos & mask];
+				size_t seq = curr->seq.load(std::memory_order_acquire);
+				intptr_t diff = intptr_t(seq) - intptr_t(pos);
+				if (diff == 0)
+				{
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					{
+						break;
+					}
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			curr->data = std::move(item);
+			curr->seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		//Ran from consumer thread only:
+
+		bool pop(T* out) // Returns false if the queue is empty
+		{
+			cell* curr = &buf[dequeue_pos & mask];
+			size_t seq = curr->seq.load(std::memory_order_acquire);
+			if (intptr_t(seq) - intptr_t(dequeue_pos + 1) < 0)
+			{
+				return false;
+			}
+			*out = std::move(curr->data);
+			curr->seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+			dequeue_pos++;
+			return true;
+		}
+
+		size_t size() // Approximate when called from a producer thread
+		{
+			size_t enq = enqueue_pos.load(std::memory_order_relaxed);
+			size_t deq = dequeue_pos;
+			if (enq > deq)
+			{
+				return enq - deq;
+			}
+			return 0;
+		}
+
+	private:
+		struct cell
+		{
+			std::atomic<size_t> seq;
+			T data;
+		};
+
+		std::unique_ptr<cell[]> buf;
+		size_t mask;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos;
+		alignas(CACHE_LINE_SIZE) size_t dequeue_pos;
+	};
+}
@@ -0,0 +1,129 @@
+/*
+	This source file contains definitions of member functions of ShmExport.
+*/
+
+#include "shm_export.h"
+#include <new>
+
+#if !IBM
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+
+namespace XPDataBus
+{
+	ShmExport::ShmExport()
+	{
+		hdr = nullptr;
+		segment_size = 0;
+	}
+
+	int ShmExport::open(std::string shm_name, std::vector<shm_export_entry>* drs)
+	{
+		close();
+#if !IBM
+		size_t n_max_bytes = 0;
+		for (size_t i = 0; i < drs->size(); i++)
+		{
+			if (drs->at(i).n_bytes > n_max_bytes)
+			{
+				n_max_bytes = drs->at(i).n_bytes;
+			}
+		}
+		size_t record_stride = XPShm::get_record_stride(n_max_bytes);
+		size_t size = XPShm::get_segment_size(drs->size(), record_stride);
+
+		// Readers that still have the old segment mapped keep their copy.
+		shm_unlink(shm_name.c_str());
+		int fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+		if (fd == -1)
+		{
+			return 0;
+		}
+		if (ftruncate(fd, off_t(size)) == -1)
+		{
+			::close(fd);
+			shm_unlink(shm_name.c_str());
+			return 0;
+		}
+		void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED)
+		{
+			shm_unlink(shm_name.c_str());
+			return 0;
+		}
+
+		name = shm_name;
+		segment_size = size;
+		entries = *drs;
+		hdr = new (addr) XPShm::shm_header();
+		hdr->version = XPShm::SHM_LAYOUT_VERSION;
+		hdr->n_records = uint32_t(entries.size());
+		hdr->record_stride = uint32_t(record_stride);
+		hdr->frame.store(0, std::memory_order_relaxed);
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			XPShm::shm_record* rec = new (XPShm::get_record(hdr, i)) XPShm::shm_record();
+			rec->seq.store(0, std::memory_order_relaxed);
+			rec->val_type = entries[i].ref.ptr_type;
+			rec->n_bytes = uint32_t(entries[i].n_bytes);
+			strcpy_safe(rec->name, XPShm::N_SHM_NAME_LENGTH - 1, entries[i].name.c_str());
+			memcpy(XPShm::get_record_data(rec), entries[i].ref.ptr, entries[i].n_bytes);
+		}
+		// Readers check the magic number, so it is written last.
+		std::atomic_thread_fence(std::memory_order_release);
+		hdr->magic = XPShm::SHM_MAGIC;
+		return 1;
+#else
+		return 0;
+#endif
+	}
+
+	void ShmExport::publish(uint64_t frame)
+	{
+		if (hdr == nullptr)
+		{
+			return;
+		}
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			XPShm::shm_record* rec = XPShm::get_record(hdr, i);
+			char* dst = XPShm::get_record_data(rec);
+			size_t n_bytes = entries[i].n_bytes;
+			// Only the sim writes to the segment, so it can be compared against directly.
+			if (memcmp(dst, entries[i].ref.ptr, n_bytes) == 0)
+			{
+				continue;
+			}
+			uint32_t seq = rec->seq.load(std::memory_order_relaxed);
+			rec->seq.store(seq + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			memcpy(dst, entries[i].ref.ptr, n_bytes);
+			rec->seq.store(seq + 2, std::memory_order_release);
+		}
+		hdr->frame.store(frame, std::memory_order_release);
+	}
+
+	void ShmExport::close()
+	{
+#if !IBM
+		if (hdr != nullptr)
+		{
+			munmap(hdr, segment_size);
+			shm_unlink(name.c_str());
+		}
+#endif
+		hdr = nullptr;
+		segment_size = 0;
+		entries.clear();
+	}
+
+	ShmExport::~ShmExport()
+	{
+		close();
+	}
+}
@@ -0,0 +1,46 @@
+/*
+	This header file contains the declaration of ShmExport. It publishes
+	custom datarefs to a POSIX shared memory segment, so that local external
+	processes can read them without going through the sim.
+	See shm_layout.h for the layout of the segment.
+*/
+
+#pragma once
+
+#include "common.h"
+#include "shm_layout.h"
+#include <vector>
+
+
+namespace XPDataBus
+{
+	struct shm_export_entry
+	{
+		std::string name;
+		generic_ptr ref;
+		size_t n_bytes;
+	};
+
+	class ShmExport
+	{
+	public:
+		ShmExport();
+
+		// Creates the segment. An existing segment with the same name is replaced.
+		// Returns 1 on success.
+		int open(std::string shm_name, std::vector<shm_export_entry>* drs);
+
+		// Ran from main thread only. Copies the datarefs that have changed since the last call.
+		void publish(uint64_t frame);
+
+		void close();
+
+		~ShmExport();
+
+	private:
+		std::string name;
+		XPShm::shm_header* hdr;
+		size_t segment_size;
+		std::vector<shm_export_entry> entries;
+	};
+}
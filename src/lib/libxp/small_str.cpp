@@ -0,0 +1,173 @@
+/*
+	This source file contains definitions of member functions of SmallString.
+*/
+
+#include "small_str.h"
+
+
+namespace XPDataBus
+{
+	SmallString::SmallString()
+	{
+		inline_buf[0] = '\0';
+		heap_buf = nullptr;
+		len = 0;
+		cap = N_SMALL_STR_INLINE - 1;
+	}
+
+	SmallString::SmallString(const char* in): SmallString()
+	{
+		assign(in, strlen(in));
+	}
+
+	SmallString::SmallString(const std::string& in): SmallString()
+	{
+		assign(in.data(), in.length());
+	}
+
+	SmallString::SmallString(const SmallString& other): SmallString()
+	{
+		assign(other.data(), other.len);
+	}
+
+	SmallString::SmallString(SmallString&& other) noexcept: SmallString()
+	{
+		*this = std::move(other);
+	}
+
+	SmallString& SmallString::operator=(const SmallString& other)
+	{
+		if (this != &other)
+		{
+			assign(other.data(), other.len);
+		}
+		return *this;
+	}
+
+	SmallString& SmallString::operator=(SmallString&& other) noexcept
+	{
+		if (this == &other)
+		{
+			return *this;
+		}
+		if (other.heap_buf != nullptr)
+		{
+			// Take over the heap buffer of other.
+			delete[] heap_buf;
+			heap_buf = other.heap_buf;
+			len = other.len;
+			cap = other.cap;
+			other.heap_buf = nullptr;
+			other.cap = N_SMALL_STR_INLINE - 1;
+		}
+		else
+		{
+			assign(other.inline_buf, other.len);
+		}
+		other.len = 0;
+		other.inline_buf[0] = '\0';
+		return *this;
+	}
+
+	void SmallString::assign(const char* in, size_t n)
+	{
+		reserve(n);
+		char* buf = get_buf();
+		memmove(buf, in, n);
+		buf[n] = '\0';
+		len = uint32_t(n);
+	}
+
+	void SmallString::push_back(char c)
+	{
+		reserve(size_t(len) + 1);
+		char* buf = get_buf();
+		buf[len] = c;
+		len++;
+		buf[len] = '\0';
+	}
+
+	void SmallString::clear()
+	{
+		len = 0;
+		get_buf()[0] = '\0';
+	}
+
+	size_t SmallString::length() const
+	{
+		return len;
+	}
+
+	size_t SmallString::size() const
+	{
+		return len;
+	}
+
+	char SmallString::at(size_t idx) const
+	{
+		if (idx >= len)
+		{
+			return '\0';
+		}
+		return data()[idx];
+	}
+
+	const char* SmallString::c_str() const
+	{
+		return data();
+	}
+
+	const char* SmallString::data() const
+	{
+		if (heap_buf != nullptr)
+		{
+			return heap_buf;
+		}
+		return inline_buf;
+	}
+
+	bool SmallString::is_inline() const
+	{
+		return heap_buf == nullptr;
+	}
+
+	SmallString::operator std::string() const
+	{
+		return std::string(data(), len);
+	}
+
+	SmallString::~SmallString()
+	{
+		delete[] heap_buf;
+	}
+
+	char* SmallString::get_buf()
+	{
+		if (heap_buf != nullptr)
+		{
+			return heap_buf;
+		}
+		return inline_buf;
+	}
+
+	void SmallString::reserve(size_t n)
+	{
+		/*
+		* This is the overflow path. Grows the buffer to hold at least n characters.
+		*/
+		if (n <= cap)
+		{
+			return;
+		}
+		size_t new_cap = size_t(cap) * 2;
+		if (new_cap < n)
+		{
+			new_cap = n;
+		}
+		char* buf = new char[new_cap + 1];
+		memcpy(buf, get_buf(), size_t(len) + 1);
+		delete[] heap_buf;
+		heap_buf = buf;
+		cap = uint32_t(new_cap);
+	}
+}
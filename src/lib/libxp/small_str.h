@@ -0,0 +1,70 @@
+/*
+	This header file contains the declaration of SmallString - a string with
+	inline storage. Strings that fit into the inline buffer never touch the heap.
+	Longer strings are moved to a heap buffer.
+*/
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+
+namespace XPDataBus
+{
+	// Inline buffer size in bytes, including the terminating 0.
+	// Big enough for a CDU line (24 bytes) and its padding.
+	constexpr size_t N_SMALL_STR_INLINE = 32;
+
+	class SmallString
+	{
+	public:
+		SmallString();
+
+		SmallString(const char* in);
+
+		SmallString(const std::string& in);
+
+		SmallString(const SmallString& other);
+
+		SmallString(SmallString&& other) noexcept;
+
+		SmallString& operator=(const SmallString& other);
+
+		SmallString& operator=(SmallString&& other) noexcept;
+
+		void assign(const char* in, size_t n);
+
+		void push_back(char c);
+
+		void clear();
+
+		size_t length() const;
+
+		size_t size() const;
+
+		char at(size_t idx) const;
+
+		const char* c_str() const;
+
+		const char* data() const;
+
+		// Returns false if the string has overflown into a heap buffer.
+		bool is_inline() const;
+
+		operator std::string() const;
+
+		~SmallString();
+
+	private:
+		char inline_buf[N_SMALL_STR_INLINE];
+		char* heap_buf;
+		uint32_t len;
+		uint32_t cap; // Doesn't include the terminating 0
+
+		char* get_buf();
+
+		void reserve(size_t n);
+	};
+}
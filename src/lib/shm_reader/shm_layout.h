@@ -0,0 +1,71 @@
+/*
+	This header file contains the layout of the shared memory segment
+	that libxp exports datarefs to. It doesn't depend on the X-plane sdk,
+	so external processes can include it directly.
+
+	The segment starts with shm_header. It is followed by n_records records.
+	Each record starts with shm_record and is followed by n_bytes of data.
+	Records are record_stride bytes apart.
+
+	Every record is protected by its own seqlock: seq is odd while the sim
+	is writing the record. Readers copy the data and retry if seq was odd
+	or has changed during the copy.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace XPShm
+{
+	constexpr uint32_t SHM_MAGIC = 0x58505348; // "XPSH"
+	constexpr uint32_t SHM_LAYOUT_VERSION = 1;
+	constexpr size_t N_SHM_NAME_LENGTH = 128;
+	constexpr size_t SHM_ALIGNMENT = 64;
+
+	struct alignas(SHM_ALIGNMENT) shm_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t n_records;
+		uint32_t record_stride;
+		std::atomic<uint64_t> frame; // Last frame published by the sim
+	};
+
+	struct alignas(SHM_ALIGNMENT) shm_record
+	{
+		std::atomic<uint32_t> seq;
+		int32_t val_type; // XPLMDataTypeID of the dataref
+		uint32_t n_bytes;
+		uint32_t reserved;
+		char name[N_SHM_NAME_LENGTH];
+	};
+
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared memory requires lock-free atomics");
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory requires lock-free atomics");
+
+	inline size_t get_record_stride(size_t n_bytes)
+	{
+		size_t stride = sizeof(shm_record) + n_bytes;
+		return (stride + SHM_ALIGNMENT - 1) / SHM_ALIGNMENT * SHM_ALIGNMENT;
+	}
+
+	inline size_t get_segment_size(size_t n_records, size_t record_stride)
+	{
+		return sizeof(shm_header) + n_records * record_stride;
+	}
+
+	inline shm_record* get_record(shm_header* hdr, size_t idx)
+	{
+		char* base = reinterpret_cast<char*>(hdr) + sizeof(shm_header);
+		return reinterpret_cast<shm_record*>(base + idx * hdr->record_stride);
+	}
+
+	inline char* get_record_data(shm_record* rec)
+	{
+		return reinterpret_cast<char*>(rec) + sizeof(shm_record);
+	}
+}
@@ -0,0 +1,159 @@
+/*
+	This source file contains definitions of member functions of ShmReader.
+*/
+
+#include "shm_reader.h"
+#include <cstring>
+
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+
+namespace XPShm
+{
+	ShmReader::ShmReader()
+	{
+		hdr = nullptr;
+		segment_size = 0;
+	}
+
+	int ShmReader::open(std::string shm_name)
+	{
+		close();
+#ifndef _WIN32
+		int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+		if (fd == -1)
+		{
+			return 0;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(shm_header))
+		{
+			::close(fd);
+			return 0;
+		}
+		void* addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED)
+		{
+			return 0;
+		}
+		hdr = reinterpret_cast<shm_header*>(addr);
+		segment_size = size_t(st.st_size);
+		if (hdr->magic != SHM_MAGIC || hdr->version != SHM_LAYOUT_VERSION ||
+			get_segment_size(hdr->n_records, hdr->record_stride) > segment_size)
+		{
+			close();
+			return 0;
+		}
+		return 1;
+#else
+		return 0;
+#endif
+	}
+
+	int ShmReader::find(std::string dr_name)
+	{
+		if (hdr == nullptr)
+		{
+			return -1;
+		}
+		for (uint32_t i = 0; i < hdr->n_records; i++)
+		{
+			shm_record* rec = get_record(hdr, i);
+			if (strncmp(rec->name, dr_name.c_str(), N_SHM_NAME_LENGTH) == 0)
+			{
+				return int(i);
+			}
+		}
+		return -1;
+	}
+
+	int ShmReader::get_n_records()
+	{
+		if (hdr == nullptr)
+		{
+			return 0;
+		}
+		return int(hdr->n_records);
+	}
+
+	uint64_t ShmReader::get_frame()
+	{
+		if (hdr == nullptr)
+		{
+			return 0;
+		}
+		return hdr->frame.load(std::memory_order_acquire);
+	}
+
+	int ShmReader::read(int idx, void* out, size_t n_max, uint32_t* seq)
+	{
+		if (hdr == nullptr || idx < 0 || uint32_t(idx) >= hdr->n_records)
+		{
+			return -1;
+		}
+		shm_record* rec = get_record(hdr, size_t(idx));
+		size_t n_bytes = rec->n_bytes;
+		if (n_bytes > n_max)
+		{
+			n_bytes = n_max;
+		}
+		for (int i = 0; i < N_SHM_MAX_READ_RETRIES; i++)
+		{
+			uint32_t seq_start = rec->seq.load(std::memory_order_acquire);
+			if (seq_start & 1)
+			{
+				continue;
+			}
+			memcpy(out, get_record_data(rec), n_bytes);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (rec->seq.load(std::memory_order_relaxed) == seq_start)
+			{
+				if (seq != nullptr)
+				{
+					*seq = seq_start;
+				}
+				return int(n_bytes);
+			}
+		}
+		return -1;
+	}
+
+	int ShmReader::read_s(int idx, char* out, size_t n_max)
+	{
+		if (n_max == 0)
+		{
+			return -1;
+		}
+		int n_read = read(idx, out, n_max - 1);
+		if (n_read < 0)
+		{
+			out[0] = '\0';
+			return -1;
+		}
+		out[n_read] = '\0';
+		return int(strlen(out));
+	}
+
+	void ShmReader::close()
+	{
+#ifndef _WIN32
+		if (hdr != nullptr)
+		{
+			munmap(hdr, segment_size);
+		}
+#endif
+		hdr = nullptr;
+		segment_size = 0;
+	}
+
+	ShmReader::~ShmReader()
+	{
+		close();
+	}
+}
@@ -0,0 +1,51 @@
+/*
+	This library reads datarefs exported by libxp into shared memory.
+	It doesn't depend on the X-plane sdk and is meant to be used by
+	external processes, e.g. home cockpit hardware drivers.
+	Reads never block the sim and never allocate.
+*/
+
+#pragma once
+
+#include "shm_layout.h"
+#include <string>
+
+
+namespace XPShm
+{
+	// Number of attempts to get a consistent copy of a record before giving up.
+	constexpr int N_SHM_MAX_READ_RETRIES = 1000;
+
+	class ShmReader
+	{
+	public:
+		ShmReader();
+
+		// Returns 1 on success, 0 if the segment doesn't exist or has a different layout.
+		int open(std::string shm_name);
+
+		// Returns record index of the dataref or -1 if it wasn't exported.
+		int find(std::string dr_name);
+
+		int get_n_records();
+
+		// Returns last frame published by the sim. 0 means nothing has been published yet.
+		uint64_t get_frame();
+
+		// Copies up to n_max bytes of the record to out.
+		// Returns number of bytes copied or -1 if no consistent copy could be made.
+		// If seq isn't nullptr, it is set to the sequence number of the copy.
+		int read(int idx, void* out, size_t n_max, uint32_t* seq=nullptr);
+
+		// Same as above but stops at the first 0.
+		int read_s(int idx, char* out, size_t n_max);
+
+		void close();
+
+		~ShmReader();
+
+	private:
+		shm_header* hdr;
+		size_t segment_size;
+	};
+}
@@ -0,0 +1,707 @@
+/*
+	This source file contains definitions of all functions found in xplm_headless.h
+	as well as the subset of the XPLM api used by the plugin.
+*/
+
+#include "xplm_headless.h"
+#include "XPLMUtilities.h"
+#include "XPLMPlugin.h"
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+
+
+namespace XPHeadless
+{
+	struct dr_record
+	{
+		std::string name;
+		XPLMDataTypeID type;
+		bool is_writable;
+		bool is_good;
+
+		// Accessors of datarefs registered by the plugin.
+
+		bool is_accessor = false;
+		XPLMGetDatai_f read_i = nullptr;
+		XPLMSetDatai_f write_i = nullptr;
+		XPLMGetDataf_f read_f = nullptr;
+		XPLMSetDataf_f write_f = nullptr;
+		XPLMGetDatad_f read_d = nullptr;
+		XPLMSetDatad_f write_d = nullptr;
+		XPLMGetDatavi_f read_vi = nullptr;
+		XPLMSetDatavi_f write_vi = nullptr;
+		XPLMGetDatavf_f read_vf = nullptr;
+		XPLMSetDatavf_f write_vf = nullptr;
+		XPLMGetDatab_f read_b = nullptr;
+		XPLMSetDatab_f write_b = nullptr;
+		void* read_ref = nullptr;
+		void* write_ref = nullptr;
+
+		// Storage of datarefs owned by the sim.
+
+		std::vector<int> ints;
+		std::vector<float> floats;
+		double dbl = 0;
+		std::vector<char> bytes;
+	};
+
+	struct flt_loop
+	{
+		XPLMFlightLoop_f callback;
+		void* refcon;
+		bool is_legacy; // Registered with XPLMRegisterFlightLoopCallback
+		bool is_dead;
+		bool is_scheduled;
+		bool by_frames; // Next call is determined by frame count rather than time
+		double next_time;
+		uint64_t next_frame;
+		double last_call_time;
+		int counter;
+	};
+
+	struct sim_state
+	{
+		sim_config cfg = { "/", "/", 12000, false };
+		double time = 0;
+		uint64_t frame = 0;
+		std::string log;
+
+		std::unordered_map<std::string, std::unique_ptr<dr_record>> data_refs;
+		// Unregistered datarefs stay here so that stale handles don't crash.
+		std::vector<std::unique_ptr<dr_record>> dead_data_refs;
+		std::vector<std::unique_ptr<flt_loop>> flight_loops;
+	};
+
+	static sim_state state;
+
+	static void schedule(flt_loop* loop, float interval, bool relative_to_now)
+	{
+		/*
+		* Positive intervals are in seconds, negative ones are in frames.
+		* 0 stops the flight loop.
+		*/
+		if (interval == 0)
+		{
+			loop->is_scheduled = false;
+			return;
+		}
+		loop->is_scheduled = true;
+		if (interval > 0)
+		{
+			double base = relative_to_now ? state.time : loop->last_call_time;
+			loop->by_frames = false;
+			loop->next_time = base + double(interval);
+		}
+		else
+		{
+			loop->by_frames = true;
+			loop->next_frame = state.frame + uint64_t(-interval);
+		}
+	}
+
+	static flt_loop* find_legacy_loop(XPLMFlightLoop_f callback, void* refcon)
+	{
+		for (size_t i = 0; i < state.flight_loops.size(); i++)
+		{
+			flt_loop* loop = state.flight_loops[i].get();
+			if (!loop->is_dead && loop->is_legacy && loop->callback == callback && loop->refcon == refcon)
+			{
+				return loop;
+			}
+		}
+		return nullptr;
+	}
+
+	static flt_loop* add_flight_loop(XPLMFlightLoop_f callback, void* refcon, bool is_legacy)
+	{
+		std::unique_ptr<flt_loop> loop = std::make_unique<flt_loop>();
+		loop->callback = callback;
+		loop->refcon = refcon;
+		loop->is_legacy = is_legacy;
+		loop->is_dead = false;
+		loop->is_scheduled = false;
+		loop->by_frames = false;
+		loop->next_time = 0;
+		loop->next_frame = 0;
+		loop->last_call_time = state.time;
+		loop->counter = 0;
+		flt_loop* ptr = loop.get();
+		state.flight_loops.push_back(std::move(loop));
+		return ptr;
+	}
+
+	static dr_record* get_record(XPLMDataRef ref)
+	{
+		dr_record* rec = reinterpret_cast<dr_record*>(ref);
+		if (rec == nullptr || !rec->is_good)
+		{
+			return nullptr;
+		}
+		return rec;
+	}
+
+	template <class T>
+	static int get_array(std::vector<T>* src, T* out, int offset, int n_max)
+	{
+		int n_length = int(src->size());
+		if (out == nullptr)
+		{
+			return n_length;
+		}
+		if (offset < 0 || offset >= n_length)
+		{
+			return 0;
+		}
+		int r = n_length - offset;
+		if (r > n_max)
+		{
+			r = n_max;
+		}
+		for (int i = 0; i < r; i++)
+		{
+			out[i] = src->at(i + offset);
+		}
+		return r;
+	}
+
+	template <class T>
+	static void set_array(std::vector<T>* dst, T* in, int offset, int n)
+	{
+		if (in == nullptr || offset < 0)
+		{
+			return;
+		}
+		int n_length = int(dst->size());
+		for (int i = 0; i < n && i + offset < n_length; i++)
+		{
+			dst->at(i + offset) = in[i];
+		}
+	}
+
+	void init(sim_config* cfg)
+	{
+		state.cfg = *cfg;
+		state.time = 0;
+		state.frame = 0;
+		state.log.clear();
+		state.data_refs.clear();
+		state.dead_data_refs.clear();
+		state.flight_loops.clear();
+	}
+
+	XPLMDataRef add_data_ref(std::string name, XPLMDataTypeID type, int n_length, bool is_writable)
+	{
+		if (state.data_refs.find(name) != state.data_refs.end())
+		{
+			return nullptr;
+		}
+		std::unique_ptr<dr_record> rec = std::make_unique<dr_record>();
+		rec->name = name;
+		rec->type = type;
+		rec->is_writable = is_writable;
+		rec->is_good = true;
+		if (type & xplmType_Int)
+		{
+			rec->ints = std::vector<int>(1, 0);
+		}
+		else if (type & xplmType_Float)
+		{
+			rec->floats = std::vector<float>(1, 0);
+		}
+		if (type & xplmType_IntArray)
+		{
+			rec->ints = std::vector<int>(n_length, 0);
+		}
+		else if (type & xplmType_FloatArray)
+		{
+			rec->floats = std::vector<float>(n_length, 0);
+		}
+		else if (type & xplmType_Data)
+		{
+			rec->bytes = std::vector<char>(n_length, 0);
+		}
+		XPLMDataRef out = rec.get();
+		state.data_refs[name] = std::move(rec);
+		return out;
+	}
+
+	int run_frame(float dt_sec)
+	{
+		state.time += double(dt_sec);
+		state.frame++;
+		int n_called = 0;
+		// Flight loops created during this frame are called starting from the next one.
+		size_t n_loops = state.flight_loops.size();
+		for (size_t i = 0; i < n_loops; i++)
+		{
+			flt_loop* loop = state.flight_loops[i].get();
+			if (loop->is_dead || !loop->is_scheduled)
+			{
+				continue;
+			}
+			bool is_due = loop->by_frames ? state.frame >= loop->next_frame : state.time >= loop->next_time;
+			if (is_due)
+			{
+				float elapsed = float(state.time - loop->last_call_time);
+				loop->counter++;
+				float interval = loop->callback(elapsed, elapsed, loop->counter, loop->refcon);
+				loop->last_call_time = state.time;
+				if (!loop->is_dead)
+				{
+					schedule(loop, interval, true);
+				}
+				n_called++;
+			}
+		}
+		size_t j = 0;
+		for (size_t i = 0; i < state.flight_loops.size(); i++)
+		{
+			if (!state.flight_loops[i]->is_dead)
+			{
+				state.flight_loops[j++] = std::move(state.flight_loops[i]);
+			}
+		}
+		state.flight_loops.resize(j);
+		return n_called;
+	}
+
+	void run_frames(uint64_t n_frames, float dt_sec)
+	{
+		for (uint64_t i = 0; i < n_frames; i++)
+		{
+			run_frame(dt_sec);
+		}
+	}
+
+	double get_time()
+	{
+		return state.time;
+	}
+
+	uint64_t get_frame_count()
+	{
+		return state.frame;
+	}
+
+	size_t get_n_flight_loops()
+	{
+		size_t n_loops = 0;
+		for (size_t i = 0; i < state.flight_loops.size(); i++)
+		{
+			if (!state.flight_loops[i]->is_dead)
+			{
+				n_loops++;
+			}
+		}
+		return n_loops;
+	}
+
+	std::string get_log()
+	{
+		return state.log;
+	}
+
+	void clear_log()
+	{
+		state.log.clear();
+	}
+}
+
+using namespace XPHeadless;
+
+// XPLMUtilities
+
+void XPLMGetSystemPath(char* outSystemPath)
+{
+	strcpy(outSystemPath, state.cfg.xplane_path.c_str());
+}
+
+void XPLMGetPrefsPath(char* outPrefsPath)
+{
+	std::string path = state.cfg.prefs_path + "X-Plane.prf";
+	strcpy(outPrefsPath, path.c_str());
+}
+
+const char* XPLMGetDirectorySeparator(void)
+{
+	return "/";
+}
+
+char* XPLMExtractFileAndPath(char* inFullPath)
+{
+	char* sep = strrchr(inFullPath, '/');
+	if (sep == nullptr)
+	{
+		return inFullPath;
+	}
+	*sep = '\0';
+	return sep + 1;
+}
+
+void XPLMGetVersions(int* outXPlaneVersion, int* outXPLMVersion, XPLMHostApplicationID* outHostID)
+{
+	*outXPlaneVersion = state.cfg.xplane_version;
+	*outXPLMVersion = 400;
+	*outHostID = xplm_Host_XPlane;
+}
+
+void XPLMDebugString(const char* inString)
+{
+	state.log.append(inString);
+	if (state.cfg.echo_log)
+	{
+		fputs(inString, stdout);
+	}
+}
+
+// XPLMPlugin
+
+XPLMPluginID XPLMFindPluginBySignature(const char* /*inSignature*/)
+{
+	return XPLM_NO_PLUGIN_ID;
+}
+
+void XPLMSendMessageToPlugin(XPLMPluginID /*inPlugin*/, int /*inMessage*/, void* /*inParam*/) { }
+
+void XPLMEnableFeature(const char* /*inFeature*/, int /*inEnable*/) { }
+
+// XPLMProcessing
+
+float XPLMGetElapsedTime(void)
+{
+	return float(state.time);
+}
+
+int XPLMGetCycleNumber(void)
+{
+	return int(state.frame);
+}
+
+void XPLMRegisterFlightLoopCallback(XPLMFlightLoop_f inFlightLoop, float inInterval, void* inRefcon)
+{
+	flt_loop* loop = add_flight_loop(inFlightLoop, inRefcon, true);
+	schedule(loop, inInterval, true);
+}
+
+void XPLMUnregisterFlightLoopCallback(XPLMFlightLoop_f inFlightLoop, void* inRefcon)
+{
+	flt_loop* loop = find_legacy_loop(inFlightLoop, inRefcon);
+	if (loop != nullptr)
+	{
+		loop->is_dead = true;
+	}
+}
+
+void XPLMSetFlightLoopCallbackInterval(XPLMFlightLoop_f inFlightLoop, float inInterval, int inRelativeToNow, void* inRefcon)
+{
+	flt_loop* loop = find_legacy_loop(inFlightLoop, inRefcon);
+	if (loop != nullptr)
+	{
+		schedule(loop, inInterval, inRelativeToNow != 0);
+	}
+}
+
+XPLMFlightLoopID XPLMCreateFlightLoop(XPLMCreateFlightLoop_t* inParams)
+{
+	return add_flight_loop(inParams->callbackFunc, inParams->refcon, false);
+}
+
+void XPLMDestroyFlightLoop(XPLMFlightLoopID inFlightLoopID)
+{
+	flt_loop* loop = reinterpret_cast<flt_loop*>(inFlightLoopID);
+	if (loop != nullptr)
+	{
+		loop->is_dead = true;
+	}
+}
+
+void XPLMScheduleFlightLoop(XPLMFlightLoopID inFlightLoopID, float inInterval, int inRelativeToNow)
+{
+	flt_loop* loop = reinterpret_cast<flt_loop*>(inFlightLoopID);
+	if (loop != nullptr && !loop->is_dead)
+	{
+		schedule(loop, inInterval, inRelativeToNow != 0);
+	}
+}
+
+// XPLMDataAccess
+
+XPLMDataRef XPLMFindDataRef(const char* inDataRefName)
+{
+	auto it = state.data_refs.find(inDataRefName);
+	if (it != state.data_refs.end())
+	{
+		return it->second.get();
+	}
+	return nullptr;
+}
+
+int XPLMCanWriteDataRef(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	return rec != nullptr && rec->is_writable;
+}
+
+int XPLMIsDataRefGood(XPLMDataRef inDataRef)
+{
+	return get_record(inDataRef) != nullptr;
+}
+
+XPLMDataTypeID XPLMGetDataRefTypes(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr)
+	{
+		return xplmType_Unknown;
+	}
+	return rec->type;
+}
+
+int XPLMGetDatai(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_Int))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_i != nullptr ? rec->read_i(rec->read_ref) : 0;
+	}
+	return rec->ints[0];
+}
+
+void XPLMSetDatai(XPLMDataRef inDataRef, int inValue)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_Int))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_i != nullptr)
+		{
+			rec->write_i(rec->write_ref, inValue);
+		}
+		return;
+	}
+	rec->ints[0] = inValue;
+}
+
+float XPLMGetDataf(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_Float))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_f != nullptr ? rec->read_f(rec->read_ref) : 0;
+	}
+	return rec->floats[0];
+}
+
+void XPLMSetDataf(XPLMDataRef inDataRef, float inValue)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_Float))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_f != nullptr)
+		{
+			rec->write_f(rec->write_ref, inValue);
+		}
+		return;
+	}
+	rec->floats[0] = inValue;
+}
+
+double XPLMGetDatad(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_Double))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_d != nullptr ? rec->read_d(rec->read_ref) : 0;
+	}
+	return rec->dbl;
+}
+
+void XPLMSetDatad(XPLMDataRef inDataRef, double inValue)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_Double))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_d != nullptr)
+		{
+			rec->write_d(rec->write_ref, inValue);
+		}
+		return;
+	}
+	rec->dbl = inValue;
+}
+
+int XPLMGetDatavi(XPLMDataRef inDataRef, int* outValues, int inOffset, int inMax)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_IntArray))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_vi != nullptr ? rec->read_vi(rec->read_ref, outValues, inOffset, inMax) : 0;
+	}
+	return get_array(&rec->ints, outValues, inOffset, inMax);
+}
+
+void XPLMSetDatavi(XPLMDataRef inDataRef, int* inValues, int inoffset, int inCount)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_IntArray))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_vi != nullptr)
+		{
+			rec->write_vi(rec->write_ref, inValues, inoffset, inCount);
+		}
+		return;
+	}
+	set_array(&rec->ints, inValues, inoffset, inCount);
+}
+
+int XPLMGetDatavf(XPLMDataRef inDataRef, float* outValues, int inOffset, int inMax)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_FloatArray))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_vf != nullptr ? rec->read_vf(rec->read_ref, outValues, inOffset, inMax) : 0;
+	}
+	return get_array(&rec->floats, outValues, inOffset, inMax);
+}
+
+void XPLMSetDatavf(XPLMDataRef inDataRef, float* inValues, int inoffset, int inCount)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_FloatArray))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_vf != nullptr)
+		{
+			rec->write_vf(rec->write_ref, inValues, inoffset, inCount);
+		}
+		return;
+	}
+	set_array(&rec->floats, inValues, inoffset, inCount);
+}
+
+int XPLMGetDatab(XPLMDataRef inDataRef, void* outValue, int inOffset, int inMaxBytes)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !(rec->type & xplmType_Data))
+	{
+		return 0;
+	}
+	if (rec->is_accessor)
+	{
+		return rec->read_b != nullptr ? rec->read_b(rec->read_ref, outValue, inOffset, inMaxBytes) : 0;
+	}
+	return get_array(&rec->bytes, reinterpret_cast<char*>(outValue), inOffset, inMaxBytes);
+}
+
+void XPLMSetDatab(XPLMDataRef inDataRef, void* inValue, int inOffset, int inLength)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_writable || !(rec->type & xplmType_Data))
+	{
+		return;
+	}
+	if (rec->is_accessor)
+	{
+		if (rec->write_b != nullptr)
+		{
+			rec->write_b(rec->write_ref, inValue, inOffset, inLength);
+		}
+		return;
+	}
+	set_array(&rec->bytes, reinterpret_cast<char*>(inValue), inOffset, inLength);
+}
+
+XPLMDataRef XPLMRegisterDataAccessor(const char* inDataName, XPLMDataTypeID inDataType, int inIsWritable,
+	XPLMGetDatai_f inReadInt, XPLMSetDatai_f inWriteInt,
+	XPLMGetDataf_f inReadFloat, XPLMSetDataf_f inWriteFloat,
+	XPLMGetDatad_f inReadDouble, XPLMSetDatad_f inWriteDouble,
+	XPLMGetDatavi_f inReadIntArray, XPLMSetDatavi_f inWriteIntArray,
+	XPLMGetDatavf_f inReadFloatArray, XPLMSetDatavf_f inWriteFloatArray,
+	XPLMGetDatab_f inReadData, XPLMSetDatab_f inWriteData,
+	void* inReadRefcon, void* inWriteRefcon)
+{
+	if (state.data_refs.find(inDataName) != state.data_refs.end())
+	{
+		return nullptr;
+	}
+	std::unique_ptr<dr_record> rec = std::make_unique<dr_record>();
+	rec->name = inDataName;
+	rec->type = inDataType;
+	rec->is_writable = inIsWritable != 0;
+	rec->is_good = true;
+	rec->is_accessor = true;
+	rec->read_i = inReadInt;
+	rec->write_i = inWriteInt;
+	rec->read_f = inReadFloat;
+	rec->write_f = inWriteFloat;
+	rec->read_d = inReadDouble;
+	rec->write_d = inWriteDouble;
+	rec->read_vi = inReadIntArray;
+	rec->write_vi = inWriteIntArray;
+	rec->read_vf = inReadFloatArray;
+	rec->write_vf = inWriteFloatArray;
+	rec->read_b = inReadData;
+	rec->write_b = inWriteData;
+	rec->read_ref = inReadRefcon;
+	rec->write_ref = inWriteRefcon;
+	XPLMDataRef out = rec.get();
+	state.data_refs[inDataName] = std::move(rec);
+	return out;
+}
+
+void XPLMUnregisterDataAccessor(XPLMDataRef inDataRef)
+{
+	dr_record* rec = get_record(inDataRef);
+	if (rec == nullptr || !rec->is_accessor)
+	{
+		return;
+	}
+	auto it = state.data_refs.find(rec->name);
+	if (it != state.data_refs.end() && it->second.get() == rec)
+	{
+		rec->is_good = false;
+		state.dead_data_refs.push_back(std::move(it->second));
+		state.data_refs.erase(it);
+	}
+}
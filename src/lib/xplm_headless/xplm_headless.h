@@ -0,0 +1,52 @@
+/*
+	This library is a stand-in for X-plane's XPLM library.
+	It allows libxp, libnav and fmc_sys to run on plain Linux without X-plane,
+	e.g. for benchmarking and profiling. Datarefs are kept in memory and
+	flight loops are run by run_frame, which is driven by a test clock,
+	so the sim can run faster than real time.
+	All XPLM calls as well as run_frame must be made from the same thread.
+*/
+
+#pragma once
+
+#include "XPLMDataAccess.h"
+#include "XPLMProcessing.h"
+#include <string>
+#include <cstdint>
+
+
+namespace XPHeadless
+{
+	struct sim_config
+	{
+		// Must end with a separator. Nav data is looked up relative to this path,
+		// so it can point to a directory with synthetic nav data.
+		std::string xplane_path;
+		std::string prefs_path; // Directory of the preferences file. Must end with a separator.
+		int xplane_version;
+		bool echo_log; // Also write XPLMDebugString output to stdout
+	};
+
+	// init removes all datarefs and flight loops and resets the clock.
+	void init(sim_config* cfg);
+
+	// add_data_ref creates a dataref owned by the sim. n_length is ignored for
+	// scalar types. Returns nullptr if a dataref with this name already exists.
+	XPLMDataRef add_data_ref(std::string name, XPLMDataTypeID type, int n_length=1, bool is_writable=true);
+
+	// run_frame advances the clock by dt_sec and calls every flight loop that is due.
+	// Returns number of flight loops called.
+	int run_frame(float dt_sec);
+
+	void run_frames(uint64_t n_frames, float dt_sec);
+
+	double get_time();
+
+	uint64_t get_frame_count();
+
+	size_t get_n_flight_loops();
+
+	std::string get_log();
+
+	void clear_log();
+}
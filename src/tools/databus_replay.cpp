@@ -0,0 +1,272 @@
+/*
+	databus_replay replays a log written by DataBus::start_recording against
+	the headless XPLM stand-in, so that the same data bus workload can be
+	profiled outside of X-plane.
+
+	Usage: databus_replay <log> [--xplane-path <path>] [--fmc] [--budget-us <n>]
+
+	--xplane-path  X-plane root(ending with a separator) to load nav data from. Needed by --fmc.
+	--fmc          Also run the avionics and FMC threads. Their own requests are served on top of the log.
+	--budget-us    Overrides the time budget stored in the log.
+*/
+
+#include "xplm_headless.h"
+#include "fmc_sys.h"
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <algorithm>
+
+
+enum replay_constants
+{
+	N_WARMUP_FRAMES_MAX = 1000,
+	N_DRAIN_FRAMES_MAX = 1000
+};
+
+const float REPLAY_DEFAULT_DT_SEC = 0.02f;
+
+
+struct replay_stats
+{
+	uint64_t n_frames;
+	uint64_t n_extra_frames; // Frames run because a queue was full or requests were deferred
+	uint64_t n_reqs;
+	std::vector<uint32_t> cb_times_us;
+};
+
+struct custom_storage
+{
+	std::vector<double> buf; // double for alignment
+};
+
+uint32_t get_percentile(std::vector<uint32_t>* vals, double pct)
+{
+	if (vals->empty())
+	{
+		return 0;
+	}
+	std::vector<uint32_t> tmp = *vals;
+	std::sort(tmp.begin(), tmp.end());
+	size_t idx = size_t(pct / 100 * double(tmp.size() - 1));
+	return tmp[idx];
+}
+
+size_t get_item_size(int type)
+{
+	if (type & (xplmType_Double | XPDataBus::DR_TYPE_DOUBLE_ARRAY))
+	{
+		return sizeof(double);
+	}
+	else if (type & xplmType_Data)
+	{
+		return 1;
+	}
+	return sizeof(int);
+}
+
+uint32_t run_timed_frame(float dt_sec)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	XPHeadless::run_frame(dt_sec);
+	std::chrono::steady_clock::duration t = std::chrono::steady_clock::now() - start;
+	return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(t).count());
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("Usage: databus_replay <log> [--xplane-path <path>] [--fmc] [--budget-us <n>]\n");
+		return 1;
+	}
+	std::string log_path = argv[1];
+	std::string xplane_path = "./";
+	bool run_fmc = false;
+	int64_t budget_us = -1;
+	for (int i = 2; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--xplane-path" && i + 1 < argc)
+		{
+			xplane_path = argv[++i];
+		}
+		else if (arg == "--fmc")
+		{
+			run_fmc = true;
+		}
+		else if (arg == "--budget-us" && i + 1 < argc)
+		{
+			budget_us = atoll(argv[++i]);
+		}
+	}
+
+	// The whole log is read first: custom datarefs have to be known before the data bus is created.
+	XPDataBus::DataBusLogReader reader;
+	if (!reader.open(log_path))
+	{
+		printf("Failed to open %s\n", log_path.c_str());
+		return 1;
+	}
+	std::vector<XPDataBus::rec_frame> frames;
+	XPDataBus::rec_frame frame;
+	while (reader.read_frame(&frame))
+	{
+		frames.push_back(std::move(frame));
+	}
+
+	XPHeadless::sim_config cfg = { xplane_path, xplane_path, 12000, false };
+	XPHeadless::init(&cfg);
+
+	std::vector<custom_storage> storage(reader.names.size());
+	std::vector<XPDataBus::custom_data_ref_entry> custom_drs;
+	for (size_t i = 0; i < reader.names.size(); i++)
+	{
+		XPDataBus::rec_name* name = &reader.names[i];
+		if (name->is_custom)
+		{
+			size_t n_items = std::max(size_t(name->n_length), size_t(1));
+			size_t n_bytes = n_items * get_item_size(name->type);
+			storage[i].buf = std::vector<double>(n_bytes / sizeof(double) + 1, 0);
+			custom_drs.push_back({ name->name, { storage[i].buf.data(), name->type, name->n_length } });
+		}
+		else if (name->type != xplmType_Unknown)
+		{
+			XPHeadless::add_data_ref(name->name, name->type, int(name->n_length));
+		}
+	}
+
+	std::shared_ptr<XPDataBus::DataBus> databus = std::make_shared<XPDataBus::DataBus>(&custom_drs,
+		reader.hdr.max_queue_refresh);
+	databus->set_coalescing(reader.hdr.coalesce_sets != 0);
+	databus->set_time_budget(budget_us >= 0 ? uint64_t(budget_us) : reader.hdr.time_budget_us);
+	// Get latencies are only collected with metrics enabled.
+	databus->enable_metrics("Strato/replay/databus/", 0);
+
+	// Wait for the first flight loop of the data bus.
+	for (int i = 0; i < N_WARMUP_FRAMES_MAX && databus->get_stats().n_frames == 0; i++)
+	{
+		XPHeadless::run_frame(REPLAY_DEFAULT_DT_SEC);
+	}
+
+	std::shared_ptr<StratosphereAvionics::AvionicsSys> avionics;
+	std::shared_ptr<StratosphereAvionics::FMC> fmc;
+	std::thread avionics_thread, fmc_thread;
+	if (run_fmc)
+	{
+		// Same datarefs as the ones used by the plugin
+		StratosphereAvionics::fmc_in_drs fmc_in = { "Strato/777/FMC/FMC_R/REF_NAV/input_icao",
+			"Strato/777/FMC/FMC_R/clear_msg", "Strato/777/FMC/FMC_R/page", "Strato/777/FMC/FMC_R/RTE/input_route",
+			"Strato/777/FMC/FMC_R/exec", "Strato/777/FMC/FMC_R/erase", "Strato/777/FMC/FMC_R/fpl_name",
+			"Strato/777/FMC/FMC_R/fpl_load", "Strato/777/FMC/FMC_R/fpl_save" };
+		StratosphereAvionics::fmc_out_drs fmc_out = { "Strato/777/FMC/FMC_R/REF_NAV/out_icao",
+			"Strato/777/FMC/FMC_R/REF_NAV/poi_lat", "Strato/777/FMC/FMC_R/REF_NAV/poi_lon",
+			"Strato/777/FMC/FMC_R/REF_NAV/poi_elev", "Strato/777/FMC/FMC_R/REF_NAV/poi_freq",
+			"Strato/777/FMC/FMC_R/scratchpad_msg", { "Strato/777/FMC/line_1_big", "Strato/777/FMC/line_2_big",
+			"Strato/777/FMC/line_3_big", "Strato/777/FMC/line_4_big", "Strato/777/FMC/line_5_big",
+			"Strato/777/FMC/line_6_big", "Strato/777/FMC/line_7_big" } };
+		avionics = std::make_shared<StratosphereAvionics::AvionicsSys>(databus);
+		fmc = std::make_shared<StratosphereAvionics::FMC>(avionics, &fmc_in, &fmc_out);
+		avionics_thread = std::thread([avionics]() { avionics->main_loop(); });
+		fmc_thread = std::thread([fmc]() { fmc->main_loop(); });
+	}
+
+	replay_stats stats = {};
+	std::vector<uint32_t> rec_cb_times_us;
+	// Promises and buffers have to outlive the requests, so they are kept until the end.
+	std::deque<std::promise<XPDataBus::generic_val>> get_proms;
+	std::deque<std::promise<int>> range_proms;
+	std::deque<std::vector<char>> range_bufs;
+	uint64_t t_prev_us = 0;
+	std::chrono::steady_clock::time_point replay_start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		XPDataBus::rec_frame* curr = &frames[i];
+		rec_cb_times_us.push_back(curr->callback_time_us);
+		float dt_sec = REPLAY_DEFAULT_DT_SEC;
+		if (i > 0 && curr->t_us > t_prev_us)
+		{
+			dt_sec = float(curr->t_us - t_prev_us) / 1000000;
+		}
+		t_prev_us = curr->t_us;
+
+		for (size_t j = 0; j < curr->reqs.size(); j++)
+		{
+			XPDataBus::rec_req* req = &curr->reqs[j];
+			std::string name = reader.names[req->name_id].name;
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (req->kind == XPDataBus::REC_GET)
+			{
+				get_proms.emplace_back();
+				XPDataBus::get_req get = { name, XPDataBus::dr_handle{ -1 }, &get_proms.back(), req->offset, now };
+				while (!databus->get_queue.push(get))
+				{
+					stats.cb_times_us.push_back(run_timed_frame(dt_sec));
+					stats.n_extra_frames++;
+				}
+			}
+			else if (req->kind == XPDataBus::REC_SET)
+			{
+				databus->set_data(name, req->val, req->priority);
+			}
+			else
+			{
+				bool is_set = req->kind == XPDataBus::REC_RANGE_SET;
+				XPDataBus::range_req range = { name, XPDataBus::dr_handle{ -1 }, req->val_type,
+					req->offset, req->n_max, nullptr, nullptr, {}, now };
+				if (is_set)
+				{
+					range.in = req->data;
+				}
+				else
+				{
+					range_bufs.emplace_back(size_t(req->n_max) * sizeof(double));
+					range_proms.emplace_back();
+					range.out = range_bufs.back().data();
+					range.prom = &range_proms.back();
+				}
+				while (!databus->range_queue.push(range))
+				{
+					stats.cb_times_us.push_back(run_timed_frame(dt_sec));
+					stats.n_extra_frames++;
+				}
+			}
+			stats.n_reqs++;
+		}
+		stats.cb_times_us.push_back(run_timed_frame(dt_sec));
+		stats.n_frames++;
+	}
+
+	// Serve whatever has been deferred by the time budget.
+	for (int i = 0; i < N_DRAIN_FRAMES_MAX && databus->get_stats().n_deferred_last != 0; i++)
+	{
+		stats.cb_times_us.push_back(run_timed_frame(REPLAY_DEFAULT_DT_SEC));
+		stats.n_extra_frames++;
+	}
+	std::chrono::steady_clock::duration replay_time = std::chrono::steady_clock::now() - replay_start;
+
+	if (run_fmc)
+	{
+		avionics->sim_shutdown.store(true, std::memory_order_seq_cst);
+		fmc->sim_shutdown.store(true, std::memory_order_seq_cst);
+	}
+	databus->cleanup();
+	if (run_fmc)
+	{
+		fmc_thread.join();
+		avionics_thread.join();
+	}
+
+	printf("Replayed %llu requests in %llu frames(+%llu extra) in %.3f s\n",
+		(unsigned long long)stats.n_reqs, (unsigned long long)stats.n_frames,
+		(unsigned long long)stats.n_extra_frames,
+		std::chrono::duration<double>(replay_time).count());
+	printf("Flight loop time, us:   p50      p99      max\n");
+	printf("  recorded:        %8u %8u %8u\n", get_percentile(&rec_cb_times_us, 50),
+		get_percentile(&rec_cb_times_us, 99), get_percentile(&rec_cb_times_us, 100));
+	printf("  replayed:        %8u %8u %8u\n", get_percentile(&stats.cb_times_us, 50),
+		get_percentile(&stats.cb_times_us, 99), get_percentile(&stats.cb_times_us, 100));
+	printf("%s", databus->get_metrics()->get_summary().c_str());
+	return 0;
+}
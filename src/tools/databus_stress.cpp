@@ -0,0 +1,186 @@
+/*
+	databus_stress measures how the data bus holds up when several threads
+	flood it with requests. Producer threads push set requests (and optionally
+	blocking gets) as fast as they can while the main thread runs flight loops
+	against the headless XPLM stand-in. The time of every flight loop is the
+	time the sim thread spent draining the queues.
+
+	Usage: databus_stress [--producers <n>] [--requests <n>] [--per-frame <n>] [--get-every <n>] [--frame-us <n>]
+
+	--producers  Number of producer threads. Default 4.
+	--requests   Requests made by every producer. Default 500000.
+	--per-frame  Maximum number of requests served per queue per flight loop. Default 1024.
+	--get-every  Every n-th request is a blocking get. 0 means sets only. Default 0.
+	--frame-us   Wall time between the starts of two flight loops. Default 1000.
+*/
+
+#include "xplm_headless.h"
+#include "databus.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+
+enum stress_constants
+{
+	N_DEFAULT_PRODUCERS = 4,
+	N_DEFAULT_REQUESTS = 500000,
+	N_DEFAULT_PER_FRAME = 1024,
+	N_DEFAULT_FRAME_US = 1000,
+	N_WARMUP_FRAMES = 60,
+	N_DRAIN_FRAMES_MAX = 100000
+};
+
+const float STRESS_DT_SEC = 0.02f;
+const char* STRESS_DR_NAME = "Strato/stress/values";
+
+
+uint32_t get_percentile(std::vector<uint32_t>* vals, double pct)
+{
+	if (vals->empty())
+	{
+		return 0;
+	}
+	std::vector<uint32_t> tmp = *vals;
+	std::sort(tmp.begin(), tmp.end());
+	size_t idx = size_t(pct / 100 * double(tmp.size() - 1));
+	return tmp[idx];
+}
+
+uint32_t run_timed_frame(float dt_sec)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	XPHeadless::run_frame(dt_sec);
+	std::chrono::steady_clock::duration t = std::chrono::steady_clock::now() - start;
+	return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(t).count());
+}
+
+int main(int argc, char** argv)
+{
+	int n_producers = N_DEFAULT_PRODUCERS;
+	int n_requests = N_DEFAULT_REQUESTS;
+	int n_per_frame = N_DEFAULT_PER_FRAME;
+	int get_every = 0;
+	int frame_us = N_DEFAULT_FRAME_US;
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 < argc && !strcmp(argv[i], "--producers"))
+		{
+			n_producers = atoi(argv[++i]);
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--requests"))
+		{
+			n_requests = atoi(argv[++i]);
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--per-frame"))
+		{
+			n_per_frame = atoi(argv[++i]);
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--get-every"))
+		{
+			get_every = atoi(argv[++i]);
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--frame-us"))
+		{
+			frame_us = atoi(argv[++i]);
+		}
+		else
+		{
+			printf("Usage: databus_stress [--producers <n>] [--requests <n>] [--per-frame <n>] [--get-every <n>] [--frame-us <n>]\n");
+			return 1;
+		}
+	}
+	if (n_producers <= 0 || n_requests <= 0 || n_per_frame <= 0 || get_every < 0 || frame_us < 0)
+	{
+		printf("databus_stress: Counts can't be negative\n");
+		return 1;
+	}
+
+	XPHeadless::sim_config cfg = { "./", "./", 12000, false };
+	XPHeadless::init(&cfg);
+	// Every producer writes its own item, so the final values show whether anything was lost.
+	// Item 0 is left unused, since sets at offset 0 are scalar sets.
+	XPHeadless::add_data_ref(STRESS_DR_NAME, xplmType_IntArray, n_producers + 1);
+	std::vector<XPDataBus::custom_data_ref_entry> custom_drs;
+	std::shared_ptr<XPDataBus::DataBus> databus = std::make_shared<XPDataBus::DataBus>(&custom_drs, uint64_t(n_per_frame));
+	XPDataBus::dr_handle handle = databus->register_data_ref(STRESS_DR_NAME);
+	// The data bus schedules its first flight loop a second after it's created.
+	XPHeadless::run_frames(N_WARMUP_FRAMES, STRESS_DT_SEC);
+
+	std::atomic<int> n_running{ n_producers };
+	std::vector<std::thread> producers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < n_producers; i++)
+	{
+		producers.emplace_back([&, i]()
+			{
+				for (int j = 1; j <= n_requests; j++)
+				{
+					if (get_every && j % get_every == 0)
+					{
+						databus->get_datai(handle, i + 1);
+					}
+					else
+					{
+						databus->set_datai(handle, j, i + 1);
+					}
+				}
+				n_running.fetch_sub(1, std::memory_order_release);
+			});
+	}
+
+	std::vector<uint32_t> cb_times_us;
+	std::chrono::steady_clock::time_point next_frame = start;
+	while (n_running.load(std::memory_order_acquire))
+	{
+		next_frame += std::chrono::microseconds(frame_us);
+		cb_times_us.push_back(run_timed_frame(STRESS_DT_SEC));
+		std::this_thread::sleep_until(next_frame);
+	}
+	std::chrono::steady_clock::duration push_time = std::chrono::steady_clock::now() - start;
+	for (int i = 0; i < N_DRAIN_FRAMES_MAX && databus->get_stats().n_deferred_last != 0; i++)
+	{
+		cb_times_us.push_back(run_timed_frame(STRESS_DT_SEC));
+	}
+	// One more frame serves whatever was pushed after the last one started.
+	cb_times_us.push_back(run_timed_frame(STRESS_DT_SEC));
+	std::chrono::steady_clock::duration total_time = std::chrono::steady_clock::now() - start;
+	for (size_t i = 0; i < producers.size(); i++)
+	{
+		producers[i].join();
+	}
+
+	int n_lost = 0;
+	XPLMDataRef ref = XPLMFindDataRef(STRESS_DR_NAME);
+	std::vector<int> vals(n_producers);
+	XPLMGetDatavi(ref, vals.data(), 1, n_producers);
+	for (int i = 0; i < n_producers; i++)
+	{
+		// The last request that was a set
+		int expected = n_requests;
+		while (get_every && expected > 0 && expected % get_every == 0)
+		{
+			expected--;
+		}
+		n_lost += vals[i] != expected;
+	}
+	databus->cleanup();
+
+	double push_sec = std::chrono::duration<double>(push_time).count();
+	uint64_t n_total = uint64_t(n_producers) * uint64_t(n_requests);
+	printf("%d producers x %d requests, %d served per queue per frame, a frame every %d us\n",
+		n_producers, n_requests, n_per_frame, frame_us);
+	printf("Pushed in %.3f s(%.0f requests/s), served in %.3f s over %zu frames\n",
+		push_sec, double(n_total) / push_sec, std::chrono::duration<double>(total_time).count(), cb_times_us.size());
+	printf("Flight loop time, us:   p50      p99      max\n");
+	printf("                   %8u %8u %8u\n", get_percentile(&cb_times_us, 50),
+		get_percentile(&cb_times_us, 99), get_percentile(&cb_times_us, 100));
+	if (n_lost)
+	{
+		printf("%d producers don't have their last value written\n", n_lost);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+	shm_latency measures how long it takes for a dataref update to reach
+	a process that reads the shared memory export. A headless sim writes
+	the current time into a 24 byte custom dataref every frame and a forked
+	reader process polls it with ShmReader. The reader reports the time from
+	the write to the first read that sees it.
+
+	Usage: shm_latency [--updates <n>] [--frame-us <n>]
+
+	--updates   Number of updates the reader has to see. Default 20000.
+	--frame-us  Sleep between two frames of the sim. Default 50.
+*/
+
+#include "xplm_headless.h"
+#include "databus.h"
+#include "shm_reader.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+enum shm_latency_constants
+{
+	N_DEFAULT_UPDATES = 20000,
+	N_DEFAULT_FRAME_US = 50,
+	N_WARMUP_FRAMES = 60,
+	N_LINE_LENGTH = 24
+};
+
+const float SHM_LATENCY_DT_SEC = 0.0001f;
+const char* SHM_LATENCY_SEGMENT = "/Strato_shm_latency";
+const char* SHM_LATENCY_DR_NAME = "Strato/777/FMC/line_1_big";
+
+char line[N_LINE_LENGTH];
+
+
+uint64_t get_time_ns()
+{
+	std::chrono::steady_clock::duration t = std::chrono::steady_clock::now().time_since_epoch();
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t).count());
+}
+
+int run_reader(int n_updates)
+{
+	XPShm::ShmReader reader;
+	while (!reader.open(SHM_LATENCY_SEGMENT))
+	{
+		usleep(100);
+	}
+	int idx = reader.find(SHM_LATENCY_DR_NAME);
+	if (idx < 0)
+	{
+		printf("shm_latency: %s isn't in the segment\n", SHM_LATENCY_DR_NAME);
+		return 1;
+	}
+
+	std::vector<uint64_t> latencies_ns;
+	latencies_ns.reserve(size_t(n_updates));
+	uint64_t last_t = 0;
+	int n_failed = 0;
+	char buf[N_LINE_LENGTH];
+	while (int(latencies_ns.size()) < n_updates)
+	{
+		if (reader.read(idx, buf, N_LINE_LENGTH) < 0)
+		{
+			n_failed++;
+			continue;
+		}
+		uint64_t t;
+		memcpy(&t, buf, sizeof(t));
+		if (t != 0 && t != last_t)
+		{
+			latencies_ns.push_back(get_time_ns() - t);
+			last_t = t;
+		}
+	}
+	std::sort(latencies_ns.begin(), latencies_ns.end());
+	printf("%d updates, %d failed reads\n", n_updates, n_failed);
+	printf("Latency, us:   p50      p99      max\n");
+	printf("          %8.1f %8.1f %8.1f\n", double(latencies_ns[latencies_ns.size() / 2]) / 1000,
+		double(latencies_ns[latencies_ns.size() * 99 / 100]) / 1000, double(latencies_ns.back()) / 1000);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int n_updates = N_DEFAULT_UPDATES;
+	int frame_us = N_DEFAULT_FRAME_US;
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 < argc && !strcmp(argv[i], "--updates"))
+		{
+			n_updates = atoi(argv[++i]);
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--frame-us"))
+		{
+			frame_us = atoi(argv[++i]);
+		}
+		else
+		{
+			printf("Usage: shm_latency [--updates <n>] [--frame-us <n>]\n");
+			return 1;
+		}
+	}
+	if (n_updates <= 0 || frame_us < 0)
+	{
+		printf("shm_latency: --updates has to be positive\n");
+		return 1;
+	}
+
+	XPHeadless::sim_config cfg = { "./", "./", 12000, false };
+	XPHeadless::init(&cfg);
+	std::vector<XPDataBus::custom_data_ref_entry> custom_drs = {
+		{ SHM_LATENCY_DR_NAME, { line, xplmType_Data, N_LINE_LENGTH } }
+	};
+	XPDataBus::DataBus databus(&custom_drs, 100);
+	std::vector<std::string> exported = { SHM_LATENCY_DR_NAME };
+	if (!databus.export_data_refs(SHM_LATENCY_SEGMENT, &exported))
+	{
+		printf("shm_latency: Failed to create %s\n", SHM_LATENCY_SEGMENT);
+		return 1;
+	}
+	// The data bus schedules its first flight loop a second after it's created.
+	XPHeadless::run_frames(N_WARMUP_FRAMES, 0.02f);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		printf("shm_latency: fork failed\n");
+		return 1;
+	}
+	if (pid == 0)
+	{
+		int ret = run_reader(n_updates);
+		fflush(stdout);
+		_exit(ret);
+	}
+
+	int n_frames = 0;
+	int status = 0;
+	while (waitpid(pid, &status, WNOHANG) == 0)
+	{
+		// The time is written right before the frame that exports it.
+		uint64_t t = get_time_ns();
+		memcpy(line, &t, sizeof(t));
+		XPHeadless::run_frame(SHM_LATENCY_DT_SEC);
+		n_frames++;
+		if (frame_us)
+		{
+			usleep(useconds_t(frame_us));
+		}
+	}
+	databus.cleanup();
+	printf("Sim ran %d frames\n", n_frames);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}